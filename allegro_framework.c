@@ -5,26 +5,312 @@
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+
+#if defined(_WIN32)
+    #define WIN32_LEAN_AND_MEAN
+    #define NOGDI               // wingdi.h declares a Rectangle function
+    #define NOMINMAX
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+    #define THREAD_LOCAL __declspec(thread)
+#else
+    #define THREAD_LOCAL _Thread_local
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+    #define FRAMEWORK_SSE2
+    #include <emmintrin.h>
+#endif
+
+#if defined(FRAMEWORK_SSE2) && (defined(__GNUC__) || defined(__clang__))
+    #define FRAMEWORK_AVX2
+    #define TARGET_AVX2 __attribute__((target("avx2")))
+    #include <immintrin.h>
+#endif
 
 static ALLEGRO_EVENT_QUEUE *event_queue = NULL;
 static ALLEGRO_DISPLAY *display = NULL;
 static ALLEGRO_TIMER *timer = NULL;
 static ALLEGRO_FILE *logfile = NULL;
+static bool has_opened_logfile = false;     // reopened for appending after destroy_framework() closed it
+static THREAD_LOCAL bool is_init_thread = false;    // the thread that registered destroy_framework() with atexit()
 static ALLEGRO_FONT *default_font = NULL;
 
 static bool is_done = false;
+static bool is_headless_mode = false;
+static bool should_render_headless = false;
+static ALLEGRO_BITMAP *headless_bitmap = NULL;
+static int headless_width = 0, headless_height = 0;
+static int headless_tick_limit = 0;
+static int tick_count = 0;
 static bool is_paused = false;
 static bool should_alt_tab_pause = true;
+static bool should_use_vsync = false;
+static double logic_rate = 60.0;
+static int max_catch_up_ticks = 5;
+static int render_mode = RENDER_ON_TICK;
+static int simd_level = -1;
+
+#define LOG_QUEUE_SIZE 2048
+#define LOG_FLUSH_INTERVAL 0.005
+
+typedef struct {
+    atomic_size_t sequence;
+    int level;
+    double time;
+    char text[LOG_RECORD_SIZE];
+} LogRecord;
+
+static LogRecord log_records[LOG_QUEUE_SIZE];
+static atomic_size_t log_push_pos = 0;
+static atomic_size_t log_pop_pos = 0;
+static atomic_int log_dropped_count = 0;
+static atomic_flag log_write_lock = ATOMIC_FLAG_INIT;
+static atomic_int log_thread_state = 0;     // 0 not started, 1 running, 2 stopped
+static ALLEGRO_THREAD *log_thread = NULL;
+
+#define MAX_ASSET_THREADS 4
+
+struct Asset {
+    int type;
+    int font_size;
+    char *filename;
+    uint32_t hash;
+    int ref_count;
+    bool is_released;           // released while a loader thread still had it
+    atomic_int state;
+    ALLEGRO_BITMAP *bitmap;
+    ALLEGRO_FONT *font;
+    void *data;
+    size_t size;
+    Asset *next_in_bucket;
+    Asset *next_in_queue;
+};
+
+static Asset **asset_buckets = NULL;
+static int num_asset_buckets = 0;
+static int num_assets = 0;
+static int num_assets_requested = 0;
+static int num_assets_finished = 0;
+static bool has_unconverted_fonts = false;
+
+// guards the queues and asset_threads_should_stop
+static ALLEGRO_MUTEX *asset_mutex = NULL;
+static ALLEGRO_COND *asset_cond = NULL;
+static Asset *pending_assets_head = NULL, *pending_assets_tail = NULL;
+static Asset *finished_assets_head = NULL, *finished_assets_tail = NULL;
+static bool asset_threads_should_stop = false;
+static ALLEGRO_THREAD *asset_threads[MAX_ASSET_THREADS];
+static int num_asset_threads = 0;
+
+#define MAX_JOB_THREADS 64
+#define JOB_QUEUE_SIZE 4096     // per thread, power of two
+#define JOB_SPIN_COUNT 256
+
+typedef struct Job Job;
+
+struct Job {
+    JobProc proc;
+    void *data;
+    JobCounter *counter;
+    Job *next_waiting;
+    atomic_bool is_used;
+};
+
+// Set in JobCounter.count while waiting is being changed.
+#define JOB_COUNTER_LOCK (1 << 30)
+
+struct JobCounter {
+    atomic_int count;           // unfinished jobs, the lock bit is kept in here so the
+                                // last job can unlock and finish with a single write
+    Job *waiting;               // jobs to queue once count reaches zero
+};
+
+// Chase-Lev deque, the owner pushes and pops at the bottom, thieves steal from the top.
+typedef struct {
+    atomic_llong top;
+    atomic_llong bottom;
+    _Atomic(Job *) jobs[JOB_QUEUE_SIZE];
+    Job pool[JOB_QUEUE_SIZE];
+    int next_pool_index;
+} JobQueue;
+
+static JobQueue *job_queues = NULL;
+static ALLEGRO_THREAD *job_threads[MAX_JOB_THREADS];
+static int num_job_threads = 0;     // including the main thread
+static atomic_int num_queued_jobs = 0;
+static atomic_int num_sleeping_job_threads = 0;
+static atomic_bool job_threads_should_stop = false;
+static ALLEGRO_MUTEX *job_mutex = NULL;
+static ALLEGRO_COND *job_cond = NULL;
+static THREAD_LOCAL int job_thread_index = -1;
+
+#define ARENA_ALIGNMENT 16
+#define FRAME_ARENA_SIZE (256 * 1024)
+
+typedef struct ArenaBlock ArenaBlock;
+
+struct ArenaBlock {
+    ArenaBlock *next;       // the previous, full block
+    size_t size;
+    size_t used;
+    size_t padding;         // keeps data aligned
+    char data[];
+};
+
+struct Arena {
+    ArenaBlock *block;
+    size_t used_in_full_blocks;
+    size_t high_water;
+};
+
+struct Pool {
+    char *objects;
+    size_t object_size;
+    int capacity;
+    int used;
+    int high_water;
+    void *free_list;
+};
+
+static Arena *frame_arenas[2] = { NULL, NULL };
+static int frame_arena_index = 0;
+
+#define PROFILE_TRACE_SIZE 8192
+#define PROFILE_GRAPH_FRAMES 240
+
+typedef struct {
+    int scope;
+    double start;
+    double duration;
+} ProfileEvent;
+
+static bool is_profiler_enabled = false;
+static bool should_show_profiler_overlay = false;
+static char profile_scope_names[MAX_PROFILE_SCOPES][32] = { "frame", "events", "update", "render", "flip" };
+static int num_profile_scopes = NUM_BUILTIN_PROFILE_SCOPES;
+static double profile_scope_start[MAX_PROFILE_SCOPES];
+static double profile_scope_total[MAX_PROFILE_SCOPES];
+static float profile_history[PROFILE_HISTORY_SIZE][MAX_PROFILE_SCOPES];
+static int profile_frame_count = 0;
+static double profile_frame_start = 0.0;
+static double profile_epoch = 0.0;
+static ProfileEvent profile_trace[PROFILE_TRACE_SIZE];
+static int profile_trace_count = 0;
+
+static _Atomic uint64_t random_seed = 0;
+static atomic_int random_generation = 1;
+static _Atomic uint64_t next_random_stream = MAX_JOB_THREADS;
+static THREAD_LOCAL RandomGenerator thread_random;
+static THREAD_LOCAL int thread_random_generation = 0;
+static THREAD_LOCAL uint64_t thread_random_stream = 0;
+static THREAD_LOCAL bool thread_random_has_stream = false;
+
+// input state is kept in bitsets, so clearing and scanning it is a few word operations
+#define KEY_WORDS ((ALLEGRO_KEY_MAX + 31) / 32)
+
+static uint32_t keys[KEY_WORDS] = { 0 };
+static uint32_t keys_pressed[KEY_WORDS] = { 0 };
+static uint32_t keys_released[KEY_WORDS] = { 0 };
+static int key_lock_modifiers = 0;
+
+static const InputEvent *playback_events = NULL;
+static int num_playback_events = 0;
+static int playback_index = 0;
+
+// kinds of entries in an input recording
+enum {
+    INPUT_ENTRY_KEY_DOWN,
+    INPUT_ENTRY_KEY_UP,
+    INPUT_ENTRY_MOUSE_AXES,
+    INPUT_ENTRY_MOUSE_BUTTON_DOWN,
+    INPUT_ENTRY_MOUSE_BUTTON_UP,
+    INPUT_ENTRY_KEYFRAME,
+    INPUT_ENTRY_END
+};
 
-static bool keys[ALLEGRO_KEY_MAX] = { false };
-static bool keys_pressed[ALLEGRO_KEY_MAX] = { false };
-static bool keys_released[ALLEGRO_KEY_MAX] = { false };
+#define INPUT_REPLAY_MAGIC "AFIR"
+#define INPUT_REPLAY_VERSION 1
+
+typedef struct {
+    int tick;
+    int offset;
+} InputKeyframe;
+
+struct InputReplay {
+    uint8_t *data;
+    int size;
+    int length;
+    InputKeyframe *keyframes;
+    int num_keyframes;
+};
+
+typedef struct {
+    int offset;
+    int tick;
+    int mouse_x, mouse_y;
+} InputStreamCursor;
+
+static bool is_recording = false;
+static uint8_t *recording = NULL;
+static int recording_size = 0;
+static int recording_capacity = 0;
+static int recording_start_tick = 0;
+static InputStreamCursor recording_cursor;
+
+static InputReplay *replay = NULL;
+static InputStreamCursor replay_cursor;
+static int replay_tick_base = 0;
 
 static int mouse_x = 0, mouse_y = 0;
 static int mouse_old_x = 0, mouse_old_y = 0;
-static bool mouse_buttons[MAX_MOUSE_BUTTONS] = { false };
-static bool mouse_buttons_pressed[MAX_MOUSE_BUTTONS] = { false };
-static bool mouse_buttons_released[MAX_MOUSE_BUTTONS] = { false };
+static uint32_t mouse_buttons = 0;
+static uint32_t mouse_buttons_pressed = 0;
+static uint32_t mouse_buttons_released = 0;
+
+typedef struct {
+    ALLEGRO_EVENT_TYPE type;
+    EventCallback callback;     // NULL once removed while callbacks were running
+    void *data;
+    int id;
+} EventCallbackEntry;
+
+static EventCallbackEntry *event_callbacks = NULL;
+static int num_event_callbacks = 0;
+static int event_callbacks_capacity = 0;
+static int next_event_callback_id = 1;
+static int event_dispatch_depth = 0;
+static bool has_removed_event_callbacks = false;
+
+// Posted events use the same queue design as log records, with the main thread as the only consumer.
+typedef struct {
+    atomic_size_t sequence;
+    ALLEGRO_EVENT event;
+} PostedEvent;
+
+static PostedEvent posted_events[POSTED_EVENT_QUEUE_SIZE];
+static atomic_size_t posted_push_pos = 0;
+static size_t posted_pop_pos = 0;
+
+typedef struct {
+    void *data;         // NULL once removed
+    size_t size;
+    Arena *arena;       // or an arena instead of data
+} SnapshotRegion;
+
+static SnapshotRegion *snapshot_regions = NULL;
+static int num_snapshot_regions = 0, snapshot_regions_capacity = 0;
+static uint32_t snapshot_layout_hash = 0;
 
 ALLEGRO_COLOR black_color;
 ALLEGRO_COLOR white_color;
@@ -46,442 +332,8431 @@ ALLEGRO_COLOR navy_color;
 ALLEGRO_COLOR teal_color;
 ALLEGRO_COLOR brown_color;
 
-void write_logfile(int log_level, const char *format, ...)
+typedef struct {
+    ALLEGRO_BITMAP *texture;    // root bitmap, NULL for rectangles
+    float u1, v1, u2, v2;       // texture coordinates in pixels of the root bitmap
+    float x1, y1, x2, y2;
+    ALLEGRO_COLOR color;
+    int layer;
+    int order;
+} Sprite;
+
+static Sprite *sprites = NULL;
+static int num_sprites = 0;
+static int sprites_capacity = 0;
+static ALLEGRO_VERTEX *sprite_vertices = NULL;
+static int sprite_vertices_capacity = 0;
+static int *sprite_indices = NULL;
+static int sprite_indices_capacity = 0;
+static SpriteBatchStats sprite_stats;
+
+typedef struct TextCacheEntry {
+    uint32_t hash;
+    const ALLEGRO_FONT *font;
+    int page;                   // -1 for text without pixels, e.g. spaces
+    int x, y, w, h;             // region of the page
+    int offset_x, offset_y;     // of the region from the position the text is drawn at
+    int width;                  // al_get_text_width()
+    struct TextCacheEntry *next_in_bucket;
+    char text[];
+} TextCacheEntry;
+
+typedef struct {
+    ALLEGRO_BITMAP *bitmap;
+    int x, y, shelf_height;
+    int last_used_frame;        // pages drawn from this frame can't be cleared yet
+} TextPage;
+
+#define TEXT_CACHE_BUCKETS 1024
+
+static TextCacheEntry *text_buckets[TEXT_CACHE_BUCKETS];
+static TextPage text_pages[TEXT_CACHE_PAGES];
+static int current_text_page = 0;
+static int text_frame = 0;
+static int num_cached_strings = 0;
+static TextCacheStats text_cache_stats, text_frame_stats;
+
+static bool is_camera_active = false;
+static Rectangle camera_bounds;             // of the active camera, for culling
+
+static int count_bits(uint32_t bits)
 {
-    char buffer[4096];
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcount(bits);
+#else
+    int count = 0;
+    for (; bits; bits &= bits - 1)
+        count++;
+    return count;
+#endif
+}
 
-    if (!logfile) {
-        logfile = al_fopen("log.txt", "w");
+static int lowest_bit_index(uint32_t bits)
+{
+    assert(bits != 0);
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(bits);
+#else
+    int index = 0;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+static int detect_simd_level()
+{
+#if defined(FRAMEWORK_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return SIMD_AVX2;
+    }
+#endif
+#if defined(FRAMEWORK_SSE2)
+    return SIMD_SSE2;
+#else
+    return SIMD_NONE;
+#endif
+}
+
+int get_simd_level()
+{
+    if (simd_level < 0) {
+        simd_level = detect_simd_level();
+    }
+    return simd_level;
+}
+
+void set_simd_level(int level)
+{
+    int supported = detect_simd_level();
+    simd_level = level < SIMD_NONE ? SIMD_NONE : (level > supported ? supported : level);
+}
+
+/*
+    Makes sure a heap array has room for at least needed elements.
+    Grows by doubling so repeated calls settle on a fixed size.
+ */
+static void* grow_array(void *array, int *capacity, int needed, size_t element_size)
+{
+    if (needed <= *capacity) {
+        return array;
     }
 
-    if (log_level == LOG_WARNING) {
-        al_fputs(logfile, "WARNING: ");
+    int new_capacity = *capacity > 0 ? *capacity : 16;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
     }
-    else if (log_level == LOG_ERROR) {
-        al_fputs(logfile, "ERROR: ");
+
+    array = realloc(array, new_capacity * element_size);
+    if (!array) {
+        log_error("Failed to allocate %d elements of size %d", new_capacity, (int)element_size);
     }
+    *capacity = new_capacity;
+    return array;
+}
 
+// Formats into a buffer and writes it, al_fputs() being the only output function we rely on.
+static void file_printf(ALLEGRO_FILE *file, const char *format, ...)
+{
+    char buffer[1024];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, sizeof(buffer), format, args);
     va_end(args);
+    al_fputs(file, buffer);
+}
 
-    al_fputs(logfile, buffer);
-    al_fputs(logfile, "\n");
+/*
+    Log records are passed through a bounded lock free queue (Dmitry Vyukov's
+    design). Each slot stores its sequence number minus its index, so the zero
+    initialized array is already a valid empty queue.
+ */
+static LogRecord* log_begin_push(size_t *pos_out)
+{
+    size_t pos = atomic_load_explicit(&log_push_pos, memory_order_relaxed);
+    for (;;) {
+        size_t index = pos & (LOG_QUEUE_SIZE - 1);
+        LogRecord *record = &log_records[index];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire) + index;
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
 
-    if (log_level == LOG_ERROR) {
-        exit(1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_push_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return record;
+            }
+        }
+        else if (diff < 0) {
+            return NULL;
+        }
+        else {
+            pos = atomic_load_explicit(&log_push_pos, memory_order_relaxed);
+        }
     }
 }
 
-void init_framework(const char *title, int window_width, int window_height, bool fullscreen)
+static void log_end_push(LogRecord *record, size_t pos)
 {
-    if (!al_init()) {
-        log_error("Failed to initialize allegro");
+    size_t index = pos & (LOG_QUEUE_SIZE - 1);
+    atomic_store_explicit(&record->sequence, pos + 1 - index, memory_order_release);
+}
+
+static LogRecord* log_begin_pop(size_t *pos_out)
+{
+    size_t pos = atomic_load_explicit(&log_pop_pos, memory_order_relaxed);
+    for (;;) {
+        size_t index = pos & (LOG_QUEUE_SIZE - 1);
+        LogRecord *record = &log_records[index];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire) + index;
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_pop_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *pos_out = pos;
+                return record;
+            }
+        }
+        else if (diff < 0) {
+            return NULL;
+        }
+        else {
+            pos = atomic_load_explicit(&log_pop_pos, memory_order_relaxed);
+        }
     }
+}
 
-	atexit(destroy_framework);
+static void log_end_pop(LogRecord *record, size_t pos)
+{
+    size_t index = pos & (LOG_QUEUE_SIZE - 1);
+    atomic_store_explicit(&record->sequence, pos + LOG_QUEUE_SIZE - index, memory_order_release);
+}
 
-	al_set_exe_name(title);
-	al_set_app_name(title);
+// Opens the log file on the first write, so nothing creates or truncates it until there is something to log.
+static bool open_logfile()
+{
+    if (!logfile) {
+        logfile = al_fopen("log.txt", has_opened_logfile ? "a" : "w");
+        has_opened_logfile = has_opened_logfile || logfile;
+    }
+    return logfile != NULL;
+}
 
-	// set correct resource directory
-	ALLEGRO_PATH *path = al_get_standard_path(ALLEGRO_RESOURCES_PATH);
-	al_change_directory(al_path_cstr(path, '/'));
-	al_destroy_path(path);
+// Writes everything in the queue with as few writes as possible. Returns false if the queue was empty.
+static bool log_write_queued()
+{
+    static char batch[16384];
+    static const char *prefixes[] = { "", "WARNING: ", "ERROR: " };
+    int length = 0;
+    bool has_written = false;
 
-    if (!al_install_keyboard()) {
-        log_error("Failed to install keyboard");
+    while (atomic_flag_test_and_set_explicit(&log_write_lock, memory_order_acquire)) {
+        // another thread is writing, it is done soon
     }
 
-    if (!al_install_mouse()) {
-        log_error("Failed to install mouse");
+    int dropped = atomic_exchange(&log_dropped_count, 0);
+    if (dropped > 0) {
+        length += snprintf(batch, sizeof(batch), "WARNING: %d log messages dropped, the log queue was full\n", dropped);
     }
 
-    if (!al_init_primitives_addon()) {
-        log_error("Failed to init primitives addon");
+    size_t pos;
+    LogRecord *record;
+    while ((record = log_begin_pop(&pos)) != NULL) {
+        if (length + LOG_RECORD_SIZE + 32 > (int)sizeof(batch)) {
+            if (open_logfile()) {
+                al_fwrite(logfile, batch, length);
+            }
+            length = 0;
+        }
+        length += snprintf(batch + length, sizeof(batch) - length, "[%10.4f] %s%s\n",
+                           record->time, prefixes[record->level], record->text);
+        log_end_pop(record, pos);
+        has_written = true;
     }
 
-    if (!al_init_image_addon()) {
-        log_error("Failed to init image addon");
+    if (length > 0 && open_logfile()) {
+        al_fwrite(logfile, batch, length);
+        al_fflush(logfile);
     }
 
-    al_init_font_addon();
-    default_font = al_create_builtin_font();
-    if (!default_font) {
-        log_error("Failed to create builtin font");
+    atomic_flag_clear_explicit(&log_write_lock, memory_order_release);
+    return has_written;
+}
+
+static void* log_thread_proc(ALLEGRO_THREAD *thread, void *arg)
+{
+    while (!al_get_thread_should_stop(thread)) {
+        if (!log_write_queued()) {
+            al_rest(LOG_FLUSH_INTERVAL);
+        }
     }
+    return NULL;
+}
 
-    event_queue = al_create_event_queue();
-    if (!event_queue) {
-        log_error("Failed to create event queue");
+static void start_log_thread()
+{
+    int expected = 0;
+    if (!atomic_compare_exchange_strong(&log_thread_state, &expected, 1)) {
+        return;
     }
 
-    if (fullscreen) {
-        al_set_new_display_flags(ALLEGRO_FULLSCREEN_WINDOW);
+    log_thread = al_create_thread(log_thread_proc, NULL);
+    if (log_thread) {
+        al_start_thread(log_thread);
     }
     else {
-        al_set_new_display_flags(ALLEGRO_WINDOWED);
+        atomic_store(&log_thread_state, 2);
     }
+}
 
-    display = al_create_display(window_width, window_height);
-    if (!display) {
-        log_error("Failed to create display @ %dx%d", window_width, window_height);
+static void stop_log_thread()
+{
+    if (log_thread) {
+        al_set_thread_should_stop(log_thread);
+        al_join_thread(log_thread, NULL);
+        al_destroy_thread(log_thread);
+        log_thread = NULL;
     }
-    al_set_window_title(display, title);
+    // don't start a new one while shutting down
+    atomic_store(&log_thread_state, 2);
+}
 
-    timer = al_create_timer(1.0 / 60);
-    if (!timer) {
-        log_error("Failed to create timer");
+void write_logfile(int log_level, const char *format, ...)
+{
+    assert(log_level >= LOG_MESSAGE && log_level <= LOG_ERROR);
+
+    bool is_system_installed = al_is_system_installed();
+    if (is_system_installed && atomic_load_explicit(&log_thread_state, memory_order_relaxed) == 0) {
+        start_log_thread();
     }
 
-    al_register_event_source(event_queue, al_get_keyboard_event_source());
-    al_register_event_source(event_queue, al_get_mouse_event_source());
-    al_register_event_source(event_queue, al_get_display_event_source(display));
-    al_register_event_source(event_queue, al_get_timer_event_source(timer));
+    size_t pos;
+    LogRecord *record = log_begin_push(&pos);
+    while (!record && log_level == LOG_ERROR) {
+        // make room, errors are never dropped
+        flush_logfile();
+        record = log_begin_push(&pos);
+    }
 
-    srand(time(NULL));
+    if (!record) {
+        atomic_fetch_add(&log_dropped_count, 1);
+        return;
+    }
 
-	// initialize default colors
-    black_color       = al_map_rgb(0, 0, 0);
-    white_color       = al_map_rgb(255, 255, 255);
-	dark_grey_color   = al_map_rgb(64, 64, 64);
-	grey_color        = al_map_rgb(128, 128, 128);
-	light_grey_color  = al_map_rgb(192, 192, 192);
-	red_color         = al_map_rgb(255, 0, 0);
-	green_color       = al_map_rgb(0, 255, 0);
-	dark_green_color  = al_map_rgb(0, 100, 0);
-	blue_color        = al_map_rgb(0, 0, 255);
-	yellow_color      = al_map_rgb(255, 255, 0);
-	cyan_color        = al_map_rgb(0, 255, 255);
-	magenta_color     = al_map_rgb(255, 0, 255);
-	maroon_color      = al_map_rgb(128, 0, 0);
-	purple_color      = al_map_rgb(128, 0, 128);
-	lime_color        = al_map_rgb(191, 255, 0);
-	olive_color       = al_map_rgb(128, 128, 0);
-	navy_color        = al_map_rgb(0, 0, 128);
-	teal_color        = al_map_rgb(0, 128, 128);
-	brown_color       = al_map_rgb(101, 55, 0);
+    va_list args;
+    va_start(args, format);
+    vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+
+    record->level = log_level;
+    record->time = is_system_installed ? al_get_time() : 0.0;
+    log_end_push(record, pos);
+
+    // without the background thread every message is written right away
+    if (log_level == LOG_ERROR || atomic_load_explicit(&log_thread_state, memory_order_relaxed) != 1) {
+        flush_logfile();
+    }
+
+    // destroy_framework() joins the framework's threads, which deadlocks when one of them is the caller
+    if (log_level == LOG_ERROR) {
+        if (!is_init_thread) {
+            _Exit(1);
+        }
+        exit(1);
+    }
 }
 
-void destroy_framework()
+void flush_logfile()
 {
-    if (default_font) {
-        al_destroy_font(default_font);
-        default_font = NULL;
+    while (log_write_queued()) {
+        // keep going until the queue is empty
     }
+}
 
-    if (timer) {
-        al_destroy_timer(timer);
-        timer = NULL;
+static void push_asset(Asset **head, Asset **tail, Asset *asset)
+{
+    asset->next_in_queue = NULL;
+    if (*tail) {
+        (*tail)->next_in_queue = asset;
     }
+    else {
+        *head = asset;
+    }
+    *tail = asset;
+}
 
-    if (display) {
-        al_destroy_display(display);
-        display = NULL;
+static void load_asset(Asset *asset)
+{
+    switch (asset->type) {
+        case ASSET_BITMAP:
+            asset->bitmap = al_load_bitmap(asset->filename);
+            break;
+
+        case ASSET_FONT:
+            asset->font = al_load_font(asset->filename, asset->font_size, 0);
+            break;
+
+        case ASSET_FILE: {
+            ALLEGRO_FILE *file = al_fopen(asset->filename, "rb");
+            if (!file) {
+                break;
+            }
+            int64_t size = al_fsize(file);
+            if (size >= 0) {
+                asset->data = malloc((size_t)size + 1);
+            }
+            if (asset->data && al_fread(file, asset->data, (size_t)size) == (size_t)size) {
+                ((char *)asset->data)[size] = '\0';
+                asset->size = (size_t)size;
+            }
+            else {
+                free(asset->data);
+                asset->data = NULL;
+            }
+            al_fclose(file);
+            break;
+        }
     }
+}
 
-    if (event_queue) {
-        al_destroy_event_queue(event_queue);
-        event_queue = NULL;
+static void* asset_thread_proc(ALLEGRO_THREAD *thread, void *arg)
+{
+    // decode into memory, there is no display on this thread
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP | ALLEGRO_CONVERT_BITMAP);
+
+    al_lock_mutex(asset_mutex);
+    while (true) {
+        while (!pending_assets_head && !asset_threads_should_stop) {
+            al_wait_cond(asset_cond, asset_mutex);
+        }
+        if (asset_threads_should_stop) {
+            break;
+        }
+
+        Asset *asset = pending_assets_head;
+        pending_assets_head = asset->next_in_queue;
+        if (!pending_assets_head) {
+            pending_assets_tail = NULL;
+        }
+
+        al_unlock_mutex(asset_mutex);
+        load_asset(asset);
+        al_lock_mutex(asset_mutex);
+
+        push_asset(&finished_assets_head, &finished_assets_tail, asset);
     }
+    al_unlock_mutex(asset_mutex);
+    return NULL;
+}
 
-    if (logfile) {
-        al_fclose(logfile);
-        logfile = NULL;
+static void start_asset_threads()
+{
+    asset_mutex = al_create_mutex();
+    asset_cond = al_create_cond();
+    if (!asset_mutex || !asset_cond) {
+        log_error("Failed to create asset loader");
     }
+
+    int count = al_get_cpu_count() - 1;
+    count = count < 1 ? 1 : count > MAX_ASSET_THREADS ? MAX_ASSET_THREADS : count;
+    for (int i = 0; i < count; i++) {
+        asset_threads[i] = al_create_thread(asset_thread_proc, NULL);
+        if (!asset_threads[i]) {
+            log_error("Failed to create asset loader thread");
+        }
+        al_start_thread(asset_threads[i]);
+    }
+    num_asset_threads = count;
 }
 
-void run_game_loop(void (*update_proc)(), void (*render_proc)())
+static void destroy_asset(Asset *asset)
 {
-    bool should_redraw = true;
-    al_start_timer(timer);
+    if (asset->bitmap) {
+        al_destroy_bitmap(asset->bitmap);
+    }
+    if (asset->font) {
+        al_destroy_font(asset->font);
+    }
+    free(asset->data);
+    free(asset->filename);
+    free(asset);
+}
 
-    while (!is_done) {
-        ALLEGRO_EVENT event;
-        al_wait_for_event(event_queue, &event);
+static void destroy_assets()
+{
+    if (asset_mutex) {
+        al_lock_mutex(asset_mutex);
+        asset_threads_should_stop = true;
+        al_broadcast_cond(asset_cond);
+        al_unlock_mutex(asset_mutex);
+
+        for (int i = 0; i < num_asset_threads; i++) {
+            al_join_thread(asset_threads[i], NULL);
+            al_destroy_thread(asset_threads[i]);
+        }
+        al_destroy_cond(asset_cond);
+        al_destroy_mutex(asset_mutex);
+    }
+
+    // released assets are only referenced by the queues, the others by the cache
+    for (Asset *asset = pending_assets_head, *next; asset; asset = next) {
+        next = asset->next_in_queue;
+        if (asset->is_released) {
+            destroy_asset(asset);
+        }
+    }
+    for (Asset *asset = finished_assets_head, *next; asset; asset = next) {
+        next = asset->next_in_queue;
+        if (asset->is_released) {
+            destroy_asset(asset);
+        }
+    }
+    for (int i = 0; i < num_asset_buckets; i++) {
+        for (Asset *asset = asset_buckets[i], *next; asset; asset = next) {
+            next = asset->next_in_bucket;
+            destroy_asset(asset);
+        }
+    }
+    free(asset_buckets);
+
+    asset_buckets = NULL;
+    num_asset_buckets = num_assets = 0;
+    num_assets_requested = num_assets_finished = 0;
+    has_unconverted_fonts = false;
+    asset_mutex = NULL;
+    asset_cond = NULL;
+    pending_assets_head = pending_assets_tail = NULL;
+    finished_assets_head = finished_assets_tail = NULL;
+    asset_threads_should_stop = false;
+    num_asset_threads = 0;
+}
+
+static void spin_pause()
+{
+#ifdef FRAMEWORK_SSE2
+    _mm_pause();
+#endif
+}
+
+static bool push_job(JobQueue *queue, Job *job)
+{
+    long long bottom = atomic_load_explicit(&queue->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&queue->top, memory_order_acquire);
+    if (bottom - top >= JOB_QUEUE_SIZE) {
+        return false;
+    }
+
+    atomic_store_explicit(&queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)], job, memory_order_relaxed);
+    atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+static Job* pop_job(JobQueue *queue)
+{
+    long long bottom = atomic_load_explicit(&queue->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&queue->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&queue->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    Job *job = atomic_load_explicit(&queue->jobs[bottom & (JOB_QUEUE_SIZE - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // last job, race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&queue->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            job = NULL;
+        }
+        atomic_store_explicit(&queue->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+static Job* steal_job(JobQueue *queue)
+{
+    long long top = atomic_load_explicit(&queue->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom = atomic_load_explicit(&queue->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    Job *job = atomic_load_explicit(&queue->jobs[top & (JOB_QUEUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&queue->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return job;
+}
+
+// Takes a job from the calling thread's queue or steals one from another thread.
+static Job* find_job()
+{
+    int index = job_thread_index;
+    if (index < 0 || !job_queues) {
+        return NULL;
+    }
+
+    Job *job = pop_job(&job_queues[index]);
+    for (int i = 1; !job && i < num_job_threads; i++) {
+        job = steal_job(&job_queues[(index + i) % num_job_threads]);
+    }
+
+    if (job) {
+        atomic_fetch_sub(&num_queued_jobs, 1);
+    }
+    return job;
+}
+
+// Queues a job on the calling thread, returns false if it has to be run right away instead.
+static bool queue_job(Job *job)
+{
+    if (job_thread_index < 0 || !job_queues || !push_job(&job_queues[job_thread_index], job)) {
+        return false;
+    }
+
+    atomic_fetch_add(&num_queued_jobs, 1);
+    if (atomic_load(&num_sleeping_job_threads) > 0) {
+        al_lock_mutex(job_mutex);
+        al_signal_cond(job_cond);
+        al_unlock_mutex(job_mutex);
+    }
+    return true;
+}
+
+static void execute_job(Job *job)
+{
+    JobProc proc = job->proc;
+    void *data = job->data;
+    JobCounter *counter = job->counter;
+    atomic_store_explicit(&job->is_used, false, memory_order_release);
+
+    proc(data);
+
+    if (!counter) {
+        return;
+    }
+
+    int count = atomic_load(&counter->count);
+    while (true) {
+        if (count == (JOB_COUNTER_LOCK | 1)) {
+            // a job is being added to the waiting list, it has to see the count at 1 or 0
+            spin_pause();
+            count = atomic_load(&counter->count);
+        }
+        else if (count == 1) {
+            if (atomic_compare_exchange_weak(&counter->count, &count, JOB_COUNTER_LOCK)) {
+                break;
+            }
+        }
+        else if (atomic_compare_exchange_weak(&counter->count, &count, count - 1)) {
+            return;
+        }
+    }
+
+    // last job, the counter may be destroyed as soon as the lock bit is cleared
+    Job *waiting = counter->waiting;
+    counter->waiting = NULL;
+    atomic_fetch_and(&counter->count, ~JOB_COUNTER_LOCK);
+
+    while (waiting) {
+        Job *next = waiting->next_waiting;
+        if (!queue_job(waiting)) {
+            execute_job(waiting);
+        }
+        waiting = next;
+    }
+}
+
+static Job* allocate_job(JobProc proc, void *data, JobCounter *counter)
+{
+    static THREAD_LOCAL Job inline_job;
+    Job *job = &inline_job;
+
+    if (job_thread_index >= 0 && job_queues) {
+        // slots are reused round robin, help out until the next one is free
+        JobQueue *queue = &job_queues[job_thread_index];
+        while (true) {
+            job = &queue->pool[queue->next_pool_index];
+            if (!atomic_load_explicit(&job->is_used, memory_order_acquire)) {
+                break;
+            }
+            Job *other = find_job();
+            if (other) {
+                execute_job(other);
+            }
+            else {
+                spin_pause();
+            }
+        }
+        queue->next_pool_index = (queue->next_pool_index + 1) & (JOB_QUEUE_SIZE - 1);
+    }
+
+    job->proc = proc;
+    job->data = data;
+    job->counter = counter;
+    job->next_waiting = NULL;
+    atomic_store_explicit(&job->is_used, true, memory_order_relaxed);
+    if (counter) {
+        atomic_fetch_add(&counter->count, 1);
+    }
+    return job;
+}
+
+static void* job_thread_proc(ALLEGRO_THREAD *thread, void *arg)
+{
+    job_thread_index = (int)(intptr_t)arg;
+    set_random_stream(job_thread_index);
+
+    while (!atomic_load(&job_threads_should_stop)) {
+        Job *job = NULL;
+        for (int i = 0; !job && i < JOB_SPIN_COUNT; i++) {
+            job = find_job();
+            if (!job) {
+                spin_pause();
+            }
+        }
+
+        if (job) {
+            execute_job(job);
+            continue;
+        }
+
+        al_lock_mutex(job_mutex);
+        atomic_fetch_add(&num_sleeping_job_threads, 1);
+        if (atomic_load(&num_queued_jobs) == 0 && !atomic_load(&job_threads_should_stop)) {
+            al_wait_cond(job_cond, job_mutex);
+        }
+        atomic_fetch_sub(&num_sleeping_job_threads, 1);
+        al_unlock_mutex(job_mutex);
+    }
+    return NULL;
+}
+
+static void start_job_threads()
+{
+    int count = al_get_cpu_count();
+    num_job_threads = count < 1 ? 1 : count > MAX_JOB_THREADS ? MAX_JOB_THREADS : count;
+
+    job_queues = calloc(num_job_threads, sizeof(JobQueue));
+    job_mutex = al_create_mutex();
+    job_cond = al_create_cond();
+    if (!job_queues || !job_mutex || !job_cond) {
+        log_error("Failed to create job system");
+    }
+    job_thread_index = 0;
+
+    for (int i = 1; i < num_job_threads; i++) {
+        job_threads[i] = al_create_thread(job_thread_proc, (void *)(intptr_t)i);
+        if (!job_threads[i]) {
+            log_error("Failed to create job thread");
+        }
+        al_start_thread(job_threads[i]);
+    }
+}
+
+static void stop_job_threads()
+{
+    if (!job_queues) {
+        return;
+    }
+
+    // finish whatever is still queued before the threads go away
+    for (Job *job; (job = find_job()); ) {
+        execute_job(job);
+    }
+
+    al_lock_mutex(job_mutex);
+    atomic_store(&job_threads_should_stop, true);
+    al_broadcast_cond(job_cond);
+    al_unlock_mutex(job_mutex);
+
+    for (int i = 1; i < num_job_threads; i++) {
+        al_join_thread(job_threads[i], NULL);
+        al_destroy_thread(job_threads[i]);
+    }
+    al_destroy_cond(job_cond);
+    al_destroy_mutex(job_mutex);
+    free(job_queues);
+
+    job_queues = NULL;
+    job_mutex = NULL;
+    job_cond = NULL;
+    num_job_threads = 0;
+    job_thread_index = -1;
+    atomic_store(&job_threads_should_stop, false);
+}
+
+JobCounter* create_job_counter()
+{
+    JobCounter *counter = calloc(1, sizeof(JobCounter));
+    if (!counter) {
+        log_error("Failed to create job counter");
+    }
+    atomic_init(&counter->count, 0);
+    return counter;
+}
+
+void destroy_job_counter(JobCounter *counter)
+{
+    assert(atomic_load(&counter->count) == 0);
+    free(counter);
+}
+
+void run_job(JobProc proc, void *data, JobCounter *counter)
+{
+    Job *job = allocate_job(proc, data, counter);
+    if (!queue_job(job)) {
+        execute_job(job);
+    }
+}
+
+void run_job_after(JobCounter *dependency, JobProc proc, void *data, JobCounter *counter)
+{
+    // other threads can't hold on to jobs, they wait and run it themselves
+    if (job_thread_index < 0 || !job_queues) {
+        wait_for_job_counter(dependency);
+        run_job(proc, data, counter);
+        return;
+    }
+
+    Job *job = allocate_job(proc, data, counter);
+
+    // the last job of the dependency waits for the lock, so it either sees
+    // this job in the list or we see the count at zero
+    bool is_waiting = false;
+    int count = atomic_load(&dependency->count);
+    while (count != 0) {
+        if (count & JOB_COUNTER_LOCK) {
+            spin_pause();
+            count = atomic_load(&dependency->count);
+        }
+        else if (atomic_compare_exchange_weak(&dependency->count, &count, count | JOB_COUNTER_LOCK)) {
+            job->next_waiting = dependency->waiting;
+            dependency->waiting = job;
+            atomic_fetch_and(&dependency->count, ~JOB_COUNTER_LOCK);
+            is_waiting = true;
+            break;
+        }
+    }
+
+    if (!is_waiting && !queue_job(job)) {
+        execute_job(job);
+    }
+}
+
+bool is_job_counter_done(JobCounter *counter)
+{
+    return atomic_load(&counter->count) == 0;
+}
+
+void wait_for_job_counter(JobCounter *counter)
+{
+    while (atomic_load(&counter->count) != 0) {
+        Job *job = find_job();
+        if (job) {
+            execute_job(job);
+        }
+        else {
+            spin_pause();
+        }
+    }
+}
+
+typedef struct {
+    void (*proc)(int begin, int end, void *data);
+    void *data;
+    int count;
+    int batch_size;
+    atomic_int next;
+} ParallelFor;
+
+static void parallel_for_job(void *data)
+{
+    ParallelFor *parallel_for = data;
+    while (true) {
+        int begin = atomic_fetch_add(&parallel_for->next, parallel_for->batch_size);
+        if (begin >= parallel_for->count) {
+            break;
+        }
+        int end = begin + parallel_for->batch_size;
+        parallel_for->proc(begin, end < parallel_for->count ? end : parallel_for->count, parallel_for->data);
+    }
+}
+
+void parallel_for(int count, int batch_size, void (*proc)(int begin, int end, void *data), void *data)
+{
+    if (count <= 0) {
+        return;
+    }
+
+    int num_threads = num_job_threads > 0 && job_thread_index >= 0 ? num_job_threads : 1;
+    if (batch_size <= 0) {
+        batch_size = count / (num_threads * 4);
+        batch_size = batch_size < 1 ? 1 : batch_size;
+    }
+
+    // batches are handed out from a shared index, so only one job per thread is needed
+    ParallelFor parallel_for;
+    parallel_for.proc = proc;
+    parallel_for.data = data;
+    parallel_for.count = count;
+    parallel_for.batch_size = batch_size;
+    atomic_init(&parallel_for.next, 0);
+
+    int num_batches = (count + batch_size - 1) / batch_size;
+    int num_jobs = num_batches < num_threads ? num_batches : num_threads;
+
+    JobCounter counter;
+    atomic_init(&counter.count, 0);
+    counter.waiting = NULL;
+
+    for (int i = 1; i < num_jobs; i++) {
+        run_job(parallel_for_job, &parallel_for, &counter);
+    }
+    parallel_for_job(&parallel_for);
+    wait_for_job_counter(&counter);
+}
+
+int get_job_thread_count()
+{
+    return num_job_threads > 0 ? num_job_threads : 1;
+}
+
+int get_job_thread_index()
+{
+    return job_thread_index;
+}
+
+static ArenaBlock* create_arena_block(size_t size, ArenaBlock *next)
+{
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (!block) {
+        log_error("Failed to allocate arena block of %d bytes", (int)size);
+    }
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+Arena* create_arena(size_t size)
+{
+    Arena *arena = calloc(1, sizeof(Arena));
+    if (!arena) {
+        log_error("Failed to create arena");
+    }
+    arena->block = create_arena_block(size > 0 ? size : ARENA_ALIGNMENT, NULL);
+    return arena;
+}
+
+void destroy_arena(Arena *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    for (ArenaBlock *block = arena->block, *next; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+    free(arena);
+}
+
+void* arena_alloc(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    ArenaBlock *block = arena->block;
+    if (block->used + size > block->size) {
+        // grow geometrically so a burst doesn't chain lots of small blocks
+        size_t block_size = block->size * 2 > size ? block->size * 2 : size;
+        arena->used_in_full_blocks += block->used;
+        block = arena->block = create_arena_block(block_size, block);
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+
+    size_t used = arena->used_in_full_blocks + block->used;
+    if (used > arena->high_water) {
+        arena->high_water = used;
+    }
+    return memory;
+}
+
+static char* arena_vprintf(Arena *arena, const char *format, va_list args)
+{
+    va_list length_args;
+    va_copy(length_args, args);
+    int length = vsnprintf(NULL, 0, format, length_args);
+    va_end(length_args);
+
+    char *text = arena_alloc(arena, length + 1);
+    vsnprintf(text, length + 1, format, args);
+    return text;
+}
+
+char* arena_printf(Arena *arena, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *text = arena_vprintf(arena, format, args);
+    va_end(args);
+    return text;
+}
+
+void arena_reset(Arena *arena)
+{
+    ArenaBlock *block = arena->block;
+    if (block->next) {
+        // merge the chain into one block that fits everything that was used
+        size_t size = 0;
+        for (ArenaBlock *b = block, *next; b; b = next) {
+            next = b->next;
+            size += b->size;
+            free(b);
+        }
+        block = arena->block = create_arena_block(size, NULL);
+    }
+
+    block->used = 0;
+    arena->used_in_full_blocks = 0;
+}
+
+ArenaStats get_arena_stats(Arena *arena)
+{
+    ArenaStats stats = { 0 };
+    for (ArenaBlock *block = arena->block; block; block = block->next) {
+        stats.capacity += block->size;
+        stats.num_blocks++;
+    }
+    stats.used = arena->used_in_full_blocks + arena->block->used;
+    stats.high_water = arena->high_water;
+    return stats;
+}
+
+// Switches to the other frame arena, called by the game loops at the start of every tick.
+static void swap_frame_arenas()
+{
+    frame_arena_index ^= 1;
+    if (frame_arenas[frame_arena_index]) {
+        arena_reset(frame_arenas[frame_arena_index]);
+    }
+}
+
+Arena* get_frame_arena()
+{
+    if (!frame_arenas[frame_arena_index]) {
+        frame_arenas[frame_arena_index] = create_arena(FRAME_ARENA_SIZE);
+    }
+    return frame_arenas[frame_arena_index];
+}
+
+void* frame_alloc(size_t size)
+{
+    return arena_alloc(get_frame_arena(), size);
+}
+
+char* frame_printf(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *text = arena_vprintf(get_frame_arena(), format, args);
+    va_end(args);
+    return text;
+}
+
+Pool* create_pool(size_t object_size, int capacity)
+{
+    assert(capacity > 0);
+
+    Pool *pool = calloc(1, sizeof(Pool));
+    if (!pool) {
+        log_error("Failed to create pool");
+    }
+
+    // free objects store the next free object in their first bytes
+    object_size = object_size < sizeof(void *) ? sizeof(void *) : object_size;
+    pool->object_size = (object_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    pool->capacity = capacity;
+    pool->objects = malloc(pool->object_size * capacity);
+    if (!pool->objects) {
+        log_error("Failed to allocate pool of %d objects", capacity);
+    }
+
+    for (int i = capacity - 1; i >= 0; i--) {
+        void *object = pool->objects + pool->object_size * i;
+        *(void **)object = pool->free_list;
+        pool->free_list = object;
+    }
+    return pool;
+}
+
+void destroy_pool(Pool *pool)
+{
+    if (!pool) {
+        return;
+    }
+
+    free(pool->objects);
+    free(pool);
+}
+
+void* pool_alloc(Pool *pool)
+{
+    void *object = pool->free_list;
+    if (!object) {
+        return NULL;
+    }
+
+    pool->free_list = *(void **)object;
+    if (++pool->used > pool->high_water) {
+        pool->high_water = pool->used;
+    }
+    return object;
+}
+
+void pool_free(Pool *pool, void *object)
+{
+    assert((char *)object >= pool->objects && (char *)object < pool->objects + pool->object_size * pool->capacity);
+
+    *(void **)object = pool->free_list;
+    pool->free_list = object;
+    pool->used--;
+}
+
+PoolStats get_pool_stats(Pool *pool)
+{
+    PoolStats stats = { pool->used, pool->capacity, pool->high_water };
+    return stats;
+}
+
+static void init_default_colors()
+{
+    black_color       = al_map_rgb(0, 0, 0);
+    white_color       = al_map_rgb(255, 255, 255);
+	dark_grey_color   = al_map_rgb(64, 64, 64);
+	grey_color        = al_map_rgb(128, 128, 128);
+	light_grey_color  = al_map_rgb(192, 192, 192);
+	red_color         = al_map_rgb(255, 0, 0);
+	green_color       = al_map_rgb(0, 255, 0);
+	dark_green_color  = al_map_rgb(0, 100, 0);
+	blue_color        = al_map_rgb(0, 0, 255);
+	yellow_color      = al_map_rgb(255, 255, 0);
+	cyan_color        = al_map_rgb(0, 255, 255);
+	magenta_color     = al_map_rgb(255, 0, 255);
+	maroon_color      = al_map_rgb(128, 0, 0);
+	purple_color      = al_map_rgb(128, 0, 128);
+	lime_color        = al_map_rgb(191, 255, 0);
+	olive_color       = al_map_rgb(128, 128, 0);
+	navy_color        = al_map_rgb(0, 0, 128);
+	teal_color        = al_map_rgb(0, 128, 128);
+	brown_color       = al_map_rgb(101, 55, 0);
+}
+
+// Initialization shared by init_framework() and init_framework_headless().
+static void init_common(const char *title)
+{
+    if (!al_init()) {
+        log_error("Failed to initialize allegro");
+    }
+
+	atexit(destroy_framework);
+	is_init_thread = true;
+
+	al_set_exe_name(title);
+	al_set_app_name(title);
+
+	// set correct resource directory
+	ALLEGRO_PATH *path = al_get_standard_path(ALLEGRO_RESOURCES_PATH);
+	al_change_directory(al_path_cstr(path, '/'));
+	al_destroy_path(path);
+
+    if (!al_init_primitives_addon()) {
+        log_error("Failed to init primitives addon");
+    }
+
+    if (!al_init_image_addon()) {
+        log_error("Failed to init image addon");
+    }
+
+    al_init_font_addon();
+
+    event_queue = al_create_event_queue();
+    if (!event_queue) {
+        log_error("Failed to create event queue");
+    }
+
+    start_job_threads();
+}
+
+static void init_default_font()
+{
+    default_font = al_create_builtin_font();
+    if (!default_font) {
+        log_error("Failed to create builtin font");
+    }
+}
+
+void init_framework(const char *title, int window_width, int window_height, bool fullscreen)
+{
+    init_common(title);
+
+    if (!al_install_keyboard()) {
+        log_error("Failed to install keyboard");
+    }
+
+    if (!al_install_mouse()) {
+        log_error("Failed to install mouse");
+    }
+
+    init_default_font();
+
+    if (fullscreen) {
+        al_set_new_display_flags(ALLEGRO_FULLSCREEN_WINDOW);
+    }
+    else {
+        al_set_new_display_flags(ALLEGRO_WINDOWED);
+    }
+
+    if (should_use_vsync) {
+        al_set_new_display_option(ALLEGRO_VSYNC, 1, ALLEGRO_SUGGEST);
+    }
+
+    display = al_create_display(window_width, window_height);
+    if (!display) {
+        log_error("Failed to create display @ %dx%d", window_width, window_height);
+    }
+    al_set_window_title(display, title);
+
+    timer = al_create_timer(1.0 / 60);
+    if (!timer) {
+        log_error("Failed to create timer");
+    }
+
+    al_register_event_source(event_queue, al_get_keyboard_event_source());
+    al_register_event_source(event_queue, al_get_mouse_event_source());
+    al_register_event_source(event_queue, al_get_display_event_source(display));
+    al_register_event_source(event_queue, al_get_timer_event_source(timer));
+
+    seed_random(time(NULL));
+    init_default_colors();
+}
+
+void init_framework_headless(int width, int height, bool should_render)
+{
+    init_common("headless");
+
+    // without a display every bitmap has to be a memory bitmap
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+    init_default_font();
+
+    is_headless_mode = true;
+    headless_width = width;
+    headless_height = height;
+    should_render_headless = should_render;
+
+    if (should_render) {
+        headless_bitmap = al_create_bitmap(width, height);
+        if (!headless_bitmap) {
+            log_error("Failed to create headless bitmap @ %dx%d", width, height);
+        }
+    }
+
+    seed_random(0);
+    init_default_colors();
+}
+
+void destroy_framework()
+{
+    stop_job_threads();
+    destroy_assets();
+
+    for (int i = 0; i < 2; i++) {
+        destroy_arena(frame_arenas[i]);
+        frame_arenas[i] = NULL;
+    }
+
+    if (default_font) {
+        al_destroy_font(default_font);
+        default_font = NULL;
+    }
+
+    if (timer) {
+        al_destroy_timer(timer);
+        timer = NULL;
+    }
+
+    if (display) {
+        al_destroy_display(display);
+        display = NULL;
+    }
+
+    if (headless_bitmap) {
+        al_destroy_bitmap(headless_bitmap);
+        headless_bitmap = NULL;
+    }
+
+    if (event_queue) {
+        al_destroy_event_queue(event_queue);
+        event_queue = NULL;
+    }
+
+    clear_text_cache();
+
+    free(event_callbacks);
+    event_callbacks = NULL;
+    num_event_callbacks = event_callbacks_capacity = 0;
+
+    free(snapshot_regions);
+    snapshot_regions = NULL;
+    num_snapshot_regions = snapshot_regions_capacity = 0;
+
+    free(sprites);
+    free(sprite_vertices);
+    free(sprite_indices);
+    sprites = NULL;
+    sprite_vertices = NULL;
+    sprite_indices = NULL;
+    num_sprites = sprites_capacity = sprite_vertices_capacity = sprite_indices_capacity = 0;
+
+    stop_log_thread();
+    flush_logfile();
+    if (logfile) {
+        al_fclose(logfile);
+        logfile = NULL;
+    }
+}
+
+static void record_byte(uint8_t value)
+{
+    if (recording_size == recording_capacity) {
+        recording = grow_array(recording, &recording_capacity, recording_size + 1, 1);
+    }
+    recording[recording_size++] = value;
+}
+
+static void record_varint(uint32_t value)
+{
+    while (value >= 0x80) {
+        record_byte((uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    record_byte((uint8_t)value);
+}
+
+static uint32_t zigzag_encode(int value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)-(value < 0);
+}
+
+static int zigzag_decode(uint32_t value)
+{
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+// Every entry starts with the number of ticks since the previous entry and its kind.
+static void record_entry(int kind)
+{
+    int tick = tick_count - recording_start_tick;
+    record_varint(tick - recording_cursor.tick);
+    record_byte((uint8_t)kind);
+    recording_cursor.tick = tick;
+}
+
+static void record_keyframe()
+{
+    record_entry(INPUT_ENTRY_KEYFRAME);
+    record_varint(zigzag_encode(mouse_x));
+    record_varint(zigzag_encode(mouse_y));
+    recording_cursor.mouse_x = mouse_x;
+    recording_cursor.mouse_y = mouse_y;
+
+    record_varint(mouse_buttons);
+
+    int num_keys = 0;
+    for (int word = 0; word < KEY_WORDS; word++) {
+        num_keys += count_bits(keys[word]);
+    }
+    record_varint(num_keys);
+    for (int word = 0; word < KEY_WORDS; word++) {
+        for (uint32_t bits = keys[word]; bits; bits &= bits - 1) {
+            record_varint(word * 32 + lowest_bit_index(bits));
+        }
+    }
+}
+
+static void record_input_event(const ALLEGRO_EVENT *event)
+{
+    switch (event->type) {
+        case ALLEGRO_EVENT_KEY_DOWN:
+        case ALLEGRO_EVENT_KEY_UP:
+            record_entry(event->type == ALLEGRO_EVENT_KEY_DOWN ? INPUT_ENTRY_KEY_DOWN : INPUT_ENTRY_KEY_UP);
+            record_varint(event->keyboard.keycode);
+            break;
+
+        case ALLEGRO_EVENT_MOUSE_AXES:
+            record_entry(INPUT_ENTRY_MOUSE_AXES);
+            record_varint(zigzag_encode(event->mouse.x - recording_cursor.mouse_x));
+            record_varint(zigzag_encode(event->mouse.y - recording_cursor.mouse_y));
+            recording_cursor.mouse_x = event->mouse.x;
+            recording_cursor.mouse_y = event->mouse.y;
+            break;
+
+        case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
+        case ALLEGRO_EVENT_MOUSE_BUTTON_UP:
+            record_entry(event->type == ALLEGRO_EVENT_MOUSE_BUTTON_DOWN ? INPUT_ENTRY_MOUSE_BUTTON_DOWN : INPUT_ENTRY_MOUSE_BUTTON_UP);
+            record_varint(event->mouse.button);
+            break;
+    }
+}
+
+static inline bool is_valid_keycode(int keycode)
+{
+    return keycode >= 0 && keycode < ALLEGRO_KEY_MAX;
+}
+
+static inline bool test_bit(const uint32_t *bits, int index)
+{
+    return (bits[index >> 5] >> (index & 31)) & 1;
+}
+
+static inline void set_bit(uint32_t *bits, int index)
+{
+    bits[index >> 5] |= 1u << (index & 31);
+}
+
+static inline void clear_bit(uint32_t *bits, int index)
+{
+    bits[index >> 5] &= ~(1u << (index & 31));
+}
+
+static bool is_any_bit_set(const uint32_t *bits, int num_words)
+{
+    uint32_t any = 0;
+    for (int word = 0; word < num_words; word++) {
+        any |= bits[word];
+    }
+    return any != 0;
+}
+
+static int get_set_bits(const uint32_t *bits, int num_words, int *out_indices, int max_indices)
+{
+    int count = 0;
+    for (int word = 0; word < num_words; word++) {
+        for (uint32_t b = bits[word]; b && count < max_indices; b &= b - 1) {
+            out_indices[count++] = word * 32 + lowest_bit_index(b);
+        }
+    }
+    return count;
+}
+
+static void clear_input_state()
+{
+    memset(keys_pressed, 0, sizeof(keys_pressed));
+    memset(keys_released, 0, sizeof(keys_released));
+    mouse_buttons_pressed = 0;
+    mouse_buttons_released = 0;
+    mouse_old_x = mouse_x;
+    mouse_old_y = mouse_y;
+}
+
+// Drops the callbacks removed while events were being dispatched.
+static void compact_event_callbacks()
+{
+    int count = 0;
+    for (int i = 0; i < num_event_callbacks; i++) {
+        if (event_callbacks[i].callback) {
+            event_callbacks[count++] = event_callbacks[i];
+        }
+    }
+    num_event_callbacks = count;
+    has_removed_event_callbacks = false;
+}
+
+// Calls the callbacks registered for the type of the event.
+static void dispatch_event(const ALLEGRO_EVENT *event)
+{
+    // callbacks added while dispatching wait for the next event
+    int count = num_event_callbacks;
+    event_dispatch_depth++;
+    for (int i = 0; i < count; i++) {
+        EventCallbackEntry *entry = &event_callbacks[i];
+        if (entry->type == event->type && entry->callback) {
+            entry->callback(event, entry->data);
+        }
+    }
+
+    if (--event_dispatch_depth == 0 && has_removed_event_callbacks) {
+        compact_event_callbacks();
+    }
+}
+
+// Updates input and window state, shared by both game loops.
+static void handle_event(ALLEGRO_EVENT *event)
+{
+    if (is_recording) {
+        record_input_event(event);
+    }
+
+    switch (event->type) {
+        case ALLEGRO_EVENT_KEY_DOWN:
+            if (is_valid_keycode(event->keyboard.keycode)) {
+                set_bit(keys, event->keyboard.keycode);
+                set_bit(keys_pressed, event->keyboard.keycode);
+            }
+            break;
+
+        case ALLEGRO_EVENT_KEY_UP:
+            if (is_valid_keycode(event->keyboard.keycode)) {
+                clear_bit(keys, event->keyboard.keycode);
+                set_bit(keys_released, event->keyboard.keycode);
+            }
+            break;
+
+        case ALLEGRO_EVENT_KEY_CHAR:
+            key_lock_modifiers = event->keyboard.modifiers & (ALLEGRO_KEYMOD_CAPSLOCK | ALLEGRO_KEYMOD_NUMLOCK | ALLEGRO_KEYMOD_SCROLLLOCK);
+
+            // handle alt-tab
+            if (display && (event->keyboard.modifiers & ALLEGRO_KEYMOD_ALT) &&
+                 event->keyboard.keycode == ALLEGRO_KEY_ENTER) {
+                al_set_display_flag(display, ALLEGRO_FULLSCREEN_WINDOW, !(al_get_display_flags(display) & ALLEGRO_FULLSCREEN_WINDOW));
+            }
+            break;
+
+        case ALLEGRO_EVENT_MOUSE_AXES:
+            mouse_x = event->mouse.x;
+            mouse_y = event->mouse.y;
+            break;
+
+        // allegro numbers mouse buttons from 1
+        case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
+            if (event->mouse.button >= 1 && event->mouse.button <= MAX_MOUSE_BUTTONS) {
+                mouse_buttons |= 1u << (event->mouse.button - 1);
+                mouse_buttons_pressed |= 1u << (event->mouse.button - 1);
+            }
+            break;
+
+        case ALLEGRO_EVENT_MOUSE_BUTTON_UP:
+            if (event->mouse.button >= 1 && event->mouse.button <= MAX_MOUSE_BUTTONS) {
+                mouse_buttons &= ~(1u << (event->mouse.button - 1));
+                mouse_buttons_released |= 1u << (event->mouse.button - 1);
+            }
+            break;
+
+        case ALLEGRO_EVENT_DISPLAY_CLOSE:
+            is_done = true;
+            break;
+
+        case ALLEGRO_EVENT_DISPLAY_SWITCH_OUT:
+            if (should_alt_tab_pause) {
+                is_paused = true;
+            }
+            break;
+
+        case ALLEGRO_EVENT_DISPLAY_SWITCH_IN:
+            if (should_alt_tab_pause) {
+                is_paused = false;
+            }
+            break;
+    }
+
+    if (num_event_callbacks > 0) {
+        dispatch_event(event);
+    }
+}
+
+/*
+    Handles all pending events, merging runs of mouse moves so a burst of
+    them costs one event. Returns the number of timer events, which are left
+    to the game loop.
+ */
+static int handle_pending_events()
+{
+    ALLEGRO_EVENT event, mouse_move;
+    bool has_mouse_move = false;
+    int num_timer_events = 0;
+
+    while (al_get_next_event(event_queue, &event)) {
+        if (event.type == ALLEGRO_EVENT_MOUSE_AXES) {
+            if (has_mouse_move) {
+                event.mouse.dx += mouse_move.mouse.dx;
+                event.mouse.dy += mouse_move.mouse.dy;
+                event.mouse.dz += mouse_move.mouse.dz;
+                event.mouse.dw += mouse_move.mouse.dw;
+            }
+            mouse_move = event;
+            has_mouse_move = true;
+            continue;
+        }
+
+        // keep the order of the move and whatever came after it
+        if (has_mouse_move) {
+            handle_event(&mouse_move);
+            has_mouse_move = false;
+        }
+
+        if (event.type == ALLEGRO_EVENT_TIMER) {
+            num_timer_events++;
+        }
+        else {
+            handle_event(&event);
+        }
+    }
+
+    if (has_mouse_move) {
+        handle_event(&mouse_move);
+    }
+    return num_timer_events;
+}
+
+// Passes the events posted by other threads to the callbacks.
+static void handle_posted_events()
+{
+    for (;;) {
+        size_t index = posted_pop_pos & (POSTED_EVENT_QUEUE_SIZE - 1);
+        PostedEvent *posted = &posted_events[index];
+        size_t sequence = atomic_load_explicit(&posted->sequence, memory_order_acquire) + index;
+        if (sequence != posted_pop_pos + 1) {
+            return;
+        }
+
+        ALLEGRO_EVENT event = posted->event;
+        atomic_store_explicit(&posted->sequence, posted_pop_pos + POSTED_EVENT_QUEUE_SIZE - index, memory_order_release);
+        posted_pop_pos++;
+        dispatch_event(&event);
+    }
+}
+
+int add_event_callback(ALLEGRO_EVENT_TYPE type, EventCallback callback, void *data)
+{
+    assert(callback);
+
+    event_callbacks = grow_array(event_callbacks, &event_callbacks_capacity, num_event_callbacks + 1, sizeof(EventCallbackEntry));
+    EventCallbackEntry *entry = &event_callbacks[num_event_callbacks++];
+    entry->type = type;
+    entry->callback = callback;
+    entry->data = data;
+    entry->id = next_event_callback_id++;
+    return entry->id;
+}
+
+void remove_event_callback(int id)
+{
+    for (int i = 0; i < num_event_callbacks; i++) {
+        if (event_callbacks[i].id == id) {
+            event_callbacks[i].callback = NULL;
+            has_removed_event_callbacks = true;
+        }
+    }
+
+    if (event_dispatch_depth == 0 && has_removed_event_callbacks) {
+        compact_event_callbacks();
+    }
+}
+
+bool post_user_event(ALLEGRO_EVENT_TYPE type, intptr_t data1, intptr_t data2, intptr_t data3, intptr_t data4)
+{
+    size_t pos = atomic_load_explicit(&posted_push_pos, memory_order_relaxed);
+    for (;;) {
+        size_t index = pos & (POSTED_EVENT_QUEUE_SIZE - 1);
+        PostedEvent *posted = &posted_events[index];
+        size_t sequence = atomic_load_explicit(&posted->sequence, memory_order_acquire) + index;
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&posted_push_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                memset(&posted->event, 0, sizeof(ALLEGRO_EVENT));
+                posted->event.user.type = type;
+                posted->event.user.timestamp = al_get_time();
+                posted->event.user.data1 = data1;
+                posted->event.user.data2 = data2;
+                posted->event.user.data3 = data3;
+                posted->event.user.data4 = data4;
+                atomic_store_explicit(&posted->sequence, pos + 1 - index, memory_order_release);
+                return true;
+            }
+        }
+        else if (diff < 0) {
+            return false;
+        }
+        else {
+            pos = atomic_load_explicit(&posted_push_pos, memory_order_relaxed);
+        }
+    }
+}
+
+// Feeds an input event through the same path as real events.
+static void inject_input_event(int type, int code, int x, int y)
+{
+    ALLEGRO_EVENT event;
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+
+    if (type == ALLEGRO_EVENT_KEY_DOWN || type == ALLEGRO_EVENT_KEY_UP) {
+        event.keyboard.keycode = code;
+    }
+    else {
+        event.mouse.button = code;
+        event.mouse.x = x;
+        event.mouse.y = y;
+    }
+    handle_event(&event);
+}
+
+static void reset_input_state()
+{
+    memset(keys, 0, sizeof(keys));
+    mouse_buttons = 0;
+    clear_input_state();
+}
+
+static bool read_varint(const InputReplay *r, int *offset, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*offset >= r->size) {
+            return false;
+        }
+        uint8_t byte = r->data[(*offset)++];
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the tick of the next entry without consuming it, or -1 at the end of the stream.
+static int peek_entry_tick(const InputReplay *r, const InputStreamCursor *cursor)
+{
+    int offset = cursor->offset;
+    uint32_t delta;
+    if (!read_varint(r, &offset, &delta) || offset >= r->size) {
+        return -1;
+    }
+    return cursor->tick + (int)delta;
+}
+
+// what decode_entry() does with the entries it decodes
+enum { DECODE_SKIP, DECODE_EVENTS, DECODE_ALL };
+
+/*
+    Decodes the next entry of a stream.
+    DECODE_EVENTS injects events, DECODE_ALL also restores the input state from keyframes.
+    Returns the kind of the entry or -1 if the stream is broken.
+ */
+static int decode_entry(const InputReplay *r, InputStreamCursor *cursor, int mode)
+{
+    bool should_apply = mode != DECODE_SKIP;
+    uint32_t delta, a, b, count;
+    if (!read_varint(r, &cursor->offset, &delta) || cursor->offset >= r->size) {
+        return -1;
+    }
+    cursor->tick += (int)delta;
+    int kind = r->data[cursor->offset++];
+
+    switch (kind) {
+        case INPUT_ENTRY_KEY_DOWN:
+        case INPUT_ENTRY_KEY_UP:
+            if (!read_varint(r, &cursor->offset, &a) || a >= ALLEGRO_KEY_MAX) return -1;
+            if (should_apply) {
+                inject_input_event(kind == INPUT_ENTRY_KEY_DOWN ? ALLEGRO_EVENT_KEY_DOWN : ALLEGRO_EVENT_KEY_UP, (int)a, 0, 0);
+            }
+            break;
+
+        case INPUT_ENTRY_MOUSE_AXES:
+            if (!read_varint(r, &cursor->offset, &a) || !read_varint(r, &cursor->offset, &b)) return -1;
+            cursor->mouse_x += zigzag_decode(a);
+            cursor->mouse_y += zigzag_decode(b);
+            if (should_apply) {
+                inject_input_event(ALLEGRO_EVENT_MOUSE_AXES, 0, cursor->mouse_x, cursor->mouse_y);
+            }
+            break;
+
+        case INPUT_ENTRY_MOUSE_BUTTON_DOWN:
+        case INPUT_ENTRY_MOUSE_BUTTON_UP:
+            if (!read_varint(r, &cursor->offset, &a)) return -1;
+            if (should_apply) {
+                inject_input_event(kind == INPUT_ENTRY_MOUSE_BUTTON_DOWN ? ALLEGRO_EVENT_MOUSE_BUTTON_DOWN : ALLEGRO_EVENT_MOUSE_BUTTON_UP, (int)a, 0, 0);
+            }
+            break;
+
+        case INPUT_ENTRY_KEYFRAME:
+            if (!read_varint(r, &cursor->offset, &a) || !read_varint(r, &cursor->offset, &b)) return -1;
+            cursor->mouse_x = zigzag_decode(a);
+            cursor->mouse_y = zigzag_decode(b);
+            if (!read_varint(r, &cursor->offset, &a) || !read_varint(r, &cursor->offset, &count)) return -1;
+            should_apply = mode == DECODE_ALL;
+            if (should_apply) {
+                reset_input_state();
+                mouse_x = mouse_old_x = cursor->mouse_x;
+                mouse_y = mouse_old_y = cursor->mouse_y;
+                mouse_buttons = a;
+            }
+            for (uint32_t i = 0; i < count; i++) {
+                if (!read_varint(r, &cursor->offset, &b) || b >= ALLEGRO_KEY_MAX) return -1;
+                if (should_apply) {
+                    set_bit(keys, b);
+                }
+            }
+            break;
+
+        case INPUT_ENTRY_END:
+            break;
+
+        default:
+            return -1;
+    }
+
+    return kind;
+}
+
+static void apply_input_replay()
+{
+    int replay_tick = tick_count - replay_tick_base;
+
+    for (;;) {
+        int next_tick = peek_entry_tick(replay, &replay_cursor);
+        if (next_tick < 0 || next_tick > replay_tick) {
+            break;
+        }
+
+        int kind = decode_entry(replay, &replay_cursor, DECODE_EVENTS);
+        if (kind < 0 || kind == INPUT_ENTRY_END) {
+            if (kind < 0) {
+                log_warning("Input replay is broken at offset %d", replay_cursor.offset);
+            }
+            replay = NULL;
+            break;
+        }
+    }
+}
+
+static void apply_input_playback()
+{
+    while (playback_index < num_playback_events && playback_events[playback_index].tick <= tick_count) {
+        const InputEvent *input = &playback_events[playback_index++];
+        inject_input_event(input->type, input->code, input->x, input->y);
+    }
+
+    if (replay) {
+        apply_input_replay();
+    }
+}
+
+// Runs one logic tick, shared by all game loops.
+static void run_tick(void (*update_proc)())
+{
+    swap_frame_arenas();
+    update_assets();
+    apply_input_playback();
+    handle_posted_events();
+
+    profile_begin_scope(PROFILE_UPDATE);
+    update_proc();
+    profile_end_scope(PROFILE_UPDATE);
+
+    clear_input_state();
+    tick_count++;
+
+    if (is_recording && (tick_count - recording_start_tick) % INPUT_KEYFRAME_INTERVAL == 0) {
+        record_keyframe();
+    }
+}
+
+static void begin_frame()
+{
+    al_set_target_bitmap(display ? al_get_backbuffer(display) : headless_bitmap);
+    end_camera();
+    al_clear_to_color(al_map_rgb(0, 0, 0));
+}
+
+static void end_frame()
+{
+    flush_sprites();
+
+    // queued text is drawn, so its pages may be cleared from now on
+    text_cache_stats = text_frame_stats;
+    text_frame_stats.hits = text_frame_stats.misses = 0;
+    text_frame++;
+
+    if (should_show_profiler_overlay) {
+        draw_profiler_overlay(8, 8);
+    }
+
+    if (display) {
+        profile_begin_scope(PROFILE_FLIP);
+        al_flip_display();
+        profile_end_scope(PROFILE_FLIP);
+    }
+    profile_end_frame();
+}
+
+// Runs ticks back to back without waiting, only used in headless mode.
+static void run_headless_loop(void (*update_proc)(), void (*render_proc)(), void (*fixed_render_proc)(float alpha))
+{
+    int first_tick = tick_count;
+    double start_time = al_get_time();
+
+    while (!is_done && (headless_tick_limit == 0 || tick_count - first_tick < headless_tick_limit)) {
+        run_tick(update_proc);
+
+        if (should_render_headless) {
+            begin_frame();
+            profile_begin_scope(PROFILE_RENDER);
+            if (fixed_render_proc) {
+                fixed_render_proc(0.0f);
+            }
+            else {
+                render_proc();
+            }
+            profile_end_scope(PROFILE_RENDER);
+            end_frame();
+        }
+        else {
+            profile_end_frame();
+        }
+    }
+
+    double elapsed = al_get_time() - start_time;
+    int ticks = tick_count - first_tick;
+    log_message("Ran %d headless ticks in %.3f seconds (%.0f ticks per second)", ticks, elapsed, elapsed > 0 ? ticks / elapsed : 0.0);
+}
+
+void run_game_loop(void (*update_proc)(), void (*render_proc)())
+{
+    if (is_headless_mode) {
+        run_headless_loop(update_proc, render_proc, NULL);
+        return;
+    }
+
+    bool should_redraw = true;
+    al_start_timer(timer);
+
+    while (!is_done) {
+        // sleep until something happens, then handle everything that is pending in one go
+        al_wait_for_event(event_queue, NULL);
+
+        profile_begin_scope(PROFILE_EVENTS);
+        int num_timer_events = handle_pending_events();
+        profile_end_scope(PROFILE_EVENTS);
+
+        for (int i = 0; i < num_timer_events && !is_done; i++) {
+            should_redraw = true;
+            if (!is_paused) {
+                run_tick(update_proc);
+            }
+            else {
+                clear_input_state();
+            }
+        }
+
+        if (should_redraw && !is_paused) {
+            should_redraw = false;
+            begin_frame();
+            profile_begin_scope(PROFILE_RENDER);
+            render_proc();
+            profile_end_scope(PROFILE_RENDER);
+            end_frame();
+        }
+    }
+}
+
+void run_fixed_game_loop(void (*update_proc)(), void (*render_proc)(float alpha))
+{
+    if (is_headless_mode) {
+        run_headless_loop(update_proc, NULL, render_proc);
+        return;
+    }
+
+    double tick_time = 1.0 / logic_rate;
+    double accumulator = 0.0;
+    double previous_time = al_get_time();
+
+    while (!is_done) {
+        ALLEGRO_EVENT event;
+
+        if (is_paused) {
+            // nothing to do until the window becomes active again
+            al_wait_for_event(event_queue, &event);
+            handle_event(&event);
+            previous_time = al_get_time();
+            accumulator = 0.0;
+            continue;
+        }
+
+        profile_begin_scope(PROFILE_EVENTS);
+        handle_pending_events();
+        profile_end_scope(PROFILE_EVENTS);
+
+        double current_time = al_get_time();
+        accumulator += current_time - previous_time;
+        previous_time = current_time;
+
+        int ticks = 0;
+        while (accumulator >= tick_time && ticks < max_catch_up_ticks) {
+            run_tick(update_proc);
+            accumulator -= tick_time;
+            ticks++;
+        }
+
+        // drop whatever could not be caught up with
+        if (accumulator >= tick_time) {
+            accumulator = fmod(accumulator, tick_time);
+        }
+
+        if (ticks > 0 || render_mode == RENDER_UNCAPPED) {
+            begin_frame();
+            profile_begin_scope(PROFILE_RENDER);
+            render_proc((float)(accumulator / tick_time));
+            profile_end_scope(PROFILE_RENDER);
+            end_frame();
+        }
+
+        if (render_mode == RENDER_ON_TICK) {
+            // sleep until the next tick is due, waking up early for input
+            double wait_time = tick_time - (accumulator + al_get_time() - previous_time);
+            if (wait_time > 0) {
+                al_wait_for_event_timed(event_queue, NULL, (float)wait_time);
+            }
+        }
+    }
+}
+
+void quit()
+{
+    is_done = true;
+}
+
+void alt_tab_should_pause(bool true_or_false)
+{
+    should_alt_tab_pause = true_or_false;
+}
+
+void set_logic_rate(double ticks_per_second)
+{
+    assert(ticks_per_second > 0);
+    logic_rate = ticks_per_second;
+}
+
+void set_max_catch_up_ticks(int max_ticks)
+{
+    assert(max_ticks > 0);
+    max_catch_up_ticks = max_ticks;
+}
+
+void set_render_mode(int mode)
+{
+    assert(mode == RENDER_ON_TICK || mode == RENDER_UNCAPPED);
+    render_mode = mode;
+}
+
+void use_vsync(bool true_or_false)
+{
+    should_use_vsync = true_or_false;
+}
+
+void enable_profiler(bool true_or_false)
+{
+    if (true_or_false && !is_profiler_enabled) {
+        profile_frame_start = al_get_time();
+        if (profile_epoch == 0.0) {
+            profile_epoch = profile_frame_start;
+        }
+        memset(profile_scope_total, 0, sizeof(profile_scope_total));
+    }
+    is_profiler_enabled = true_or_false;
+}
+
+void show_profiler_overlay(bool true_or_false)
+{
+    if (true_or_false) {
+        enable_profiler(true);
+    }
+    should_show_profiler_overlay = true_or_false;
+}
+
+int get_profile_scope(const char *name)
+{
+    for (int i = 0; i < num_profile_scopes; i++) {
+        if (strcmp(profile_scope_names[i], name) == 0) {
+            return i;
+        }
+    }
+
+    if (num_profile_scopes == MAX_PROFILE_SCOPES) {
+        log_warning("Too many profile scopes, ignoring %s", name);
+        return -1;
+    }
+
+    snprintf(profile_scope_names[num_profile_scopes], sizeof(profile_scope_names[0]), "%s", name);
+    return num_profile_scopes++;
+}
+
+void profile_begin_scope(int scope)
+{
+    if (!is_profiler_enabled || scope < 0) {
+        return;
+    }
+    profile_scope_start[scope] = al_get_time();
+}
+
+static void add_profile_event(int scope, double start, double duration)
+{
+    ProfileEvent *event = &profile_trace[profile_trace_count % PROFILE_TRACE_SIZE];
+    event->scope = scope;
+    event->start = start;
+    event->duration = duration;
+    profile_trace_count++;
+}
+
+void profile_end_scope(int scope)
+{
+    if (!is_profiler_enabled || scope < 0) {
+        return;
+    }
+
+    double start = profile_scope_start[scope];
+    double duration = al_get_time() - start;
+    profile_scope_total[scope] += duration;
+    add_profile_event(scope, start, duration);
+}
+
+void profile_end_frame()
+{
+    if (!is_profiler_enabled) {
+        return;
+    }
+
+    double now = al_get_time();
+    profile_scope_total[PROFILE_FRAME] = now - profile_frame_start;
+    add_profile_event(PROFILE_FRAME, profile_frame_start, now - profile_frame_start);
+    profile_frame_start = now;
+
+    float *row = profile_history[profile_frame_count % PROFILE_HISTORY_SIZE];
+    for (int i = 0; i < MAX_PROFILE_SCOPES; i++) {
+        row[i] = (float)(profile_scope_total[i] * 1000.0);
+        profile_scope_total[i] = 0.0;
+    }
+    profile_frame_count++;
+}
+
+static int compare_floats(const void *a, const void *b)
+{
+    float fa = *(const float *)a;
+    float fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+static bool compute_profile_stats(int scope, ProfileStats *stats)
+{
+    static float sorted[PROFILE_HISTORY_SIZE];
+    int count = profile_frame_count < PROFILE_HISTORY_SIZE ? profile_frame_count : PROFILE_HISTORY_SIZE;
+    if (scope < 0 || scope >= num_profile_scopes || count == 0) {
+        return false;
+    }
+
+    double sum = 0.0;
+    for (int i = 0; i < count; i++) {
+        sorted[i] = profile_history[i][scope];
+        sum += sorted[i];
+    }
+    qsort(sorted, count, sizeof(float), compare_floats);
+
+    int p99 = (count * 99 + 99) / 100 - 1;
+    stats->last = profile_history[(profile_frame_count - 1) % PROFILE_HISTORY_SIZE][scope];
+    stats->min = sorted[0];
+    stats->avg = (float)(sum / count);
+    stats->max = sorted[count - 1];
+    stats->p99 = sorted[p99];
+    return true;
+}
+
+bool get_profile_stats(const char *name, ProfileStats *stats)
+{
+    for (int i = 0; i < num_profile_scopes; i++) {
+        if (strcmp(profile_scope_names[i], name) == 0) {
+            return compute_profile_stats(i, stats);
+        }
+    }
+    return false;
+}
+
+void draw_profiler_overlay(float x, float y)
+{
+    static ALLEGRO_VERTEX graph[PROFILE_GRAPH_FRAMES];
+    const float graph_height = 100.0f;
+    const float ms_per_pixel = 33.3f / graph_height;
+    int line_height = al_get_font_line_height(default_font) + 2;
+
+    al_draw_filled_rectangle(x, y, x + PROFILE_GRAPH_FRAMES + 200, y + graph_height + line_height * (num_profile_scopes + 1) + 8, al_map_rgba(0, 0, 0, 192));
+
+    // frame time graph, with a line at 60 fps
+    int count = profile_frame_count < PROFILE_GRAPH_FRAMES ? profile_frame_count : PROFILE_GRAPH_FRAMES;
+    for (int i = 0; i < count; i++) {
+        float ms = profile_history[(profile_frame_count - count + i) % PROFILE_HISTORY_SIZE][PROFILE_FRAME];
+        graph[i].x = x + i;
+        graph[i].y = y + graph_height - fminf(ms / ms_per_pixel, graph_height);
+        graph[i].z = 0;
+        graph[i].u = graph[i].v = 0;
+        graph[i].color = ms > 1000.0f / 60.0f ? red_color : green_color;
+    }
+    al_draw_line(x, y + graph_height - 16.7f / ms_per_pixel, x + PROFILE_GRAPH_FRAMES, y + graph_height - 16.7f / ms_per_pixel, grey_color, 1);
+    if (count > 1) {
+        al_draw_prim(graph, NULL, NULL, 0, count, ALLEGRO_PRIM_LINE_STRIP);
+    }
+
+    float text_y = y + graph_height + 4;
+    al_draw_text(default_font, white_color, x + 4, text_y, 0, "scope         last    avg    p99    max");
+    for (int i = 0; i < num_profile_scopes; i++) {
+        ProfileStats stats;
+        if (!compute_profile_stats(i, &stats)) continue;
+        text_y += line_height;
+        al_draw_textf(default_font, white_color, x + 4, text_y, 0, "%-12.12s %6.2f %6.2f %6.2f %6.2f",
+                      profile_scope_names[i], stats.last, stats.avg, stats.p99, stats.max);
+    }
+}
+
+bool save_profile_csv(const char *filename)
+{
+    ALLEGRO_FILE *file = al_fopen(filename, "w");
+    if (!file) {
+        log_warning("Failed to open %s", filename);
+        return false;
+    }
+
+    al_fputs(file, "index");
+    for (int i = 0; i < num_profile_scopes; i++) {
+        file_printf(file, ",%s", profile_scope_names[i]);
+    }
+    al_fputs(file, "\n");
+
+    int count = profile_frame_count < PROFILE_HISTORY_SIZE ? profile_frame_count : PROFILE_HISTORY_SIZE;
+    for (int frame = profile_frame_count - count; frame < profile_frame_count; frame++) {
+        float *row = profile_history[frame % PROFILE_HISTORY_SIZE];
+        file_printf(file, "%d", frame);
+        for (int i = 0; i < num_profile_scopes; i++) {
+            file_printf(file, ",%.4f", row[i]);
+        }
+        al_fputs(file, "\n");
+    }
+
+    return al_fclose(file);
+}
+
+// Writes text as a quoted JSON string.
+static void write_json_string(ALLEGRO_FILE *file, const char *text)
+{
+    al_fputc(file, '"');
+    for (const unsigned char *c = (const unsigned char*)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            file_printf(file, "\\%c", *c);
+        }
+        else if (*c < 0x20) {
+            file_printf(file, "\\u%04x", *c);
+        }
+        else {
+            al_fputc(file, *c);
+        }
+    }
+    al_fputc(file, '"');
+}
+
+bool save_profile_trace(const char *filename)
+{
+    ALLEGRO_FILE *file = al_fopen(filename, "w");
+    if (!file) {
+        log_warning("Failed to open %s", filename);
+        return false;
+    }
+
+    al_fputs(file, "{\"traceEvents\":[\n");
+    int count = profile_trace_count < PROFILE_TRACE_SIZE ? profile_trace_count : PROFILE_TRACE_SIZE;
+    for (int i = profile_trace_count - count; i < profile_trace_count; i++) {
+        ProfileEvent *event = &profile_trace[i % PROFILE_TRACE_SIZE];
+        al_fputs(file, "{\"name\":");
+        write_json_string(file, profile_scope_names[event->scope]);
+        file_printf(file, ",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                    (event->start - profile_epoch) * 1e6, event->duration * 1e6, i + 1 < profile_trace_count ? "," : "");
+    }
+    al_fputs(file, "]}\n");
+
+    return al_fclose(file);
+}
+
+bool is_headless()
+{
+    return is_headless_mode;
+}
+
+void set_headless_tick_limit(int num_ticks)
+{
+    assert(num_ticks >= 0);
+    headless_tick_limit = num_ticks;
+}
+
+int get_tick_count()
+{
+    return tick_count;
+}
+
+int get_window_width()
+{
+    if (is_headless_mode) {
+        return headless_width;
+    }
+    assert(display != NULL);
+    return al_get_display_width(display);
+}
+
+int get_window_height()
+{
+    if (is_headless_mode) {
+        return headless_height;
+    }
+    assert(display != NULL);
+    return al_get_display_height(display);
+}
+
+bool is_key_down(int keycode)
+{
+    assert(keycode >= 0 && keycode < ALLEGRO_KEY_MAX);
+    return test_bit(keys, keycode);
+}
+
+bool is_key_pressed(int keycode)
+{
+    assert(keycode >= 0 && keycode < ALLEGRO_KEY_MAX);
+    return test_bit(keys_pressed, keycode);
+}
+
+bool is_key_released(int keycode)
+{
+    assert(keycode >= 0 && keycode < ALLEGRO_KEY_MAX);
+    return test_bit(keys_released, keycode);
+}
+
+bool is_any_key_down()
+{
+    return is_any_bit_set(keys, KEY_WORDS);
+}
+
+bool is_any_key_pressed()
+{
+    return is_any_bit_set(keys_pressed, KEY_WORDS);
+}
+
+bool is_any_key_released()
+{
+    return is_any_bit_set(keys_released, KEY_WORDS);
+}
+
+int get_pressed_keys(int *out_keycodes, int max_keycodes)
+{
+    return get_set_bits(keys_pressed, KEY_WORDS, out_keycodes, max_keycodes);
+}
+
+int get_released_keys(int *out_keycodes, int max_keycodes)
+{
+    return get_set_bits(keys_released, KEY_WORDS, out_keycodes, max_keycodes);
+}
+
+int get_key_modifiers()
+{
+    static const int modifier_keys[][2] = {
+        { ALLEGRO_KEY_LSHIFT, ALLEGRO_KEYMOD_SHIFT },
+        { ALLEGRO_KEY_RSHIFT, ALLEGRO_KEYMOD_SHIFT },
+        { ALLEGRO_KEY_LCTRL,  ALLEGRO_KEYMOD_CTRL },
+        { ALLEGRO_KEY_RCTRL,  ALLEGRO_KEYMOD_CTRL },
+        { ALLEGRO_KEY_ALT,    ALLEGRO_KEYMOD_ALT },
+        { ALLEGRO_KEY_ALTGR,  ALLEGRO_KEYMOD_ALTGR },
+        { ALLEGRO_KEY_LWIN,   ALLEGRO_KEYMOD_LWIN },
+        { ALLEGRO_KEY_RWIN,   ALLEGRO_KEYMOD_RWIN },
+        { ALLEGRO_KEY_MENU,   ALLEGRO_KEYMOD_MENU },
+    };
+
+    int modifiers = key_lock_modifiers;
+    for (int i = 0; i < (int)lengthof(modifier_keys); i++) {
+        if (test_bit(keys, modifier_keys[i][0])) {
+            modifiers |= modifier_keys[i][1];
+        }
+    }
+    return modifiers;
+}
+
+int get_mouse_x()
+{
+    return mouse_x;
+}
+
+int get_mouse_y()
+{
+    return mouse_y;
+}
+
+int get_mouse_dx()
+{
+    return mouse_x - mouse_old_x;
+}
+
+int get_mouse_dy()
+{
+    return mouse_y - mouse_old_y;
+}
+
+bool is_mouse_button_down(int mouse_button)
+{
+    assert(mouse_button >= 0 && mouse_button < MAX_MOUSE_BUTTONS);
+    return (mouse_buttons >> mouse_button) & 1;
+}
+
+bool is_mouse_button_pressed(int mouse_button)
+{
+    assert(mouse_button >= 0 && mouse_button < MAX_MOUSE_BUTTONS);
+    return (mouse_buttons_pressed >> mouse_button) & 1;
+}
+
+bool is_mouse_button_released(int mouse_button)
+{
+    assert(mouse_button >= 0 && mouse_button < MAX_MOUSE_BUTTONS);
+    return (mouse_buttons_released >> mouse_button) & 1;
+}
+
+void play_input_events(const InputEvent *events, int num_events)
+{
+    playback_events = events;
+    num_playback_events = events ? num_events : 0;
+    playback_index = 0;
+}
+
+bool is_playing_input_events()
+{
+    return playback_index < num_playback_events;
+}
+
+void start_input_recording()
+{
+    recording_size = 0;
+    recording_start_tick = tick_count;
+    memset(&recording_cursor, 0, sizeof(recording_cursor));
+    is_recording = true;
+
+    record_byte(INPUT_REPLAY_MAGIC[0]);
+    record_byte(INPUT_REPLAY_MAGIC[1]);
+    record_byte(INPUT_REPLAY_MAGIC[2]);
+    record_byte(INPUT_REPLAY_MAGIC[3]);
+    record_byte(INPUT_REPLAY_VERSION);
+    record_varint(INPUT_KEYFRAME_INTERVAL);
+    record_keyframe();
+}
+
+bool stop_input_recording(const char *filename)
+{
+    if (!is_recording) {
+        return false;
+    }
+
+    record_entry(INPUT_ENTRY_END);
+    is_recording = false;
+
+    ALLEGRO_FILE *file = al_fopen(filename, "wb");
+    if (!file) {
+        log_warning("Failed to open %s", filename);
+        return false;
+    }
+
+    bool is_written = al_fwrite(file, recording, recording_size) == (size_t)recording_size;
+    return al_fclose(file) && is_written;
+}
+
+bool is_recording_input()
+{
+    return is_recording;
+}
+
+InputReplay* load_input_replay(const char *filename)
+{
+    ALLEGRO_FILE *file = al_fopen(filename, "rb");
+    if (!file) {
+        log_warning("Failed to open %s", filename);
+        return NULL;
+    }
+
+    InputReplay *r = calloc(1, sizeof(InputReplay));
+    if (!r) {
+        log_error("Failed to create input replay");
+    }
+
+    int64_t size = al_fsize(file);
+    r->size = size > 0 ? (int)size : 0;
+    r->data = malloc(r->size > 0 ? r->size : 1);
+    if (!r->data) {
+        log_error("Failed to allocate %d bytes for input replay", r->size);
+    }
+    bool is_read = al_fread(file, r->data, r->size) == (size_t)r->size;
+    al_fclose(file);
+
+    if (!is_read || r->size < 5 || memcmp(r->data, INPUT_REPLAY_MAGIC, 4) != 0 || r->data[4] != INPUT_REPLAY_VERSION) {
+        log_warning("%s is not an input recording", filename);
+        destroy_input_replay(r);
+        return NULL;
+    }
+
+    // index the keyframes and find the length
+    InputStreamCursor cursor = { 5, 0, 0, 0 };
+    uint32_t keyframe_interval;
+    read_varint(r, &cursor.offset, &keyframe_interval);
+
+    int capacity = 0;
+    for (;;) {
+        int offset = cursor.offset;
+        int kind = decode_entry(r, &cursor, DECODE_SKIP);
+        if (kind < 0) {
+            log_warning("%s is broken at offset %d", filename, offset);
+            destroy_input_replay(r);
+            return NULL;
+        }
+
+        if (kind == INPUT_ENTRY_KEYFRAME) {
+            r->keyframes = grow_array(r->keyframes, &capacity, r->num_keyframes + 1, sizeof(InputKeyframe));
+            r->keyframes[r->num_keyframes].tick = cursor.tick;
+            r->keyframes[r->num_keyframes].offset = offset;
+            r->num_keyframes++;
+        }
+        else if (kind == INPUT_ENTRY_END) {
+            r->length = cursor.tick;
+            break;
+        }
+    }
+
+    // seeking starts from a keyframe, recordings always begin with one
+    if (r->num_keyframes == 0 || r->keyframes[0].tick != 0) {
+        log_warning("%s has no keyframe at the start", filename);
+        destroy_input_replay(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void destroy_input_replay(InputReplay *r)
+{
+    if (!r) {
+        return;
+    }
+
+    if (replay == r) {
+        replay = NULL;
+    }
+    free(r->data);
+    free(r->keyframes);
+    free(r);
+}
+
+int get_input_replay_length(InputReplay *r)
+{
+    return r->length;
+}
+
+void play_input_replay(InputReplay *r)
+{
+    replay = r;
+    if (r) {
+        seek_input_replay(0);
+    }
+}
+
+bool seek_input_replay(int replay_tick)
+{
+    if (!replay || replay_tick < 0 || replay_tick > replay->length) {
+        return false;
+    }
+
+    // find the last keyframe at or before the tick
+    int low = 0, high = replay->num_keyframes - 1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (replay->keyframes[middle].tick <= replay_tick) {
+            low = middle;
+        }
+        else {
+            high = middle - 1;
+        }
+    }
+
+    // the keyframe entry stores the delta from the entry before it, so start one tick early
+    const InputKeyframe *keyframe = &replay->keyframes[low];
+    memset(&replay_cursor, 0, sizeof(replay_cursor));
+    replay_cursor.offset = keyframe->offset;
+    uint32_t delta;
+    int offset = keyframe->offset;
+    read_varint(replay, &offset, &delta);
+    replay_cursor.tick = keyframe->tick - (int)delta;
+    decode_entry(replay, &replay_cursor, DECODE_ALL);
+
+    // apply the events of the ticks before, the next tick plays the rest
+    while (true) {
+        int next_tick = peek_entry_tick(replay, &replay_cursor);
+        if (next_tick < 0 || next_tick >= replay_tick) {
+            break;
+        }
+        if (decode_entry(replay, &replay_cursor, DECODE_EVENTS) == INPUT_ENTRY_END) {
+            break;
+        }
+    }
+    clear_input_state();
+
+    replay_tick_base = tick_count - replay_tick;
+    return true;
+}
+
+bool is_playing_input_replay()
+{
+    return replay != NULL;
+}
+
+int wait_for_keypress()
+{
+    if (is_headless_mode) {
+        log_warning("wait_for_keypress() has no keyboard to wait for in headless mode");
+        return 0;
+    }
+
+    ALLEGRO_EVENT event;
+    do {
+        al_wait_for_event(event_queue, &event);
+    } while (event.type != ALLEGRO_EVENT_KEY_DOWN);
+    return event.keyboard.keycode;
+}
+
+bool is_float_equal(float a, float b)
+{
+	return fabs(a - b) < ALMOST_ZERO;
+}
+
+bool is_double_equal(double a, double b)
+{
+	return fabs(a - b) < ALMOST_ZERO;
+}
+
+int lerpi(int a, int b, float alpha)
+{
+	return (int)floorf(a + alpha * (b - a) + 0.5f);
+}
+
+float lerpf(float a, float b, float alpha)
+{
+	return a + alpha * (b - a);
+}
+
+double lerpd(double a, double b, double alpha)
+{
+	return a + alpha * (b - a);
+}
+
+float fast_atan2(float y, float x)
+{
+    float ax = fabsf(x), ay = fabsf(y);
+    float largest = ax > ay ? ax : ay;
+    float smallest = ax > ay ? ay : ax;
+    if (largest == 0) {
+        return 0;
+    }
+
+    // polynomial for atan on [0, 1]
+    float a = smallest / largest;
+    float s = a * a;
+    float r = a * (0.99997726f + s * (-0.33262347f + s * (0.19354346f + s * (-0.11643287f + s * (0.05265332f + s * -0.01172120f)))));
+    if (ay > ax) {
+        r = (float)HALF_PI - r;
+    }
+    if (x < 0) {
+        r = (float)PI - r;
+    }
+    return y < 0 ? -r : r;
+}
+
+// Returns sin(x) for x between [-PI / 2, PI / 2].
+static float sin_polynomial(float x)
+{
+    float s = x * x;
+    return x + x * s * (-0.166666597f + s * (0.00833307858f + s * (-0.000198106907f + s * 2.60831598e-6f)));
+}
+
+/*
+    PI split into a part with few bits, so k * PI_HIGH is exact for the
+    k used below, and the rest. Subtracting both keeps the reduced angle
+    accurate for large x.
+ */
+#define PI_HIGH 3.140625f
+#define PI_LOW 9.67653589793e-4f
+
+float fast_sin(float x)
+{
+    // x = k * PI + r, sin(x) = (-1)^k * sin(r)
+    float k = nearbyintf(x * (float)(1 / PI));
+    float r = (x - k * PI_HIGH) - k * PI_LOW;
+    float result = sin_polynomial(r);
+    return ((int)k & 1) ? -result : result;
+}
+
+float fast_cos(float x)
+{
+    // x = (k + 1/2) * PI + r, cos(x) = (-1)^(k + 1) * sin(r)
+    float m = nearbyintf(x * (float)(1 / PI) - 0.5f);
+    float k = m + 0.5f;
+    float r = (x - k * PI_HIGH) - k * PI_LOW;
+    float result = sin_polynomial(r);
+    return ((int)m & 1) ? result : -result;
+}
+
+float fast_rsqrt(float x)
+{
+#if defined(FRAMEWORK_SSE2)
+    // the hardware estimate has 12 bits, one Newton step doubles that
+    float y = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+    return y * (1.5f - 0.5f * x * y * y);
+#else
+    return 1 / sqrtf(x);
+#endif
+}
+
+Vec2 vec2(float x, float y)
+{
+    Vec2 v = { x, y };
+    return v;
+}
+
+Vec2 vec2_add(Vec2 a, Vec2 b)
+{
+    return vec2(a.x + b.x, a.y + b.y);
+}
+
+Vec2 vec2_sub(Vec2 a, Vec2 b)
+{
+    return vec2(a.x - b.x, a.y - b.y);
+}
+
+Vec2 vec2_scale(Vec2 v, float s)
+{
+    return vec2(v.x * s, v.y * s);
+}
+
+float vec2_dot(Vec2 a, Vec2 b)
+{
+    return a.x * b.x + a.y * b.y;
+}
+
+float vec2_length(Vec2 v)
+{
+    return sqrtf(v.x * v.x + v.y * v.y);
+}
+
+float vec2_length_squared(Vec2 v)
+{
+    return v.x * v.x + v.y * v.y;
+}
+
+float vec2_distance(Vec2 a, Vec2 b)
+{
+    return vec2_length(vec2_sub(a, b));
+}
+
+float vec2_distance_squared(Vec2 a, Vec2 b)
+{
+    return vec2_length_squared(vec2_sub(a, b));
+}
+
+Vec2 vec2_normalize(Vec2 v)
+{
+    float length_squared = v.x * v.x + v.y * v.y;
+    if (length_squared > 0) {
+        float length = sqrtf(length_squared);
+        return vec2(v.x / length, v.y / length);
+    }
+    return vec2(0, 0);
+}
+
+Vec2 vec2_lerp(Vec2 a, Vec2 b, float alpha)
+{
+    return vec2(lerpf(a.x, b.x, alpha), lerpf(a.y, b.y, alpha));
+}
+
+float vec2_angle(Vec2 v)
+{
+    return fast_atan2(v.y, v.x);
+}
+
+Vec4 vec4(float x, float y, float z, float w)
+{
+    Vec4 v = { x, y, z, w };
+    return v;
+}
+
+Vec4 vec4_add(Vec4 a, Vec4 b)
+{
+    return vec4(a.x + b.x, a.y + b.y, a.z + b.z, a.w + b.w);
+}
+
+Vec4 vec4_sub(Vec4 a, Vec4 b)
+{
+    return vec4(a.x - b.x, a.y - b.y, a.z - b.z, a.w - b.w);
+}
+
+Vec4 vec4_scale(Vec4 v, float s)
+{
+    return vec4(v.x * s, v.y * s, v.z * s, v.w * s);
+}
+
+float vec4_dot(Vec4 a, Vec4 b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w;
+}
+
+float vec4_length(Vec4 v)
+{
+    return sqrtf(vec4_dot(v, v));
+}
+
+Vec4 vec4_normalize(Vec4 v)
+{
+    float length_squared = vec4_dot(v, v);
+    if (length_squared > 0) {
+        float length = sqrtf(length_squared);
+        return vec4(v.x / length, v.y / length, v.z / length, v.w / length);
+    }
+    return vec4(0, 0, 0, 0);
+}
+
+Vec4 vec4_lerp(Vec4 a, Vec4 b, float alpha)
+{
+    return vec4(lerpf(a.x, b.x, alpha), lerpf(a.y, b.y, alpha), lerpf(a.z, b.z, alpha), lerpf(a.w, b.w, alpha));
+}
+
+/*
+    Batch vector kernels.
+    Vec2 arrays are loaded two registers at a time and split into x and y
+    with shuffles. The operations are done in the same order as in the
+    functions above, so the results are the same at every SIMD level.
+ */
+
+static void lerp_floats(const float *a, const float *b, float alpha, float *out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] + alpha * (b[i] - a[i]);
+    }
+}
+
+static void vec2_dot_kernel(const Vec2 *a, const Vec2 *b, float *out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = vec2_dot(a[i], b[i]);
+    }
+}
+
+static void vec2_length_kernel(const Vec2 *v, float *out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = vec2_length(v[i]);
+    }
+}
+
+static void vec2_normalize_kernel(const Vec2 *v, Vec2 *out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = vec2_normalize(v[i]);
+    }
+}
+
+static void vec2_distance_squared_kernel(Vec2 p, const Vec2 *v, float *out, int n)
+{
+    for (int i = 0; i < n; i++) {
+        out[i] = vec2_distance_squared(v[i], p);
+    }
+}
+
+#if defined(FRAMEWORK_SSE2)
+
+static void lerp_floats_sse2(const float *a, const float *b, float alpha, float *out, int n)
+{
+    __m128 t = _mm_set1_ps(alpha);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 va = _mm_loadu_ps(a + i);
+        __m128 vb = _mm_loadu_ps(b + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(va, _mm_mul_ps(t, _mm_sub_ps(vb, va))));
+    }
+    lerp_floats(a + i, b + i, alpha, out + i, n - i);
+}
+
+// Returns x * x + y * y of 4 vectors, v0 holds vectors 0-1 and v1 vectors 2-3.
+static inline __m128 length_squared_sse2(__m128 v0, __m128 v1)
+{
+    __m128 x = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 y = _mm_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y));
+}
+
+static void vec2_dot_sse2(const Vec2 *a, const Vec2 *b, float *out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 p0 = _mm_mul_ps(_mm_loadu_ps(&a[i].x), _mm_loadu_ps(&b[i].x));
+        __m128 p1 = _mm_mul_ps(_mm_loadu_ps(&a[i + 2].x), _mm_loadu_ps(&b[i + 2].x));
+        __m128 x = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 y = _mm_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm_storeu_ps(out + i, _mm_add_ps(x, y));
+    }
+    vec2_dot_kernel(a + i, b + i, out + i, n - i);
+}
+
+static void vec2_length_sse2(const Vec2 *v, float *out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 length_squared = length_squared_sse2(_mm_loadu_ps(&v[i].x), _mm_loadu_ps(&v[i + 2].x));
+        _mm_storeu_ps(out + i, _mm_sqrt_ps(length_squared));
+    }
+    vec2_length_kernel(v + i, out + i, n - i);
+}
+
+static void vec2_normalize_sse2(const Vec2 *v, Vec2 *out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 v0 = _mm_loadu_ps(&v[i].x);
+        __m128 v1 = _mm_loadu_ps(&v[i + 2].x);
+        __m128 length_squared = length_squared_sse2(v0, v1);
+        __m128 length = _mm_sqrt_ps(length_squared);
+        __m128 is_nonzero = _mm_cmpgt_ps(length_squared, _mm_setzero_ps());
+
+        // spread the lengths back to the x and y of each vector, zero vectors give 0 / 0 which is masked out
+        __m128 r0 = _mm_div_ps(v0, _mm_unpacklo_ps(length, length));
+        __m128 r1 = _mm_div_ps(v1, _mm_unpackhi_ps(length, length));
+        _mm_storeu_ps(&out[i].x, _mm_and_ps(r0, _mm_unpacklo_ps(is_nonzero, is_nonzero)));
+        _mm_storeu_ps(&out[i + 2].x, _mm_and_ps(r1, _mm_unpackhi_ps(is_nonzero, is_nonzero)));
+    }
+    vec2_normalize_kernel(v + i, out + i, n - i);
+}
+
+static void vec2_distance_squared_sse2(Vec2 p, const Vec2 *v, float *out, int n)
+{
+    __m128 point = _mm_setr_ps(p.x, p.y, p.x, p.y);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 d0 = _mm_sub_ps(_mm_loadu_ps(&v[i].x), point);
+        __m128 d1 = _mm_sub_ps(_mm_loadu_ps(&v[i + 2].x), point);
+        _mm_storeu_ps(out + i, length_squared_sse2(d0, d1));
+    }
+    vec2_distance_squared_kernel(p, v + i, out + i, n - i);
+}
+
+// Vec4 arrays are transposed 4 vectors at a time, so sums are added in the same order as vec4_dot().
+static inline __m128 vec4_dot_sse2_4(const Vec4 *a, const Vec4 *b)
+{
+    __m128 a0 = _mm_loadu_ps(&a[0].x), a1 = _mm_loadu_ps(&a[1].x), a2 = _mm_loadu_ps(&a[2].x), a3 = _mm_loadu_ps(&a[3].x);
+    __m128 b0 = _mm_loadu_ps(&b[0].x), b1 = _mm_loadu_ps(&b[1].x), b2 = _mm_loadu_ps(&b[2].x), b3 = _mm_loadu_ps(&b[3].x);
+    _MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+    _MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+    __m128 sum = _mm_add_ps(_mm_mul_ps(a0, b0), _mm_mul_ps(a1, b1));
+    sum = _mm_add_ps(sum, _mm_mul_ps(a2, b2));
+    return _mm_add_ps(sum, _mm_mul_ps(a3, b3));
+}
+
+static void vec4_dot_sse2(const Vec4 *a, const Vec4 *b, float *out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, vec4_dot_sse2_4(a + i, b + i));
+    }
+    for (; i < n; i++) {
+        out[i] = vec4_dot(a[i], b[i]);
+    }
+}
+
+static void vec4_normalize_sse2(const Vec4 *v, Vec4 *out, int n)
+{
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128 length_squared = vec4_dot_sse2_4(v + i, v + i);
+        __m128 length = _mm_sqrt_ps(length_squared);
+        __m128 is_nonzero = _mm_cmpgt_ps(length_squared, _mm_setzero_ps());
+        __m128 lengths[4] = {
+            _mm_shuffle_ps(length, length, _MM_SHUFFLE(0, 0, 0, 0)),
+            _mm_shuffle_ps(length, length, _MM_SHUFFLE(1, 1, 1, 1)),
+            _mm_shuffle_ps(length, length, _MM_SHUFFLE(2, 2, 2, 2)),
+            _mm_shuffle_ps(length, length, _MM_SHUFFLE(3, 3, 3, 3))
+        };
+        __m128 masks[4] = {
+            _mm_shuffle_ps(is_nonzero, is_nonzero, _MM_SHUFFLE(0, 0, 0, 0)),
+            _mm_shuffle_ps(is_nonzero, is_nonzero, _MM_SHUFFLE(1, 1, 1, 1)),
+            _mm_shuffle_ps(is_nonzero, is_nonzero, _MM_SHUFFLE(2, 2, 2, 2)),
+            _mm_shuffle_ps(is_nonzero, is_nonzero, _MM_SHUFFLE(3, 3, 3, 3))
+        };
+        for (int j = 0; j < 4; j++) {
+            __m128 normalized = _mm_div_ps(_mm_loadu_ps(&v[i + j].x), lengths[j]);
+            _mm_storeu_ps(&out[i + j].x, _mm_and_ps(normalized, masks[j]));
+        }
+    }
+    for (; i < n; i++) {
+        out[i] = vec4_normalize(v[i]);
+    }
+}
+
+#endif
+
+#if defined(FRAMEWORK_AVX2)
+
+TARGET_AVX2 static void lerp_floats_avx2(const float *a, const float *b, float alpha, float *out, int n)
+{
+    __m256 t = _mm256_set1_ps(alpha);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 va = _mm256_loadu_ps(a + i);
+        __m256 vb = _mm256_loadu_ps(b + i);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(va, _mm256_mul_ps(t, _mm256_sub_ps(vb, va))));
+    }
+    lerp_floats(a + i, b + i, alpha, out + i, n - i);
+}
+
+/*
+    Shuffles work within 128 bit lanes, so splitting vectors 0-3 and 4-7
+    gives x and y in the order 0 1 4 5 2 3 6 7. Results that are stored as
+    floats are put back in order with a permute.
+ */
+TARGET_AVX2 static inline __m256 length_squared_avx2(__m256 v0, __m256 v1)
+{
+    __m256 x = _mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 y = _mm256_shuffle_ps(v0, v1, _MM_SHUFFLE(3, 1, 3, 1));
+    return _mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y));
+}
+
+TARGET_AVX2 static inline __m256 unshuffle_avx2(__m256 v)
+{
+    return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(v), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+TARGET_AVX2 static void vec2_dot_avx2(const Vec2 *a, const Vec2 *b, float *out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 p0 = _mm256_mul_ps(_mm256_loadu_ps(&a[i].x), _mm256_loadu_ps(&b[i].x));
+        __m256 p1 = _mm256_mul_ps(_mm256_loadu_ps(&a[i + 4].x), _mm256_loadu_ps(&b[i + 4].x));
+        __m256 x = _mm256_shuffle_ps(p0, p1, _MM_SHUFFLE(2, 0, 2, 0));
+        __m256 y = _mm256_shuffle_ps(p0, p1, _MM_SHUFFLE(3, 1, 3, 1));
+        _mm256_storeu_ps(out + i, unshuffle_avx2(_mm256_add_ps(x, y)));
+    }
+    vec2_dot_kernel(a + i, b + i, out + i, n - i);
+}
+
+TARGET_AVX2 static void vec2_length_avx2(const Vec2 *v, float *out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 length_squared = length_squared_avx2(_mm256_loadu_ps(&v[i].x), _mm256_loadu_ps(&v[i + 4].x));
+        _mm256_storeu_ps(out + i, unshuffle_avx2(_mm256_sqrt_ps(length_squared)));
+    }
+    vec2_length_kernel(v + i, out + i, n - i);
+}
+
+TARGET_AVX2 static void vec2_normalize_avx2(const Vec2 *v, Vec2 *out, int n)
+{
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 v0 = _mm256_loadu_ps(&v[i].x);
+        __m256 v1 = _mm256_loadu_ps(&v[i + 4].x);
+        __m256 length_squared = length_squared_avx2(v0, v1);
+        __m256 length = _mm256_sqrt_ps(length_squared);
+        __m256 is_nonzero = _mm256_cmp_ps(length_squared, _mm256_setzero_ps(), _CMP_GT_OQ);
+
+        // unpacking within lanes undoes the order of the shuffles
+        __m256 r0 = _mm256_div_ps(v0, _mm256_unpacklo_ps(length, length));
+        __m256 r1 = _mm256_div_ps(v1, _mm256_unpackhi_ps(length, length));
+        _mm256_storeu_ps(&out[i].x, _mm256_and_ps(r0, _mm256_unpacklo_ps(is_nonzero, is_nonzero)));
+        _mm256_storeu_ps(&out[i + 4].x, _mm256_and_ps(r1, _mm256_unpackhi_ps(is_nonzero, is_nonzero)));
+    }
+    vec2_normalize_kernel(v + i, out + i, n - i);
+}
+
+TARGET_AVX2 static void vec2_distance_squared_avx2(Vec2 p, const Vec2 *v, float *out, int n)
+{
+    __m256 point = _mm256_setr_ps(p.x, p.y, p.x, p.y, p.x, p.y, p.x, p.y);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(&v[i].x), point);
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(&v[i + 4].x), point);
+        _mm256_storeu_ps(out + i, unshuffle_avx2(length_squared_avx2(d0, d1)));
+    }
+    vec2_distance_squared_kernel(p, v + i, out + i, n - i);
+}
+
+#endif
+
+void vec2_dot_batch(const Vec2 *a, const Vec2 *b, float *out, int n)
+{
+    void (*kernel)(const Vec2 *, const Vec2 *, float *, int) = vec2_dot_kernel;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = vec2_dot_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = vec2_dot_avx2;
+#endif
+    kernel(a, b, out, n);
+}
+
+void vec2_length_batch(const Vec2 *v, float *out, int n)
+{
+    void (*kernel)(const Vec2 *, float *, int) = vec2_length_kernel;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = vec2_length_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = vec2_length_avx2;
+#endif
+    kernel(v, out, n);
+}
+
+void vec2_normalize_batch(const Vec2 *v, Vec2 *out, int n)
+{
+    void (*kernel)(const Vec2 *, Vec2 *, int) = vec2_normalize_kernel;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = vec2_normalize_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = vec2_normalize_avx2;
+#endif
+    kernel(v, out, n);
+}
+
+static void lerp_floats_batch(const float *a, const float *b, float alpha, float *out, int n)
+{
+    void (*kernel)(const float *, const float *, float, float *, int) = lerp_floats;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = lerp_floats_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = lerp_floats_avx2;
+#endif
+    kernel(a, b, alpha, out, n);
+}
+
+void vec2_lerp_batch(const Vec2 *a, const Vec2 *b, float alpha, Vec2 *out, int n)
+{
+    lerp_floats_batch(&a->x, &b->x, alpha, &out->x, n * 2);
+}
+
+void vec2_distance_squared_batch(Vec2 p, const Vec2 *v, float *out, int n)
+{
+    void (*kernel)(Vec2, const Vec2 *, float *, int) = vec2_distance_squared_kernel;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = vec2_distance_squared_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = vec2_distance_squared_avx2;
+#endif
+    kernel(p, v, out, n);
+}
+
+void vec4_dot_batch(const Vec4 *a, const Vec4 *b, float *out, int n)
+{
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() >= SIMD_SSE2) {
+        vec4_dot_sse2(a, b, out, n);
+        return;
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+        out[i] = vec4_dot(a[i], b[i]);
+    }
+}
+
+void vec4_normalize_batch(const Vec4 *v, Vec4 *out, int n)
+{
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() >= SIMD_SSE2) {
+        vec4_normalize_sse2(v, out, n);
+        return;
+    }
+#endif
+    for (int i = 0; i < n; i++) {
+        out[i] = vec4_normalize(v[i]);
+    }
+}
+
+void vec4_lerp_batch(const Vec4 *a, const Vec4 *b, float alpha, Vec4 *out, int n)
+{
+    lerp_floats_batch(&a->x, &b->x, alpha, &out->x, n * 4);
+}
+
+static inline uint64_t rotate_left(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t xoshiro256_next(uint64_t *s)
+{
+    uint64_t result = rotate_left(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotate_left(s[3], 45);
+    return (uint32_t)(result >> 32);
+}
+
+// Advances a xoshiro256** state by 2^128 steps.
+static void xoshiro256_jump(uint64_t *s)
+{
+    static const uint64_t jump[] = { 0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL, 0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL };
+    uint64_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & (1ULL << b)) {
+                s0 ^= s[0];
+                s1 ^= s[1];
+                s2 ^= s[2];
+                s3 ^= s[3];
+            }
+            xoshiro256_next(s);
+        }
+    }
+    s[0] = s0;
+    s[1] = s1;
+    s[2] = s2;
+    s[3] = s3;
+}
+
+// state[0] is the pcg state, state[1] the stream increment
+static inline uint32_t pcg32_next(uint64_t *s)
+{
+    uint64_t old = s[0];
+    s[0] = old * 6364136223846793005ULL + s[1];
+    uint32_t xorshifted = (uint32_t)(((old >> 18) ^ old) >> 27);
+    uint32_t rot = (uint32_t)(old >> 59);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+void seed_random_generator(RandomGenerator *rng, int engine, uint64_t seed, uint64_t stream)
+{
+    memset(rng, 0, sizeof(RandomGenerator));
+    rng->engine = engine;
+
+    if (engine == RANDOM_PCG32) {
+        rng->state[1] = (stream << 1) | 1;
+        pcg32_next(rng->state);
+        rng->state[0] += seed;
+        pcg32_next(rng->state);
+    }
+    else {
+        assert(engine == RANDOM_XOSHIRO256);
+        for (int i = 0; i < 4; i++) {
+            rng->state[i] = splitmix64(&seed);
+        }
+        // streams are meant for a handful of threads, each one costs a jump
+        for (uint64_t i = 0; i < stream; i++) {
+            xoshiro256_jump(rng->state);
+        }
+    }
+}
+
+uint32_t random_next(RandomGenerator *rng)
+{
+    if (rng->engine == RANDOM_PCG32) {
+        return pcg32_next(rng->state);
+    }
+    return xoshiro256_next(rng->state);
+}
+
+/*
+    Returns a number between [0, range) using Lemire's multiply and shift,
+    rejecting the few values that would cause a bias. A range of 0 means 2^32.
+ */
+static inline uint32_t random_bounded(RandomGenerator *rng, uint32_t range)
+{
+    uint32_t x = random_next(rng);
+    if (range == 0) {
+        return x;
+    }
+
+    uint64_t m = (uint64_t)x * range;
+    uint32_t low = (uint32_t)m;
+    if (low < range) {
+        uint32_t threshold = -range % range;
+        while (low < threshold) {
+            x = random_next(rng);
+            m = (uint64_t)x * range;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+static inline float random_unit_float(RandomGenerator *rng)
+{
+    return (random_next(rng) >> 8) * (1.0f / 16777216.0f);
+}
+
+int random_int(RandomGenerator *rng, int min, int max)
+{
+    assert(min <= max);
+    return (int)((int64_t)min + random_bounded(rng, (uint32_t)((int64_t)max - min + 1)));
+}
+
+float random_float(RandomGenerator *rng, float min, float max)
+{
+    return min + random_unit_float(rng) * (max - min);
+}
+
+void random_fill_ints(RandomGenerator *rng, int *out, int n, int min, int max)
+{
+    assert(min <= max);
+    uint32_t range = (uint32_t)((int64_t)max - min + 1);
+    for (int i = 0; i < n; i++) {
+        out[i] = (int)((int64_t)min + random_bounded(rng, range));
+    }
+}
+
+void random_fill_floats(RandomGenerator *rng, float *out, int n, float min, float max)
+{
+    float scale = max - min;
+    for (int i = 0; i < n; i++) {
+        out[i] = min + random_unit_float(rng) * scale;
+    }
+}
+
+void seed_random(uint64_t seed)
+{
+    atomic_store(&random_seed, seed);
+    atomic_fetch_add(&random_generation, 1);
+    set_random_stream(0);
+}
+
+void set_random_stream(uint64_t stream)
+{
+    thread_random_stream = stream;
+    thread_random_has_stream = true;
+    thread_random_generation = atomic_load(&random_generation);
+    seed_random_generator(&thread_random, RANDOM_XOSHIRO256, atomic_load(&random_seed), stream);
+}
+
+RandomGenerator* get_random_generator()
+{
+    // reseed lazily when seed_random() has been called since the last use
+    int generation = atomic_load(&random_generation);
+    if (thread_random_generation != generation) {
+        if (!thread_random_has_stream) {
+            thread_random_stream = atomic_fetch_add(&next_random_stream, 1);
+            thread_random_has_stream = true;
+        }
+        seed_random_generator(&thread_random, RANDOM_XOSHIRO256, atomic_load(&random_seed), thread_random_stream);
+        thread_random_generation = generation;
+    }
+    return &thread_random;
+}
+
+int get_random_int(int min, int max)
+{
+    return random_int(get_random_generator(), min, max);
+}
+
+float get_random_float(float min, float max)
+{
+    return random_float(get_random_generator(), min, max);
+}
+
+bool one_in(int chance)
+{
+    assert(chance > 0);
+    return random_bounded(get_random_generator(), chance) == 0;
+}
+
+int roll_dice(int number, int sides)
+{
+    assert(sides > 0);
+    RandomGenerator *rng = get_random_generator();
+    int result = number;
+
+    // roll as many dice as fit in one draw, each die is a digit in base sides
+    for (int left = number; left > 0; ) {
+        int count = 1;
+        uint64_t range = sides;
+        while (count < left && range * sides <= UINT32_MAX) {
+            range *= sides;
+            count++;
+        }
+
+        uint32_t value = random_bounded(rng, (uint32_t)range);
+        for (int i = 0; i < count; i++) {
+            result += value % sides;
+            value /= sides;
+        }
+        left -= count;
+    }
+
+    return result;
+}
+
+static Sprite* add_sprite(ALLEGRO_BITMAP *texture, int layer)
+{
+    sprites = grow_array(sprites, &sprites_capacity, num_sprites + 1, sizeof(Sprite));
+    Sprite *sprite = &sprites[num_sprites];
+    sprite->texture = texture;
+    sprite->layer = layer;
+    sprite->order = num_sprites++;
+    return sprite;
+}
+
+void draw_sprite(ALLEGRO_BITMAP *bitmap, float x, float y, int layer)
+{
+    float w = al_get_bitmap_width(bitmap);
+    float h = al_get_bitmap_height(bitmap);
+    draw_sprite_ex(bitmap, 0, 0, w, h, x, y, w, h, white_color, layer);
+}
+
+void draw_sprite_ex(ALLEGRO_BITMAP *bitmap, float sx, float sy, float sw, float sh,
+                    float dx, float dy, float dw, float dh, ALLEGRO_COLOR tint, int layer)
+{
+    // sub bitmaps are drawn from their root bitmap, so they batch with their siblings
+    ALLEGRO_BITMAP *root = bitmap;
+    while (al_get_parent_bitmap(root)) {
+        sx += al_get_bitmap_x(root);
+        sy += al_get_bitmap_y(root);
+        root = al_get_parent_bitmap(root);
+    }
+
+    Sprite *sprite = add_sprite(root, layer);
+    sprite->u1 = sx;
+    sprite->v1 = sy;
+    sprite->u2 = sx + sw;
+    sprite->v2 = sy + sh;
+    sprite->x1 = dx;
+    sprite->y1 = dy;
+    sprite->x2 = dx + dw;
+    sprite->y2 = dy + dh;
+    sprite->color = tint;
+}
+
+void draw_sprite_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, int layer)
+{
+    Sprite *sprite = add_sprite(NULL, layer);
+    sprite->u1 = sprite->v1 = sprite->u2 = sprite->v2 = 0;
+    sprite->x1 = x1;
+    sprite->y1 = y1;
+    sprite->x2 = x2;
+    sprite->y2 = y2;
+    sprite->color = color;
+}
+
+static int compare_sprites(const void *a, const void *b)
+{
+    const Sprite *sa = a;
+    const Sprite *sb = b;
+    if (sa->layer != sb->layer) {
+        return sa->layer < sb->layer ? -1 : 1;
+    }
+    if (sa->texture != sb->texture) {
+        return (uintptr_t)sa->texture < (uintptr_t)sb->texture ? -1 : 1;
+    }
+    return sa->order - sb->order;
+}
+
+static void set_sprite_vertex(ALLEGRO_VERTEX *vertex, float x, float y, float u, float v, ALLEGRO_COLOR color)
+{
+    vertex->x = x;
+    vertex->y = y;
+    vertex->z = 0;
+    vertex->u = u;
+    vertex->v = v;
+    vertex->color = color;
+}
+
+void flush_sprites()
+{
+    sprite_stats.num_sprites = num_sprites;
+    sprite_stats.num_draw_calls = 0;
+    if (num_sprites == 0) {
+        return;
+    }
+
+    qsort(sprites, num_sprites, sizeof(Sprite), compare_sprites);
+
+    // every quad uses the same 6 indices relative to its first vertex
+    int old_capacity = sprite_indices_capacity;
+    sprite_indices = grow_array(sprite_indices, &sprite_indices_capacity, num_sprites * 6, sizeof(int));
+    for (int i = old_capacity / 6; i < sprite_indices_capacity / 6; i++) {
+        int *index = &sprite_indices[i * 6];
+        index[0] = i * 4;
+        index[1] = i * 4 + 1;
+        index[2] = i * 4 + 2;
+        index[3] = i * 4;
+        index[4] = i * 4 + 2;
+        index[5] = i * 4 + 3;
+    }
+    sprite_vertices = grow_array(sprite_vertices, &sprite_vertices_capacity, num_sprites * 4, sizeof(ALLEGRO_VERTEX));
+
+    for (int i = 0; i < num_sprites; i++) {
+        Sprite *sprite = &sprites[i];
+        ALLEGRO_VERTEX *vertex = &sprite_vertices[i * 4];
+        set_sprite_vertex(&vertex[0], sprite->x1, sprite->y1, sprite->u1, sprite->v1, sprite->color);
+        set_sprite_vertex(&vertex[1], sprite->x2, sprite->y1, sprite->u2, sprite->v1, sprite->color);
+        set_sprite_vertex(&vertex[2], sprite->x2, sprite->y2, sprite->u2, sprite->v2, sprite->color);
+        set_sprite_vertex(&vertex[3], sprite->x1, sprite->y2, sprite->u1, sprite->v2, sprite->color);
+    }
+
+    // one draw call per run of sprites sharing layer and texture
+    int start = 0;
+    for (int i = 1; i <= num_sprites; i++) {
+        if (i < num_sprites && sprites[i].texture == sprites[start].texture && sprites[i].layer == sprites[start].layer) {
+            continue;
+        }
+        al_draw_indexed_prim(&sprite_vertices[start * 4], NULL, sprites[start].texture,
+                             sprite_indices, (i - start) * 6, ALLEGRO_PRIM_TRIANGLE_LIST);
+        sprite_stats.num_draw_calls++;
+        start = i;
+    }
+
+    num_sprites = 0;
+}
+
+SpriteBatchStats get_sprite_batch_stats()
+{
+    return sprite_stats;
+}
+
+struct Atlas {
+    ALLEGRO_BITMAP **pages;
+    int num_pages;
+    ALLEGRO_BITMAP **sprites;
+    int num_sprites;
+};
+
+static ALLEGRO_BITMAP **atlas_sort_bitmaps = NULL;
+
+static int compare_atlas_entries(const void *a, const void *b)
+{
+    int ia = *(const int *)a;
+    int ib = *(const int *)b;
+    int ha = al_get_bitmap_height(atlas_sort_bitmaps[ia]);
+    int hb = al_get_bitmap_height(atlas_sort_bitmaps[ib]);
+    if (ha != hb) {
+        return hb - ha;
+    }
+    return ia - ib;
+}
+
+Atlas* create_atlas_from_bitmaps(ALLEGRO_BITMAP **bitmaps, int num_bitmaps, int page_size)
+{
+    const int padding = 1;
+
+    int count = num_bitmaps > 0 ? num_bitmaps : 1;
+    Atlas *atlas = calloc(1, sizeof(Atlas));
+    int *order = malloc(count * sizeof(int));
+    int *positions = malloc(count * 3 * sizeof(int));
+    if (!atlas || !order || !positions) {
+        log_error("Failed to create atlas");
+    }
+    atlas->sprites = calloc(count, sizeof(ALLEGRO_BITMAP *));
+    if (!atlas->sprites) {
+        log_error("Failed to create atlas");
+    }
+    atlas->num_sprites = num_bitmaps;
+
+    // shelf packing, tallest bitmaps first so shelves waste little height
+    for (int i = 0; i < num_bitmaps; i++) {
+        order[i] = i;
+    }
+    atlas_sort_bitmaps = bitmaps;
+    qsort(order, num_bitmaps, sizeof(int), compare_atlas_entries);
+
+    int page = 0, x = 0, y = 0, shelf_height = 0;
+    for (int i = 0; i < num_bitmaps; i++) {
+        int index = order[i];
+        int w = al_get_bitmap_width(bitmaps[index]);
+        int h = al_get_bitmap_height(bitmaps[index]);
+        if (w + padding > page_size || h + padding > page_size) {
+            log_warning("Bitmap %d (%dx%d) does not fit on a %dx%d atlas page", index, w, h, page_size, page_size);
+            free(order);
+            free(positions);
+            destroy_atlas(atlas);
+            return NULL;
+        }
+
+        if (x + w + padding > page_size) {
+            x = 0;
+            y += shelf_height;
+            shelf_height = 0;
+        }
+        if (y + h + padding > page_size) {
+            page++;
+            x = y = shelf_height = 0;
+        }
+
+        positions[index * 3] = page;
+        positions[index * 3 + 1] = x;
+        positions[index * 3 + 2] = y;
+        x += w + padding;
+        if (h + padding > shelf_height) {
+            shelf_height = h + padding;
+        }
+    }
+
+    atlas->num_pages = num_bitmaps > 0 ? page + 1 : 0;
+    atlas->pages = calloc(atlas->num_pages > 0 ? atlas->num_pages : 1, sizeof(ALLEGRO_BITMAP *));
+    if (!atlas->pages) {
+        log_error("Failed to create atlas pages");
+    }
+
+    ALLEGRO_STATE state;
+    al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+    al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_ZERO);
+
+    for (int p = 0; p < atlas->num_pages; p++) {
+        atlas->pages[p] = al_create_bitmap(page_size, page_size);
+        if (!atlas->pages[p]) {
+            log_error("Failed to create %dx%d atlas page", page_size, page_size);
+        }
+        al_set_target_bitmap(atlas->pages[p]);
+        al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+    }
+
+    for (int i = 0; i < num_bitmaps; i++) {
+        ALLEGRO_BITMAP *page_bitmap = atlas->pages[positions[i * 3]];
+        int px = positions[i * 3 + 1];
+        int py = positions[i * 3 + 2];
+        al_set_target_bitmap(page_bitmap);
+        al_draw_bitmap(bitmaps[i], px, py, 0);
+        atlas->sprites[i] = al_create_sub_bitmap(page_bitmap, px, py, al_get_bitmap_width(bitmaps[i]), al_get_bitmap_height(bitmaps[i]));
+    }
+
+    al_restore_state(&state);
+    free(order);
+    free(positions);
+    return atlas;
+}
+
+Atlas* create_atlas(const char **filenames, int num_files, int page_size)
+{
+    ALLEGRO_BITMAP **bitmaps = calloc(num_files > 0 ? num_files : 1, sizeof(ALLEGRO_BITMAP *));
+    if (!bitmaps) {
+        log_error("Failed to create atlas");
+    }
+
+    // load as memory bitmaps, only the pages need to be video bitmaps
+    ALLEGRO_STATE state;
+    al_store_state(&state, ALLEGRO_STATE_NEW_BITMAP_PARAMETERS);
+    al_set_new_bitmap_flags(ALLEGRO_MEMORY_BITMAP);
+
+    bool is_loaded = true;
+    for (int i = 0; i < num_files && is_loaded; i++) {
+        bitmaps[i] = al_load_bitmap(filenames[i]);
+        if (!bitmaps[i]) {
+            log_warning("Failed to load %s", filenames[i]);
+            is_loaded = false;
+        }
+    }
+    al_restore_state(&state);
+
+    Atlas *atlas = is_loaded ? create_atlas_from_bitmaps(bitmaps, num_files, page_size) : NULL;
+
+    for (int i = 0; i < num_files; i++) {
+        if (bitmaps[i]) {
+            al_destroy_bitmap(bitmaps[i]);
+        }
+    }
+    free(bitmaps);
+    return atlas;
+}
+
+void destroy_atlas(Atlas *atlas)
+{
+    if (!atlas) {
+        return;
+    }
+
+    for (int i = 0; i < atlas->num_sprites; i++) {
+        if (atlas->sprites[i]) {
+            al_destroy_bitmap(atlas->sprites[i]);
+        }
+    }
+    for (int i = 0; i < atlas->num_pages; i++) {
+        al_destroy_bitmap(atlas->pages[i]);
+    }
+    free(atlas->sprites);
+    free(atlas->pages);
+    free(atlas);
+}
+
+ALLEGRO_BITMAP* get_atlas_sprite(Atlas *atlas, int index)
+{
+    assert(index >= 0 && index < atlas->num_sprites);
+    return atlas->sprites[index];
+}
+
+int get_atlas_page_count(Atlas *atlas)
+{
+    return atlas->num_pages;
+}
+
+// FNV-1a over the font pointer and the text.
+static uint32_t hash_text(const ALLEGRO_FONT *font, const char *text)
+{
+    uint32_t hash = 2166136261u;
+    uintptr_t font_bits = (uintptr_t)font;
+    for (size_t i = 0; i < sizeof(font_bits); i++) {
+        hash = (hash ^ (uint8_t)(font_bits >> (i * 8))) * 16777619u;
+    }
+    for (const char *c = text; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash;
+}
+
+static void clear_text_page(int page)
+{
+    for (int i = 0; i < TEXT_CACHE_BUCKETS; i++) {
+        TextCacheEntry **link = &text_buckets[i];
+        while (*link) {
+            TextCacheEntry *entry = *link;
+            if (entry->page == page) {
+                *link = entry->next_in_bucket;
+                free(entry);
+                num_cached_strings--;
+            }
+            else {
+                link = &entry->next_in_bucket;
+            }
+        }
+    }
+
+    TextPage *p = &text_pages[page];
+    p->x = p->y = p->shelf_height = 0;
+    if (p->bitmap) {
+        ALLEGRO_STATE state;
+        al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP);
+        al_set_target_bitmap(p->bitmap);
+        al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+        al_restore_state(&state);
+    }
+}
+
+// Shelf packs a w x h region onto a page, returns false if it is full.
+static bool fit_text_region(TextPage *page, int w, int h, int *out_x, int *out_y)
+{
+    if (page->x + w > TEXT_CACHE_PAGE_SIZE) {
+        page->x = 0;
+        page->y += page->shelf_height;
+        page->shelf_height = 0;
+    }
+    if (page->y + h > TEXT_CACHE_PAGE_SIZE) {
+        return false;
+    }
+
+    *out_x = page->x;
+    *out_y = page->y;
+    page->x += w;
+    if (h > page->shelf_height) {
+        page->shelf_height = h;
+    }
+    return true;
+}
+
+// Finds room for a w x h region on a text page, returns the page or -1 if all pages are in use.
+static int allocate_text_region(int w, int h, int *out_x, int *out_y)
+{
+    TextPage *current = &text_pages[current_text_page];
+    if (current->bitmap && fit_text_region(current, w, h, out_x, out_y)) {
+        return current_text_page;
+    }
+
+    // move on to a new page or the next one that wasn't drawn from this frame
+    for (int i = current->bitmap ? 1 : 0; i <= TEXT_CACHE_PAGES; i++) {
+        int index = (current_text_page + i) % TEXT_CACHE_PAGES;
+        TextPage *page = &text_pages[index];
+        if (!page->bitmap) {
+            page->bitmap = al_create_bitmap(TEXT_CACHE_PAGE_SIZE, TEXT_CACHE_PAGE_SIZE);
+            if (!page->bitmap) {
+                log_error("Failed to create %dx%d text page", TEXT_CACHE_PAGE_SIZE, TEXT_CACHE_PAGE_SIZE);
+            }
+        }
+        else if (page->last_used_frame == text_frame) {
+            continue;
+        }
+
+        clear_text_page(index);
+        current_text_page = index;
+        return fit_text_region(page, w, h, out_x, out_y) ? index : -1;
+    }
+    return -1;
+}
+
+// Renders text onto a text page. Returns NULL if it doesn't fit.
+static TextCacheEntry* add_cached_text(const ALLEGRO_FONT *font, const char *text, uint32_t hash)
+{
+    int bbx, bby, bbw, bbh;
+    al_get_text_dimensions(font, text, &bbx, &bby, &bbw, &bbh);
+
+    // a pixel of space around the text keeps filtering from picking up neighbors
+    int w = bbw + 2, h = bbh + 2;
+    if (w > TEXT_CACHE_PAGE_SIZE || h > TEXT_CACHE_PAGE_SIZE) {
+        return NULL;
+    }
+
+    int x = 0, y = 0, page = -1;
+    if (bbw > 0 && bbh > 0) {
+        page = allocate_text_region(w, h, &x, &y);
+        if (page < 0) {
+            return NULL;
+        }
+
+        ALLEGRO_STATE state;
+        al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP | ALLEGRO_STATE_BLENDER);
+        al_set_target_bitmap(text_pages[page].bitmap);
+        al_set_blender(ALLEGRO_ADD, ALLEGRO_ONE, ALLEGRO_INVERSE_ALPHA);
+        al_draw_text(font, al_map_rgb(255, 255, 255), x + 1 - bbx, y + 1 - bby, 0, text);
+        al_restore_state(&state);
+    }
+
+    size_t length = strlen(text);
+    TextCacheEntry *entry = malloc(sizeof(TextCacheEntry) + length + 1);
+    if (!entry) {
+        log_error("Failed to allocate cached text");
+    }
+
+    entry->hash = hash;
+    entry->font = font;
+    entry->page = page;
+    entry->x = x;
+    entry->y = y;
+    entry->w = w;
+    entry->h = h;
+    entry->offset_x = bbx - 1;
+    entry->offset_y = bby - 1;
+    entry->width = al_get_text_width(font, text);
+    memcpy(entry->text, text, length + 1);
+
+    TextCacheEntry **bucket = &text_buckets[hash & (TEXT_CACHE_BUCKETS - 1)];
+    entry->next_in_bucket = *bucket;
+    *bucket = entry;
+    num_cached_strings++;
+    return entry;
+}
+
+void draw_cached_text(const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, int flags, int layer, const char *text)
+{
+    uint32_t hash = hash_text(font, text);
+    TextCacheEntry *entry = text_buckets[hash & (TEXT_CACHE_BUCKETS - 1)];
+    while (entry && (entry->hash != hash || entry->font != font || strcmp(entry->text, text) != 0)) {
+        entry = entry->next_in_bucket;
+    }
+
+    if (entry) {
+        text_frame_stats.hits++;
+    }
+    else {
+        text_frame_stats.misses++;
+        entry = add_cached_text(font, text, hash);
+        if (!entry) {
+            al_draw_text(font, color, x, y, flags, text);
+            return;
+        }
+    }
+    if (entry->page < 0) {
+        return;
+    }
+
+    if (flags & ALLEGRO_ALIGN_CENTRE) {
+        x -= entry->width / 2.0f;
+    }
+    else if (flags & ALLEGRO_ALIGN_RIGHT) {
+        x -= entry->width;
+    }
+    if (flags & ALLEGRO_ALIGN_INTEGER) {
+        x = floorf(x);
+        y = floorf(y);
+    }
+
+    TextPage *page = &text_pages[entry->page];
+    page->last_used_frame = text_frame;
+    draw_sprite_ex(page->bitmap, entry->x, entry->y, entry->w, entry->h,
+                   x + entry->offset_x, y + entry->offset_y, entry->w, entry->h, color, layer);
+}
+
+void draw_cached_textf(const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, int flags, int layer, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    char *text = arena_vprintf(get_frame_arena(), format, args);
+    va_end(args);
+
+    draw_cached_text(font, color, x, y, flags, layer, text);
+}
+
+void clear_text_cache()
+{
+    for (int i = 0; i < TEXT_CACHE_BUCKETS; i++) {
+        for (TextCacheEntry *entry = text_buckets[i], *next; entry; entry = next) {
+            next = entry->next_in_bucket;
+            free(entry);
+        }
+        text_buckets[i] = NULL;
+    }
+
+    for (int i = 0; i < TEXT_CACHE_PAGES; i++) {
+        if (text_pages[i].bitmap) {
+            al_destroy_bitmap(text_pages[i].bitmap);
+        }
+        memset(&text_pages[i], 0, sizeof(TextPage));
+        text_pages[i].last_used_frame = -1;
+    }
+    current_text_page = 0;
+    num_cached_strings = 0;
+}
+
+TextCacheStats get_text_cache_stats()
+{
+    TextCacheStats stats = text_cache_stats;
+    stats.num_strings = num_cached_strings;
+    return stats;
+}
+
+struct ParticleEmitter {
+    int capacity;
+    int count;
+    float gx, gy;
+    float size;
+    float *x, *y;
+    float *dx, *dy;
+    float *life;
+    float *inv_start_life;  // for fading out
+    float *r, *g, *b, *a;
+    ALLEGRO_VERTEX *vertices;
+};
+
+ParticleEmitter* create_particle_emitter(int capacity)
+{
+    assert(capacity > 0);
+
+    ParticleEmitter *emitter = calloc(1, sizeof(ParticleEmitter));
+    if (!emitter) {
+        log_error("Failed to create particle emitter");
+    }
+
+    emitter->capacity = capacity;
+    emitter->size = 2;
+
+    // one block for all arrays, each padded to a multiple of 8 floats for the simd loads
+    int stride = (capacity + 7) & ~7;
+    float *arrays = calloc((size_t)stride * 10, sizeof(float));
+    emitter->vertices = malloc((size_t)capacity * 6 * sizeof(ALLEGRO_VERTEX));
+    if (!arrays || !emitter->vertices) {
+        log_error("Failed to allocate %d particles", capacity);
+    }
+
+    float **fields[] = { &emitter->x, &emitter->y, &emitter->dx, &emitter->dy, &emitter->life, &emitter->inv_start_life,
+                         &emitter->r, &emitter->g, &emitter->b, &emitter->a };
+    for (int i = 0; i < (int)lengthof(fields); i++) {
+        *fields[i] = arrays + (size_t)stride * i;
+    }
+
+    return emitter;
+}
+
+void destroy_particle_emitter(ParticleEmitter *emitter)
+{
+    if (!emitter) {
+        return;
+    }
+
+    free(emitter->x);
+    free(emitter->vertices);
+    free(emitter);
+}
+
+int emit_particles(ParticleEmitter *emitter, int count, float x, float y, float min_speed, float max_speed, float life, ALLEGRO_COLOR color)
+{
+    assert(life > 0);
+    RandomGenerator *rng = get_random_generator();
+
+    if (count > emitter->capacity - emitter->count) {
+        count = emitter->capacity - emitter->count;
+    }
+
+    for (int i = emitter->count; i < emitter->count + count; i++) {
+        float angle = random_float(rng, 0, 2 * PI);
+        float speed = random_float(rng, min_speed, max_speed);
+        emitter->x[i] = x;
+        emitter->y[i] = y;
+        emitter->dx[i] = cosf(angle) * speed;
+        emitter->dy[i] = sinf(angle) * speed;
+        emitter->life[i] = life;
+        emitter->inv_start_life[i] = 1.0f / life;
+        emitter->r[i] = color.r;
+        emitter->g[i] = color.g;
+        emitter->b[i] = color.b;
+        emitter->a[i] = color.a;
+    }
+
+    emitter->count += count;
+    return count;
+}
+
+void set_particle_gravity(ParticleEmitter *emitter, float gx, float gy)
+{
+    emitter->gx = gx;
+    emitter->gy = gy;
+}
+
+void set_particle_size(ParticleEmitter *emitter, float size)
+{
+    emitter->size = size;
+}
+
+static void move_particles(ParticleEmitter *e, int count)
+{
+    for (int i = 0; i < count; i++) {
+        e->dx[i] += e->gx;
+        e->dy[i] += e->gy;
+        e->x[i] += e->dx[i];
+        e->y[i] += e->dy[i];
+        e->life[i] -= 1.0f;
+    }
+}
+
+#if defined(FRAMEWORK_SSE2)
+
+static void move_particles_sse2(ParticleEmitter *e, int count)
+{
+    __m128 gx = _mm_set1_ps(e->gx), gy = _mm_set1_ps(e->gy), one = _mm_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 dx = _mm_add_ps(_mm_loadu_ps(e->dx + i), gx);
+        __m128 dy = _mm_add_ps(_mm_loadu_ps(e->dy + i), gy);
+        _mm_storeu_ps(e->dx + i, dx);
+        _mm_storeu_ps(e->dy + i, dy);
+        _mm_storeu_ps(e->x + i, _mm_add_ps(_mm_loadu_ps(e->x + i), dx));
+        _mm_storeu_ps(e->y + i, _mm_add_ps(_mm_loadu_ps(e->y + i), dy));
+        _mm_storeu_ps(e->life + i, _mm_sub_ps(_mm_loadu_ps(e->life + i), one));
+    }
+    for (; i < count; i++) {
+        e->dx[i] += e->gx;
+        e->dy[i] += e->gy;
+        e->x[i] += e->dx[i];
+        e->y[i] += e->dy[i];
+        e->life[i] -= 1.0f;
+    }
+}
+
+#endif
+
+#if defined(FRAMEWORK_AVX2)
+
+TARGET_AVX2 static void move_particles_avx2(ParticleEmitter *e, int count)
+{
+    __m256 gx = _mm256_set1_ps(e->gx), gy = _mm256_set1_ps(e->gy), one = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 dx = _mm256_add_ps(_mm256_loadu_ps(e->dx + i), gx);
+        __m256 dy = _mm256_add_ps(_mm256_loadu_ps(e->dy + i), gy);
+        _mm256_storeu_ps(e->dx + i, dx);
+        _mm256_storeu_ps(e->dy + i, dy);
+        _mm256_storeu_ps(e->x + i, _mm256_add_ps(_mm256_loadu_ps(e->x + i), dx));
+        _mm256_storeu_ps(e->y + i, _mm256_add_ps(_mm256_loadu_ps(e->y + i), dy));
+        _mm256_storeu_ps(e->life + i, _mm256_sub_ps(_mm256_loadu_ps(e->life + i), one));
+    }
+    for (; i < count; i++) {
+        e->dx[i] += e->gx;
+        e->dy[i] += e->gy;
+        e->x[i] += e->dx[i];
+        e->y[i] += e->dy[i];
+        e->life[i] -= 1.0f;
+    }
+}
+
+#endif
+
+void update_particles(ParticleEmitter *emitter)
+{
+    void (*kernel)(ParticleEmitter *, int) = move_particles;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = move_particles_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = move_particles_avx2;
+#endif
+    kernel(emitter, emitter->count);
+
+    // swap dead particles with the last one, the one moved in is checked next
+    ParticleEmitter *e = emitter;
+    int i = 0;
+    while (i < e->count) {
+        if (e->life[i] > 0) {
+            i++;
+            continue;
+        }
+
+        int last = --e->count;
+        e->x[i] = e->x[last];
+        e->y[i] = e->y[last];
+        e->dx[i] = e->dx[last];
+        e->dy[i] = e->dy[last];
+        e->life[i] = e->life[last];
+        e->inv_start_life[i] = e->inv_start_life[last];
+        e->r[i] = e->r[last];
+        e->g[i] = e->g[last];
+        e->b[i] = e->b[last];
+        e->a[i] = e->a[last];
+    }
+}
+
+void draw_particles(ParticleEmitter *emitter)
+{
+    ParticleEmitter *e = emitter;
+    if (e->count == 0) {
+        return;
+    }
+
+    float half = e->size * 0.5f;
+    for (int i = 0; i < e->count; i++) {
+        // colors are premultiplied, so fading scales all channels
+        float fade = e->life[i] * e->inv_start_life[i];
+        ALLEGRO_COLOR color = { e->r[i] * fade, e->g[i] * fade, e->b[i] * fade, e->a[i] * fade };
+        float x1 = e->x[i] - half, y1 = e->y[i] - half;
+        float x2 = e->x[i] + half, y2 = e->y[i] + half;
+
+        ALLEGRO_VERTEX *v = &e->vertices[i * 6];
+        v[0] = (ALLEGRO_VERTEX){ x1, y1, 0, 0, 0, color };
+        v[1] = (ALLEGRO_VERTEX){ x2, y1, 0, 0, 0, color };
+        v[2] = (ALLEGRO_VERTEX){ x2, y2, 0, 0, 0, color };
+        v[3] = v[0];
+        v[4] = v[2];
+        v[5] = (ALLEGRO_VERTEX){ x1, y2, 0, 0, 0, color };
+    }
+
+    al_draw_prim(e->vertices, NULL, NULL, 0, e->count * 6, ALLEGRO_PRIM_TRIANGLE_LIST);
+}
+
+int get_particle_count(ParticleEmitter *emitter)
+{
+    return emitter->count;
+}
+
+// FNV-1a over the type, size and filename.
+static uint32_t hash_asset_key(int type, int font_size, const char *filename)
+{
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (uint32_t)type) * 16777619u;
+    hash = (hash ^ (uint32_t)font_size) * 16777619u;
+    for (const char *c = filename; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 16777619u;
+    }
+    return hash;
+}
+
+static void grow_asset_buckets()
+{
+    int new_num_buckets = num_asset_buckets > 0 ? num_asset_buckets * 2 : 64;
+    Asset **new_buckets = calloc(new_num_buckets, sizeof(Asset *));
+    if (!new_buckets) {
+        log_error("Failed to grow asset cache");
+    }
+
+    for (int i = 0; i < num_asset_buckets; i++) {
+        for (Asset *asset = asset_buckets[i], *next; asset; asset = next) {
+            next = asset->next_in_bucket;
+            Asset **bucket = &new_buckets[asset->hash & (new_num_buckets - 1)];
+            asset->next_in_bucket = *bucket;
+            *bucket = asset;
+        }
+    }
+
+    free(asset_buckets);
+    asset_buckets = new_buckets;
+    num_asset_buckets = new_num_buckets;
+}
+
+static Asset* request_asset(int type, int font_size, const char *filename)
+{
+    uint32_t hash = hash_asset_key(type, font_size, filename);
+    if (num_asset_buckets > 0) {
+        for (Asset *asset = asset_buckets[hash & (num_asset_buckets - 1)]; asset; asset = asset->next_in_bucket) {
+            if (asset->hash == hash && asset->type == type && asset->font_size == font_size && strcmp(asset->filename, filename) == 0) {
+                asset->ref_count++;
+                return asset;
+            }
+        }
+    }
+
+    if (!asset_mutex) {
+        start_asset_threads();
+    }
+    if (num_assets >= num_asset_buckets) {
+        grow_asset_buckets();
+    }
+
+    Asset *asset = calloc(1, sizeof(Asset));
+    if (!asset || !(asset->filename = strdup(filename))) {
+        log_error("Failed to create asset %s", filename);
+    }
+    asset->type = type;
+    asset->font_size = font_size;
+    asset->hash = hash;
+    asset->ref_count = 1;
+    atomic_init(&asset->state, ASSET_LOADING);
+
+    Asset **bucket = &asset_buckets[hash & (num_asset_buckets - 1)];
+    asset->next_in_bucket = *bucket;
+    *bucket = asset;
+    num_assets++;
+
+    // progress starts over once everything requested earlier has finished
+    if (num_assets_finished == num_assets_requested) {
+        num_assets_requested = num_assets_finished = 0;
+    }
+    num_assets_requested++;
+
+    al_lock_mutex(asset_mutex);
+    push_asset(&pending_assets_head, &pending_assets_tail, asset);
+    al_signal_cond(asset_cond);
+    al_unlock_mutex(asset_mutex);
+
+    return asset;
+}
+
+Asset* load_bitmap_async(const char *filename)
+{
+    return request_asset(ASSET_BITMAP, 0, filename);
+}
+
+Asset* load_font_async(const char *filename, int size)
+{
+    return request_asset(ASSET_FONT, size, filename);
+}
+
+Asset* load_file_async(const char *filename)
+{
+    return request_asset(ASSET_FILE, 0, filename);
+}
+
+void release_asset(Asset *asset)
+{
+    assert(asset->ref_count > 0);
+    if (--asset->ref_count > 0) {
+        return;
+    }
+
+    Asset **link = &asset_buckets[asset->hash & (num_asset_buckets - 1)];
+    while (*link != asset) {
+        link = &(*link)->next_in_bucket;
+    }
+    *link = asset->next_in_bucket;
+    num_assets--;
+
+    // a loader thread may still be working on it, update_assets() destroys it later
+    if (atomic_load(&asset->state) == ASSET_LOADING) {
+        asset->is_released = true;
+    }
+    else {
+        destroy_asset(asset);
+    }
+}
+
+int get_asset_state(Asset *asset)
+{
+    return atomic_load(&asset->state);
+}
+
+ALLEGRO_BITMAP* get_asset_bitmap(Asset *asset)
+{
+    return atomic_load(&asset->state) == ASSET_LOADED ? asset->bitmap : NULL;
+}
+
+ALLEGRO_FONT* get_asset_font(Asset *asset)
+{
+    return atomic_load(&asset->state) == ASSET_LOADED ? asset->font : NULL;
+}
+
+const void* get_asset_data(Asset *asset, size_t *size)
+{
+    if (atomic_load(&asset->state) != ASSET_LOADED) {
+        return NULL;
+    }
+    if (size) {
+        *size = asset->size;
+    }
+    return asset->data;
+}
+
+void update_assets()
+{
+    if (!asset_mutex) {
+        return;
+    }
+
+    al_lock_mutex(asset_mutex);
+    Asset *asset = finished_assets_head;
+    finished_assets_head = finished_assets_tail = NULL;
+    al_unlock_mutex(asset_mutex);
+
+    for (Asset *next; asset; asset = next) {
+        next = asset->next_in_queue;
+        num_assets_finished++;
+
+        if (asset->is_released) {
+            destroy_asset(asset);
+            continue;
+        }
+
+        bool is_loaded = asset->bitmap || asset->font || asset->data;
+        if (!is_loaded) {
+            log_warning("Failed to load %s", asset->filename);
+            atomic_store(&asset->state, ASSET_FAILED);
+            continue;
+        }
+
+        if (asset->bitmap && display) {
+            al_convert_bitmap(asset->bitmap);
+        }
+        has_unconverted_fonts |= asset->font != NULL;
+        atomic_store(&asset->state, ASSET_LOADED);
+    }
+
+    /*
+        Font glyphs live in bitmaps we can't reach, so they are converted all at
+        once. That also converts bitmaps the loader threads are still decoding,
+        so wait until no load is in flight, which is the case here as assets are
+        only requested from this thread.
+     */
+    if (has_unconverted_fonts && display && get_pending_asset_count() == 0) {
+        al_convert_memory_bitmaps();
+        has_unconverted_fonts = false;
+    }
+}
+
+int get_pending_asset_count()
+{
+    return num_assets_requested - num_assets_finished;
+}
+
+float get_asset_load_progress()
+{
+    if (num_assets_requested == 0) {
+        return 1.0f;
+    }
+    return (float)num_assets_finished / num_assets_requested;
+}
+
+void wait_for_assets()
+{
+    update_assets();
+    while (get_pending_asset_count() > 0) {
+        al_rest(0.001);
+        update_assets();
+    }
+}
+
+ALLEGRO_FONT* get_default_font()
+{
+    return default_font;
+}
+
+float angle_between_points(float x1, float y1, float x2, float y2)
+{
+    return atan2f(y2 - y1, x2 - x1);
+}
+
+float angle_between_points_ex(Point p1, Point p2)
+{
+    return angle_between_points(p1.x, p1.y, p2.x, p2.y);
+}
+
+float distance_between_points(float x1, float y1, float x2, float y2)
+{
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    return sqrtf(dx * dx + dy * dy);
+}
+
+float distance_between_points_ex(Point p1, Point p2)
+{
+    return distance_between_points(p1.x, p1.y, p2.x, p2.y);
+}
+
+float distance_squared_between_points(float x1, float y1, float x2, float y2)
+{
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    return dx * dx + dy * dy;
+}
+
+float distance_squared_between_points_ex(Point p1, Point p2)
+{
+    return distance_squared_between_points(p1.x, p1.y, p2.x, p2.y);
+}
+
+bool rectangles_intersect(float l1, float t1, float r1, float b1, float l2, float t2, float r2, float b2)
+{
+    return !(r1 < l2 || b1 < t2 || l1 > r2 || t1 > b2);
+}
+
+bool rectangles_intersect_ex(Rectangle r1, Rectangle r2)
+{
+    return rectangles_intersect(r1.x, r1.y, r1.x + r1.w, r1.y + r1.h, r2.x, r2.y, r2.x + r2.w, r2.y + r2.h);
+}
+
+bool rectangle_contains_point(float l, float t, float r, float b, float x, float y)
+{
+    return !(x < l || x > r || y < t || y > b);
+}
+
+bool rectangle_contains_point_ex(Rectangle r, Point p)
+{
+    return rectangle_contains_point(r.x, r.y, r.x + r.w, r.y + r.h, p.x, p.y);
+}
+
+bool circles_intersect(float x1, float y1, float r1, float x2, float y2, float r2)
+{
+    float radii = r1 + r2;
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    return (radii * radii) > (dx * dx + dy * dy);
+}
+
+bool circles_intersect_ex(Circle c1, Circle c2)
+{
+    return circles_intersect(c1.x, c1.y, c1.r, c2.x, c2.y, c2.r);
+}
+
+bool circle_contains_point(float x1, float y1, float r, float x2, float y2)
+{
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    return (dx * dx + dy * dy) < (r * r);
+}
+
+bool circle_contains_point_ex(Circle c, Point p)
+{
+    return circle_contains_point(c.x, c.y, c.r, p.x, p.y);
+}
+
+/*
+    Batch collision kernels.
+    Every kernel tests up to 32 shapes and returns the result as one mask word,
+    the SIMD kernels fall back to the scalar ones for the remaining tail.
+ */
+
+static uint32_t rectangles_intersect_word(float l, float t, float r, float b, const float *x, const float *y, const float *w, const float *h, int count)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < count; i++) {
+        if (r >= x[i] && b >= y[i] && l <= x[i] + w[i] && t <= y[i] + h[i])
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+static uint32_t rectangle_contains_points_word(float l, float t, float r, float b, const float *x, const float *y, int count)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < count; i++) {
+        if (x[i] >= l && x[i] <= r && y[i] >= t && y[i] <= b)
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+static uint32_t circles_intersect_word(float cx, float cy, float cr, const float *x, const float *y, const float *r, int count)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < count; i++) {
+        float radii = cr + r[i];
+        float dx = x[i] - cx;
+        float dy = y[i] - cy;
+        if (radii * radii > dx * dx + dy * dy)
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+static uint32_t circle_contains_points_word(float cx, float cy, float cr, const float *x, const float *y, int count)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < count; i++) {
+        float dx = x[i] - cx;
+        float dy = y[i] - cy;
+        if (dx * dx + dy * dy < cr * cr)
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+#if defined(FRAMEWORK_SSE2)
+
+static uint32_t rectangles_intersect_word_sse2(float l, float t, float r, float b, const float *x, const float *y, const float *w, const float *h, int count)
+{
+    __m128 vl = _mm_set1_ps(l), vt = _mm_set1_ps(t), vr = _mm_set1_ps(r), vb = _mm_set1_ps(b);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i);
+        __m128 vy = _mm_loadu_ps(y + i);
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(vr, vx), _mm_cmpge_ps(vb, vy));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(vl, _mm_add_ps(vx, _mm_loadu_ps(w + i))));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(vt, _mm_add_ps(vy, _mm_loadu_ps(h + i))));
+        bits |= (uint32_t)_mm_movemask_ps(hit) << i;
+    }
+    if (i < count)
+        bits |= rectangles_intersect_word(l, t, r, b, x + i, y + i, w + i, h + i, count - i) << i;
+    return bits;
+}
+
+static uint32_t rectangle_contains_points_word_sse2(float l, float t, float r, float b, const float *x, const float *y, int count)
+{
+    __m128 vl = _mm_set1_ps(l), vt = _mm_set1_ps(t), vr = _mm_set1_ps(r), vb = _mm_set1_ps(b);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i);
+        __m128 vy = _mm_loadu_ps(y + i);
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(vx, vl), _mm_cmple_ps(vx, vr));
+        hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(vy, vt), _mm_cmple_ps(vy, vb)));
+        bits |= (uint32_t)_mm_movemask_ps(hit) << i;
+    }
+    if (i < count)
+        bits |= rectangle_contains_points_word(l, t, r, b, x + i, y + i, count - i) << i;
+    return bits;
+}
+
+static uint32_t circles_intersect_word_sse2(float cx, float cy, float cr, const float *x, const float *y, const float *r, int count)
+{
+    __m128 vcx = _mm_set1_ps(cx), vcy = _mm_set1_ps(cy), vcr = _mm_set1_ps(cr);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 radii = _mm_add_ps(vcr, _mm_loadu_ps(r + i));
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), vcx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), vcy);
+        __m128 dist = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        bits |= (uint32_t)_mm_movemask_ps(_mm_cmpgt_ps(_mm_mul_ps(radii, radii), dist)) << i;
+    }
+    if (i < count)
+        bits |= circles_intersect_word(cx, cy, cr, x + i, y + i, r + i, count - i) << i;
+    return bits;
+}
+
+static uint32_t circle_contains_points_word_sse2(float cx, float cy, float cr, const float *x, const float *y, int count)
+{
+    __m128 vcx = _mm_set1_ps(cx), vcy = _mm_set1_ps(cy), vr2 = _mm_set1_ps(cr * cr);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + i), vcx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + i), vcy);
+        __m128 dist = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        bits |= (uint32_t)_mm_movemask_ps(_mm_cmplt_ps(dist, vr2)) << i;
+    }
+    if (i < count)
+        bits |= circle_contains_points_word(cx, cy, cr, x + i, y + i, count - i) << i;
+    return bits;
+}
+
+#endif
+
+#if defined(FRAMEWORK_AVX2)
+
+TARGET_AVX2 static uint32_t rectangles_intersect_word_avx2(float l, float t, float r, float b, const float *x, const float *y, const float *w, const float *h, int count)
+{
+    __m256 vl = _mm256_set1_ps(l), vt = _mm256_set1_ps(t), vr = _mm256_set1_ps(r), vb = _mm256_set1_ps(b);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 vy = _mm256_loadu_ps(y + i);
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(vr, vx, _CMP_GE_OQ), _mm256_cmp_ps(vb, vy, _CMP_GE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(vl, _mm256_add_ps(vx, _mm256_loadu_ps(w + i)), _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_cmp_ps(vt, _mm256_add_ps(vy, _mm256_loadu_ps(h + i)), _CMP_LE_OQ));
+        bits |= (uint32_t)_mm256_movemask_ps(hit) << i;
+    }
+    if (i < count)
+        bits |= rectangles_intersect_word_sse2(l, t, r, b, x + i, y + i, w + i, h + i, count - i) << i;
+    return bits;
+}
+
+TARGET_AVX2 static uint32_t rectangle_contains_points_word_avx2(float l, float t, float r, float b, const float *x, const float *y, int count)
+{
+    __m256 vl = _mm256_set1_ps(l), vt = _mm256_set1_ps(t), vr = _mm256_set1_ps(r), vb = _mm256_set1_ps(b);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 vx = _mm256_loadu_ps(x + i);
+        __m256 vy = _mm256_loadu_ps(y + i);
+        __m256 hit = _mm256_and_ps(_mm256_cmp_ps(vx, vl, _CMP_GE_OQ), _mm256_cmp_ps(vx, vr, _CMP_LE_OQ));
+        hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(vy, vt, _CMP_GE_OQ), _mm256_cmp_ps(vy, vb, _CMP_LE_OQ)));
+        bits |= (uint32_t)_mm256_movemask_ps(hit) << i;
+    }
+    if (i < count)
+        bits |= rectangle_contains_points_word_sse2(l, t, r, b, x + i, y + i, count - i) << i;
+    return bits;
+}
+
+TARGET_AVX2 static uint32_t circles_intersect_word_avx2(float cx, float cy, float cr, const float *x, const float *y, const float *r, int count)
+{
+    __m256 vcx = _mm256_set1_ps(cx), vcy = _mm256_set1_ps(cy), vcr = _mm256_set1_ps(cr);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 radii = _mm256_add_ps(vcr, _mm256_loadu_ps(r + i));
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vcx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), vcy);
+        __m256 dist = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        bits |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(_mm256_mul_ps(radii, radii), dist, _CMP_GT_OQ)) << i;
+    }
+    if (i < count)
+        bits |= circles_intersect_word_sse2(cx, cy, cr, x + i, y + i, r + i, count - i) << i;
+    return bits;
+}
+
+TARGET_AVX2 static uint32_t circle_contains_points_word_avx2(float cx, float cy, float cr, const float *x, const float *y, int count)
+{
+    __m256 vcx = _mm256_set1_ps(cx), vcy = _mm256_set1_ps(cy), vr2 = _mm256_set1_ps(cr * cr);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + i), vcx);
+        __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + i), vcy);
+        __m256 dist = _mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy));
+        bits |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(dist, vr2, _CMP_LT_OQ)) << i;
+    }
+    if (i < count)
+        bits |= circle_contains_points_word_sse2(cx, cy, cr, x + i, y + i, count - i) << i;
+    return bits;
+}
+
+#endif
+
+int rectangles_intersect_batch(Rectangle r, const float *x, const float *y, const float *w, const float *h, int n, uint32_t *out_mask)
+{
+    uint32_t (*kernel)(float, float, float, float, const float *, const float *, const float *, const float *, int) = rectangles_intersect_word;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = rectangles_intersect_word_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = rectangles_intersect_word_avx2;
+#endif
+
+    int hits = 0;
+    for (int i = 0; i < n; i += 32) {
+        int count = n - i < 32 ? n - i : 32;
+        uint32_t bits = kernel(r.x, r.y, r.x + r.w, r.y + r.h, x + i, y + i, w + i, h + i, count);
+        out_mask[i / 32] = bits;
+        hits += count_bits(bits);
+    }
+    return hits;
+}
+
+int rectangle_contains_points_batch(Rectangle r, const float *x, const float *y, int n, uint32_t *out_mask)
+{
+    uint32_t (*kernel)(float, float, float, float, const float *, const float *, int) = rectangle_contains_points_word;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = rectangle_contains_points_word_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = rectangle_contains_points_word_avx2;
+#endif
+
+    int hits = 0;
+    for (int i = 0; i < n; i += 32) {
+        int count = n - i < 32 ? n - i : 32;
+        uint32_t bits = kernel(r.x, r.y, r.x + r.w, r.y + r.h, x + i, y + i, count);
+        out_mask[i / 32] = bits;
+        hits += count_bits(bits);
+    }
+    return hits;
+}
+
+int circles_intersect_batch(Circle c, const float *x, const float *y, const float *r, int n, uint32_t *out_mask)
+{
+    uint32_t (*kernel)(float, float, float, const float *, const float *, const float *, int) = circles_intersect_word;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = circles_intersect_word_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = circles_intersect_word_avx2;
+#endif
+
+    int hits = 0;
+    for (int i = 0; i < n; i += 32) {
+        int count = n - i < 32 ? n - i : 32;
+        uint32_t bits = kernel(c.x, c.y, c.r, x + i, y + i, r + i, count);
+        out_mask[i / 32] = bits;
+        hits += count_bits(bits);
+    }
+    return hits;
+}
+
+int circle_contains_points_batch(Circle c, const float *x, const float *y, int n, uint32_t *out_mask)
+{
+    uint32_t (*kernel)(float, float, float, const float *, const float *, int) = circle_contains_points_word;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = circle_contains_points_word_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = circle_contains_points_word_avx2;
+#endif
+
+    int hits = 0;
+    for (int i = 0; i < n; i += 32) {
+        int count = n - i < 32 ? n - i : 32;
+        uint32_t bits = kernel(c.x, c.y, c.r, x + i, y + i, count);
+        out_mask[i / 32] = bits;
+        hits += count_bits(bits);
+    }
+    return hits;
+}
+
+int batch_mask_to_indices(const uint32_t *mask, int n, int *out_indices)
+{
+    int count = 0;
+    for (int word = 0; word < BATCH_MASK_SIZE(n); word++) {
+        for (uint32_t bits = mask[word]; bits; bits &= bits - 1) {
+            out_indices[count++] = word * 32 + lowest_bit_index(bits);
+        }
+    }
+    return count;
+}
+
+typedef struct {
+    Rectangle bounds;
+    int next_free;
+    int stamp;
+    bool alive;
+} BroadphaseObject;
+
+struct Broadphase {
+    float inv_cell_size;
+    int columns, rows;
+
+    // cell c holds the ids cell_ids[cell_start[c]] to cell_ids[cell_start[c + 1] - 1]
+    int *cell_start;
+    int *cell_ids;
+    int cell_ids_capacity;
+
+    BroadphaseObject *objects;
+    int num_objects;
+    int objects_capacity;
+    int free_list;
+    int stamp;
+
+    BroadphasePair *pairs;
+    int num_pairs;
+    int pairs_capacity;
+
+    bool is_dirty;
+};
+
+static int broadphase_clamp_cell(int cell, int num_cells)
+{
+    return cell < 0 ? 0 : (cell >= num_cells ? num_cells - 1 : cell);
+}
+
+static void broadphase_cell_range(Broadphase *bp, Rectangle r, int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = broadphase_clamp_cell((int)floorf(r.x * bp->inv_cell_size), bp->columns);
+    *y0 = broadphase_clamp_cell((int)floorf(r.y * bp->inv_cell_size), bp->rows);
+    *x1 = broadphase_clamp_cell((int)floorf((r.x + r.w) * bp->inv_cell_size), bp->columns);
+    *y1 = broadphase_clamp_cell((int)floorf((r.y + r.h) * bp->inv_cell_size), bp->rows);
+}
+
+static Rectangle circle_bounds(Circle c)
+{
+    Rectangle r = { c.x - c.r, c.y - c.r, c.r * 2, c.r * 2 };
+    return r;
+}
+
+Broadphase* create_broadphase(float cell_size)
+{
+    assert(cell_size > 0);
+
+    Broadphase *bp = calloc(1, sizeof(Broadphase));
+    if (!bp) {
+        log_error("Failed to create broadphase");
+    }
+
+    bp->inv_cell_size = 1.0f / cell_size;
+    bp->columns = (int)ceilf(get_window_width() / cell_size);
+    bp->rows = (int)ceilf(get_window_height() / cell_size);
+    if (bp->columns < 1) bp->columns = 1;
+    if (bp->rows < 1) bp->rows = 1;
+
+    bp->cell_start = calloc(bp->columns * bp->rows + 1, sizeof(int));
+    if (!bp->cell_start) {
+        log_error("Failed to create broadphase cells");
+    }
+
+    bp->free_list = -1;
+    return bp;
+}
+
+void destroy_broadphase(Broadphase *bp)
+{
+    if (!bp) {
+        return;
+    }
+
+    free(bp->cell_start);
+    free(bp->cell_ids);
+    free(bp->objects);
+    free(bp->pairs);
+    free(bp);
+}
+
+int broadphase_insert(Broadphase *bp, Rectangle bounds)
+{
+    int id;
+    if (bp->free_list >= 0) {
+        id = bp->free_list;
+        bp->free_list = bp->objects[id].next_free;
+    }
+    else {
+        id = bp->num_objects++;
+        bp->objects = grow_array(bp->objects, &bp->objects_capacity, bp->num_objects, sizeof(BroadphaseObject));
+        bp->objects[id].stamp = 0;
+    }
+
+    bp->objects[id].bounds = bounds;
+    bp->objects[id].alive = true;
+    bp->is_dirty = true;
+    return id;
+}
+
+int broadphase_insert_circle(Broadphase *bp, Circle circle)
+{
+    return broadphase_insert(bp, circle_bounds(circle));
+}
+
+void broadphase_remove(Broadphase *bp, int id)
+{
+    assert(id >= 0 && id < bp->num_objects && bp->objects[id].alive);
+    bp->objects[id].alive = false;
+    bp->objects[id].next_free = bp->free_list;
+    bp->free_list = id;
+    bp->is_dirty = true;
+}
+
+void broadphase_move(Broadphase *bp, int id, Rectangle bounds)
+{
+    assert(id >= 0 && id < bp->num_objects && bp->objects[id].alive);
+    bp->objects[id].bounds = bounds;
+    bp->is_dirty = true;
+}
+
+void broadphase_move_circle(Broadphase *bp, int id, Circle circle)
+{
+    broadphase_move(bp, id, circle_bounds(circle));
+}
+
+void broadphase_clear(Broadphase *bp)
+{
+    bp->num_objects = 0;
+    bp->free_list = -1;
+    bp->num_pairs = 0;
+    bp->is_dirty = true;
+}
+
+void broadphase_rebuild(Broadphase *bp)
+{
+    int num_cells = bp->columns * bp->rows;
+    int total = 0;
+    int x0, y0, x1, y1;
+
+    // count the ids in each cell
+    memset(bp->cell_start, 0, (num_cells + 1) * sizeof(int));
+    for (int id = 0; id < bp->num_objects; id++) {
+        if (!bp->objects[id].alive) continue;
+        broadphase_cell_range(bp, bp->objects[id].bounds, &x0, &y0, &x1, &y1);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                bp->cell_start[y * bp->columns + x]++;
+            }
+        }
+        total += (x1 - x0 + 1) * (y1 - y0 + 1);
+    }
+
+    // turn the counts into end offsets, then fill each cell backwards
+    for (int c = 1; c < num_cells; c++) {
+        bp->cell_start[c] += bp->cell_start[c - 1];
+    }
+    bp->cell_start[num_cells] = total;
+    bp->cell_ids = grow_array(bp->cell_ids, &bp->cell_ids_capacity, total, sizeof(int));
+
+    for (int id = 0; id < bp->num_objects; id++) {
+        if (!bp->objects[id].alive) continue;
+        broadphase_cell_range(bp, bp->objects[id].bounds, &x0, &y0, &x1, &y1);
+        for (int y = y0; y <= y1; y++) {
+            for (int x = x0; x <= x1; x++) {
+                bp->cell_ids[--bp->cell_start[y * bp->columns + x]] = id;
+            }
+        }
+    }
+
+    bp->num_pairs = -1;
+    bp->is_dirty = false;
+}
+
+int broadphase_find_pairs(Broadphase *bp, const BroadphasePair **pairs)
+{
+    if (bp->is_dirty) {
+        broadphase_rebuild(bp);
+    }
+
+    // pairs are kept until the grid changes
+    if (bp->num_pairs >= 0) {
+        *pairs = bp->pairs;
+        return bp->num_pairs;
+    }
+
+    bp->num_pairs = 0;
+    for (int c = 0; c < bp->columns * bp->rows; c++) {
+        int begin = bp->cell_start[c];
+        int end = bp->cell_start[c + 1];
+
+        for (int i = begin; i < end; i++) {
+            int a = bp->cell_ids[i];
+            Rectangle ra = bp->objects[a].bounds;
+
+            for (int j = i + 1; j < end; j++) {
+                int b = bp->cell_ids[j];
+                Rectangle rb = bp->objects[b].bounds;
+
+                if (!rectangles_intersect_ex(ra, rb)) continue;
+
+                // only report the pair in the cell holding the top left corner of the overlap
+                int x = broadphase_clamp_cell((int)floorf(fmaxf(ra.x, rb.x) * bp->inv_cell_size), bp->columns);
+                int y = broadphase_clamp_cell((int)floorf(fmaxf(ra.y, rb.y) * bp->inv_cell_size), bp->rows);
+                if (y * bp->columns + x != c) continue;
+
+                bp->pairs = grow_array(bp->pairs, &bp->pairs_capacity, bp->num_pairs + 1, sizeof(BroadphasePair));
+                bp->pairs[bp->num_pairs].a = a < b ? a : b;
+                bp->pairs[bp->num_pairs].b = a < b ? b : a;
+                bp->num_pairs++;
+            }
+        }
+    }
+
+    *pairs = bp->pairs;
+    return bp->num_pairs;
+}
+
+int broadphase_query(Broadphase *bp, Rectangle area, int *out_ids, int max_ids)
+{
+    if (bp->is_dirty) {
+        broadphase_rebuild(bp);
+    }
+
+    // stamps make sure objects spanning several cells are only reported once
+    if (++bp->stamp == INT_MAX) {
+        for (int id = 0; id < bp->num_objects; id++) {
+            bp->objects[id].stamp = 0;
+        }
+        bp->stamp = 1;
+    }
+
+    int count = 0;
+    int x0, y0, x1, y1;
+    broadphase_cell_range(bp, area, &x0, &y0, &x1, &y1);
+
+    for (int y = y0; y <= y1; y++) {
+        for (int x = x0; x <= x1; x++) {
+            int c = y * bp->columns + x;
+            for (int i = bp->cell_start[c]; i < bp->cell_start[c + 1]; i++) {
+                int id = bp->cell_ids[i];
+                if (bp->objects[id].stamp == bp->stamp) continue;
+                bp->objects[id].stamp = bp->stamp;
+
+                if (rectangles_intersect_ex(area, bp->objects[id].bounds)) {
+                    if (count == max_ids) {
+                        return count;
+                    }
+                    out_ids[count++] = id;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+#define AABB_NULL_NODE (-1)
+#define AABB_STACK_SIZE 256
+
+typedef struct {
+    // fat bounds, equal to the object bounds for static objects
+    float min_x, min_y, max_x, max_y;
+    int parent;         // next free node when the node is unused
+    int child1, child2; // AABB_NULL_NODE for leaves
+    int height;         // 0 for leaves, -1 for unused nodes
+} AabbNode;
+
+struct AabbTree {
+    AabbNode *nodes;
+    Rectangle *bounds;  // exact object bounds, only valid for leaves
+    bool *is_static;
+    int capacity;
+    int num_nodes;
+    int free_list;
+    int root;
+    float margin;
+};
+
+enum { AABB_QUERY_POINT, AABB_QUERY_RECTANGLE, AABB_QUERY_CIRCLE };
+
+static float aabb_perimeter(float min_x, float min_y, float max_x, float max_y)
+{
+    return 2.0f * ((max_x - min_x) + (max_y - min_y));
+}
+
+static void aabb_combine(AabbNode *out, const AabbNode *a, const AabbNode *b)
+{
+    out->min_x = fminf(a->min_x, b->min_x);
+    out->min_y = fminf(a->min_y, b->min_y);
+    out->max_x = fmaxf(a->max_x, b->max_x);
+    out->max_y = fmaxf(a->max_y, b->max_y);
+}
+
+static int aabb_tree_allocate_node(AabbTree *tree)
+{
+    if (tree->free_list == AABB_NULL_NODE) {
+        int capacity = tree->capacity;
+        tree->nodes = grow_array(tree->nodes, &capacity, tree->num_nodes + 1, sizeof(AabbNode));
+        capacity = tree->capacity;
+        tree->bounds = grow_array(tree->bounds, &capacity, tree->num_nodes + 1, sizeof(Rectangle));
+        capacity = tree->capacity;
+        tree->is_static = grow_array(tree->is_static, &capacity, tree->num_nodes + 1, sizeof(bool));
+
+        // chain the new nodes into the free list
+        for (int i = tree->num_nodes; i < capacity - 1; i++) {
+            tree->nodes[i].parent = i + 1;
+            tree->nodes[i].height = -1;
+        }
+        tree->nodes[capacity - 1].parent = AABB_NULL_NODE;
+        tree->nodes[capacity - 1].height = -1;
+        tree->free_list = tree->num_nodes;
+        tree->capacity = capacity;
+    }
+
+    int index = tree->free_list;
+    AabbNode *node = &tree->nodes[index];
+    tree->free_list = node->parent;
+    node->parent = AABB_NULL_NODE;
+    node->child1 = AABB_NULL_NODE;
+    node->child2 = AABB_NULL_NODE;
+    node->height = 0;
+    tree->num_nodes++;
+    return index;
+}
+
+static void aabb_tree_free_node(AabbTree *tree, int index)
+{
+    tree->nodes[index].parent = tree->free_list;
+    tree->nodes[index].height = -1;
+    tree->free_list = index;
+    tree->num_nodes--;
+}
+
+/*
+    Rotates the subtree at index a if it is imbalanced.
+    Returns the index of the new subtree root.
+ */
+static int aabb_tree_balance(AabbTree *tree, int ia)
+{
+    AabbNode *nodes = tree->nodes;
+    AabbNode *a = &nodes[ia];
+    if (a->child1 == AABB_NULL_NODE || a->height < 2) {
+        return ia;
+    }
+
+    int ib = a->child1;
+    int ic = a->child2;
+    AabbNode *b = &nodes[ib];
+    AabbNode *c = &nodes[ic];
+    int balance = c->height - b->height;
+
+    // rotate c up
+    if (balance > 1) {
+        int i_f = c->child1;
+        int ig = c->child2;
+        AabbNode *f = &nodes[i_f];
+        AabbNode *g = &nodes[ig];
+
+        c->child1 = ia;
+        c->parent = a->parent;
+        a->parent = ic;
+
+        if (c->parent == AABB_NULL_NODE) {
+            tree->root = ic;
+        }
+        else if (nodes[c->parent].child1 == ia) {
+            nodes[c->parent].child1 = ic;
+        }
+        else {
+            nodes[c->parent].child2 = ic;
+        }
+
+        if (f->height > g->height) {
+            c->child2 = i_f;
+            a->child2 = ig;
+            g->parent = ia;
+            aabb_combine(a, b, g);
+            aabb_combine(c, a, f);
+            a->height = 1 + (b->height > g->height ? b->height : g->height);
+            c->height = 1 + (a->height > f->height ? a->height : f->height);
+        }
+        else {
+            c->child2 = ig;
+            a->child2 = i_f;
+            f->parent = ia;
+            aabb_combine(a, b, f);
+            aabb_combine(c, a, g);
+            a->height = 1 + (b->height > f->height ? b->height : f->height);
+            c->height = 1 + (a->height > g->height ? a->height : g->height);
+        }
+        return ic;
+    }
+
+    // rotate b up
+    if (balance < -1) {
+        int id = b->child1;
+        int ie = b->child2;
+        AabbNode *d = &nodes[id];
+        AabbNode *e = &nodes[ie];
+
+        b->child1 = ia;
+        b->parent = a->parent;
+        a->parent = ib;
+
+        if (b->parent == AABB_NULL_NODE) {
+            tree->root = ib;
+        }
+        else if (nodes[b->parent].child1 == ia) {
+            nodes[b->parent].child1 = ib;
+        }
+        else {
+            nodes[b->parent].child2 = ib;
+        }
+
+        if (d->height > e->height) {
+            b->child2 = id;
+            a->child1 = ie;
+            e->parent = ia;
+            aabb_combine(a, c, e);
+            aabb_combine(b, a, d);
+            a->height = 1 + (c->height > e->height ? c->height : e->height);
+            b->height = 1 + (a->height > d->height ? a->height : d->height);
+        }
+        else {
+            b->child2 = ie;
+            a->child1 = id;
+            d->parent = ia;
+            aabb_combine(a, c, d);
+            aabb_combine(b, a, e);
+            a->height = 1 + (c->height > d->height ? c->height : d->height);
+            b->height = 1 + (a->height > e->height ? a->height : e->height);
+        }
+        return ib;
+    }
+
+    return ia;
+}
+
+// Walks from a node up to the root, rebalancing and refitting on the way.
+static void aabb_tree_refit(AabbTree *tree, int index)
+{
+    while (index != AABB_NULL_NODE) {
+        index = aabb_tree_balance(tree, index);
+
+        AabbNode *node = &tree->nodes[index];
+        AabbNode *child1 = &tree->nodes[node->child1];
+        AabbNode *child2 = &tree->nodes[node->child2];
+        node->height = 1 + (child1->height > child2->height ? child1->height : child2->height);
+        aabb_combine(node, child1, child2);
+
+        index = node->parent;
+    }
+}
+
+static void aabb_tree_insert_leaf(AabbTree *tree, int leaf)
+{
+    AabbNode *nodes = tree->nodes;
+    if (tree->root == AABB_NULL_NODE) {
+        tree->root = leaf;
+        nodes[leaf].parent = AABB_NULL_NODE;
+        return;
+    }
+
+    // find the cheapest sibling using the perimeter as cost
+    AabbNode box = nodes[leaf];
+    int index = tree->root;
+    while (nodes[index].child1 != AABB_NULL_NODE) {
+        AabbNode *node = &nodes[index];
+        AabbNode combined;
+        aabb_combine(&combined, node, &box);
+
+        float area = aabb_perimeter(node->min_x, node->min_y, node->max_x, node->max_y);
+        float combined_area = aabb_perimeter(combined.min_x, combined.min_y, combined.max_x, combined.max_y);
+        float cost = 2.0f * combined_area;
+        float inheritance_cost = 2.0f * (combined_area - area);
+
+        float child_cost[2];
+        int children[2] = { node->child1, node->child2 };
+        for (int i = 0; i < 2; i++) {
+            AabbNode *child = &nodes[children[i]];
+            AabbNode merged;
+            aabb_combine(&merged, child, &box);
+            child_cost[i] = aabb_perimeter(merged.min_x, merged.min_y, merged.max_x, merged.max_y) + inheritance_cost;
+            if (child->child1 != AABB_NULL_NODE) {
+                child_cost[i] -= aabb_perimeter(child->min_x, child->min_y, child->max_x, child->max_y);
+            }
+        }
+
+        if (cost < child_cost[0] && cost < child_cost[1]) {
+            break;
+        }
+        index = child_cost[0] < child_cost[1] ? children[0] : children[1];
+    }
+
+    int sibling = index;
+    int old_parent = nodes[sibling].parent;
+    int new_parent = aabb_tree_allocate_node(tree);
+    nodes = tree->nodes;
+
+    nodes[new_parent].parent = old_parent;
+    nodes[new_parent].height = nodes[sibling].height + 1;
+    nodes[new_parent].child1 = sibling;
+    nodes[new_parent].child2 = leaf;
+    aabb_combine(&nodes[new_parent], &nodes[sibling], &nodes[leaf]);
+    nodes[sibling].parent = new_parent;
+    nodes[leaf].parent = new_parent;
+
+    if (old_parent == AABB_NULL_NODE) {
+        tree->root = new_parent;
+    }
+    else if (nodes[old_parent].child1 == sibling) {
+        nodes[old_parent].child1 = new_parent;
+    }
+    else {
+        nodes[old_parent].child2 = new_parent;
+    }
+
+    aabb_tree_refit(tree, nodes[leaf].parent);
+}
+
+static void aabb_tree_remove_leaf(AabbTree *tree, int leaf)
+{
+    AabbNode *nodes = tree->nodes;
+    if (leaf == tree->root) {
+        tree->root = AABB_NULL_NODE;
+        return;
+    }
+
+    int parent = nodes[leaf].parent;
+    int grand_parent = nodes[parent].parent;
+    int sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+
+    if (grand_parent == AABB_NULL_NODE) {
+        tree->root = sibling;
+        nodes[sibling].parent = AABB_NULL_NODE;
+        aabb_tree_free_node(tree, parent);
+        return;
+    }
+
+    if (nodes[grand_parent].child1 == parent) {
+        nodes[grand_parent].child1 = sibling;
+    }
+    else {
+        nodes[grand_parent].child2 = sibling;
+    }
+    nodes[sibling].parent = grand_parent;
+    aabb_tree_free_node(tree, parent);
+    aabb_tree_refit(tree, grand_parent);
+}
+
+static void aabb_tree_set_leaf_bounds(AabbTree *tree, int id, Rectangle bounds)
+{
+    float margin = tree->is_static[id] ? 0.0f : tree->margin;
+    AabbNode *node = &tree->nodes[id];
+    node->min_x = bounds.x - margin;
+    node->min_y = bounds.y - margin;
+    node->max_x = bounds.x + bounds.w + margin;
+    node->max_y = bounds.y + bounds.h + margin;
+    tree->bounds[id] = bounds;
+}
+
+AabbTree* create_aabb_tree(float margin)
+{
+    AabbTree *tree = calloc(1, sizeof(AabbTree));
+    if (!tree) {
+        log_error("Failed to create aabb tree");
+    }
+
+    tree->free_list = AABB_NULL_NODE;
+    tree->root = AABB_NULL_NODE;
+    tree->margin = margin;
+    return tree;
+}
+
+void destroy_aabb_tree(AabbTree *tree)
+{
+    if (!tree) {
+        return;
+    }
+
+    free(tree->nodes);
+    free(tree->bounds);
+    free(tree->is_static);
+    free(tree);
+}
+
+int aabb_tree_insert(AabbTree *tree, Rectangle bounds, bool is_static)
+{
+    int id = aabb_tree_allocate_node(tree);
+    tree->is_static[id] = is_static;
+    aabb_tree_set_leaf_bounds(tree, id, bounds);
+    aabb_tree_insert_leaf(tree, id);
+    return id;
+}
+
+void aabb_tree_remove(AabbTree *tree, int id)
+{
+    assert(id >= 0 && id < tree->capacity && tree->nodes[id].height == 0);
+    aabb_tree_remove_leaf(tree, id);
+    aabb_tree_free_node(tree, id);
+}
+
+bool aabb_tree_move(AabbTree *tree, int id, Rectangle bounds)
+{
+    assert(id >= 0 && id < tree->capacity && tree->nodes[id].height == 0);
+
+    // still inside the fat bounds, nothing above the leaf changes
+    AabbNode *node = &tree->nodes[id];
+    if (bounds.x >= node->min_x && bounds.y >= node->min_y &&
+        bounds.x + bounds.w <= node->max_x && bounds.y + bounds.h <= node->max_y) {
+        tree->bounds[id] = bounds;
+        return false;
+    }
+
+    aabb_tree_remove_leaf(tree, id);
+    aabb_tree_set_leaf_bounds(tree, id, bounds);
+    aabb_tree_insert_leaf(tree, id);
+    return true;
+}
+
+Rectangle aabb_tree_get_bounds(AabbTree *tree, int id)
+{
+    assert(id >= 0 && id < tree->capacity && tree->nodes[id].height == 0);
+    return tree->bounds[id];
+}
+
+int aabb_tree_get_height(AabbTree *tree)
+{
+    return tree->root == AABB_NULL_NODE ? 0 : tree->nodes[tree->root].height;
+}
+
+static void aabb_tree_query(AabbTree *tree, int kind, Rectangle area, Circle circle, AabbTreeQueryProc callback, void *data)
+{
+    int stack[AABB_STACK_SIZE];
+    int top = 0;
+
+    float l = area.x, t = area.y, r = area.x + area.w, b = area.y + area.h;
+
+    if (tree->root != AABB_NULL_NODE) {
+        stack[top++] = tree->root;
+    }
+
+    while (top > 0) {
+        int index = stack[--top];
+        const AabbNode *node = &tree->nodes[index];
+
+        if (r < node->min_x || b < node->min_y || l > node->max_x || t > node->max_y) {
+            continue;
+        }
+
+        if (node->child1 != AABB_NULL_NODE) {
+            assert(top + 2 <= AABB_STACK_SIZE);
+            stack[top++] = node->child1;
+            stack[top++] = node->child2;
+            continue;
+        }
+
+        Rectangle bounds = tree->bounds[index];
+        bool is_hit;
+        if (kind == AABB_QUERY_POINT) {
+            is_hit = rectangle_contains_point(bounds.x, bounds.y, bounds.x + bounds.w, bounds.y + bounds.h, l, t);
+        }
+        else if (kind == AABB_QUERY_RECTANGLE) {
+            is_hit = rectangles_intersect_ex(area, bounds);
+        }
+        else {
+            // distance from the circle center to the closest point of the rectangle
+            float dx = circle.x - fmaxf(bounds.x, fminf(circle.x, bounds.x + bounds.w));
+            float dy = circle.y - fmaxf(bounds.y, fminf(circle.y, bounds.y + bounds.h));
+            is_hit = dx * dx + dy * dy < circle.r * circle.r;
+        }
+
+        if (is_hit && !callback(index, data)) {
+            return;
+        }
+    }
+}
+
+void aabb_tree_query_point(AabbTree *tree, float x, float y, AabbTreeQueryProc callback, void *data)
+{
+    Rectangle area = { x, y, 0, 0 };
+    Circle unused = { 0, 0, 0 };
+    aabb_tree_query(tree, AABB_QUERY_POINT, area, unused, callback, data);
+}
+
+void aabb_tree_query_rectangle(AabbTree *tree, Rectangle area, AabbTreeQueryProc callback, void *data)
+{
+    Circle unused = { 0, 0, 0 };
+    aabb_tree_query(tree, AABB_QUERY_RECTANGLE, area, unused, callback, data);
+}
+
+void aabb_tree_query_circle(AabbTree *tree, Circle area, AabbTreeQueryProc callback, void *data)
+{
+    aabb_tree_query(tree, AABB_QUERY_CIRCLE, circle_bounds(area), area, callback, data);
+}
+
+/*
+    Intersects the ray x + t * dx, y + t * dy with a box using the slab method.
+    Returns the entry fraction, or a negative value if the box is missed before max_fraction.
+ */
+static float ray_box_fraction(float x, float y, float dx, float dy, float min_x, float min_y, float max_x, float max_y, float max_fraction)
+{
+    float t_min = 0.0f;
+    float t_max = max_fraction;
+
+    float origin[2] = { x, y };
+    float dir[2] = { dx, dy };
+    float lo[2] = { min_x, min_y };
+    float hi[2] = { max_x, max_y };
+
+    for (int axis = 0; axis < 2; axis++) {
+        if (fabsf(dir[axis]) < 1e-9f) {
+            if (origin[axis] < lo[axis] || origin[axis] > hi[axis]) {
+                return -1.0f;
+            }
+            continue;
+        }
+
+        float inv = 1.0f / dir[axis];
+        float t1 = (lo[axis] - origin[axis]) * inv;
+        float t2 = (hi[axis] - origin[axis]) * inv;
+        if (t1 > t2) {
+            float tmp = t1;
+            t1 = t2;
+            t2 = tmp;
+        }
+
+        t_min = fmaxf(t_min, t1);
+        t_max = fminf(t_max, t2);
+        if (t_min > t_max) {
+            return -1.0f;
+        }
+    }
+
+    return t_min;
+}
+
+void aabb_tree_raycast(AabbTree *tree, float x1, float y1, float x2, float y2, AabbTreeRaycastProc callback, void *data)
+{
+    int stack[AABB_STACK_SIZE];
+    int top = 0;
+
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    float max_fraction = 1.0f;
+
+    if (tree->root != AABB_NULL_NODE) {
+        stack[top++] = tree->root;
+    }
+
+    while (top > 0) {
+        int index = stack[--top];
+        const AabbNode *node = &tree->nodes[index];
+
+        if (ray_box_fraction(x1, y1, dx, dy, node->min_x, node->min_y, node->max_x, node->max_y, max_fraction) < 0) {
+            continue;
+        }
+
+        if (node->child1 != AABB_NULL_NODE) {
+            assert(top + 2 <= AABB_STACK_SIZE);
+            stack[top++] = node->child1;
+            stack[top++] = node->child2;
+            continue;
+        }
+
+        Rectangle bounds = tree->bounds[index];
+        float fraction = ray_box_fraction(x1, y1, dx, dy, bounds.x, bounds.y, bounds.x + bounds.w, bounds.y + bounds.h, max_fraction);
+        if (fraction < 0) {
+            continue;
+        }
+
+        float result = callback(index, fraction, data);
+        if (result <= 0) {
+            return;
+        }
+        if (result < max_fraction) {
+            max_fraction = result;
+        }
+    }
+}
+
+#define TILEMAP_MAGIC "TMAP"
+#define TILEMAP_VERSION 1
+
+typedef struct {
+    ALLEGRO_BITMAP *bitmap;     // static layers, NULL if they are empty
+    bool is_dirty;
+} TilemapChunk;
+
+struct Tilemap {
+    int width, height;          // in tiles
+    int num_layers;
+    uint16_t *tiles;            // layer after layer, row by row
+    bool is_dynamic[MAX_TILEMAP_LAYERS];
+    int collision_layer;
+
+    ALLEGRO_BITMAP *tileset;
+    int tile_width, tile_height;
+    int tileset_columns;
+
+    TilemapChunk *chunks;
+    int chunk_columns, chunk_rows;
+};
+
+Tilemap* create_tilemap(int width, int height, int num_layers, ALLEGRO_BITMAP *tileset, int tile_width, int tile_height)
+{
+    assert(width > 0 && height > 0 && tile_width > 0 && tile_height > 0);
+    assert(num_layers > 0 && num_layers <= MAX_TILEMAP_LAYERS);
+
+    Tilemap *map = calloc(1, sizeof(Tilemap));
+    if (!map) {
+        log_error("Failed to create tilemap");
+    }
+
+    map->width = width;
+    map->height = height;
+    map->num_layers = num_layers;
+    map->tileset = tileset;
+    map->tile_width = tile_width;
+    map->tile_height = tile_height;
+    map->tileset_columns = tileset ? al_get_bitmap_width(tileset) / tile_width : 0;
+    map->chunk_columns = (width + TILEMAP_CHUNK_SIZE - 1) / TILEMAP_CHUNK_SIZE;
+    map->chunk_rows = (height + TILEMAP_CHUNK_SIZE - 1) / TILEMAP_CHUNK_SIZE;
+
+    map->tiles = calloc((size_t)width * height * num_layers, sizeof(uint16_t));
+    map->chunks = calloc(map->chunk_columns * map->chunk_rows, sizeof(TilemapChunk));
+    if (!map->tiles || !map->chunks) {
+        log_error("Failed to allocate tilemap of %dx%d tiles", width, height);
+    }
+    for (int i = 0; i < map->chunk_columns * map->chunk_rows; i++) {
+        map->chunks[i].is_dirty = true;
+    }
+
+    return map;
+}
+
+static uint32_t read_u32le(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static Tilemap* parse_binary_tilemap(const unsigned char *data, int64_t size, ALLEGRO_BITMAP *tileset, int tile_width, int tile_height)
+{
+    if (size < 17 || data[4] != TILEMAP_VERSION) {
+        return NULL;
+    }
+
+    uint32_t width = read_u32le(data + 5);
+    uint32_t height = read_u32le(data + 9);
+    uint32_t num_layers = read_u32le(data + 13);
+    if (width == 0 || height == 0 || num_layers == 0 || num_layers > MAX_TILEMAP_LAYERS ||
+        (uint64_t)width * height * num_layers * 2 != (uint64_t)size - 17) {
+        return NULL;
+    }
+
+    Tilemap *map = create_tilemap(width, height, num_layers, tileset, tile_width, tile_height);
+    const unsigned char *p = data + 17;
+    for (size_t i = 0; i < (size_t)width * height * num_layers; i++, p += 2) {
+        map->tiles[i] = p[0] | (p[1] << 8);
+    }
+    return map;
+}
+
+// Rows are lines of comma separated tiles, layers are separated by empty lines.
+static Tilemap* parse_csv_tilemap(const char *text, ALLEGRO_BITMAP *tileset, int tile_width, int tile_height)
+{
+    int width = 0, rows = 0, num_layers = 0, layer_rows = 0, height = 0;
+    for (const char *line = text; *line; ) {
+        const char *end = line + strcspn(line, "\n");
+        int count = 0;
+        for (const char *c = line; c < end; c++) {
+            if (*c >= '0' && *c <= '9' && (c == line || c[-1] < '0' || c[-1] > '9')) {
+                count++;
+            }
+        }
+
+        if (count > 0) {
+            if (width == 0) {
+                width = count;
+            }
+            else if (count != width) {
+                return NULL;
+            }
+            if (layer_rows++ == 0) {
+                num_layers++;
+            }
+            rows++;
+        }
+        else if (layer_rows > 0) {
+            if (height != 0 && layer_rows != height) {
+                return NULL;
+            }
+            height = layer_rows;
+            layer_rows = 0;
+        }
+        line = *end ? end + 1 : end;
+    }
+    if (layer_rows > 0) {
+        if (height != 0 && layer_rows != height) {
+            return NULL;
+        }
+        height = layer_rows;
+    }
+    if (width == 0 || num_layers > MAX_TILEMAP_LAYERS) {
+        return NULL;
+    }
+
+    Tilemap *map = create_tilemap(width, height, num_layers, tileset, tile_width, tile_height);
+    int i = 0;
+    for (const char *c = text; *c && i < rows * width; ) {
+        if (*c >= '0' && *c <= '9') {
+            char *end;
+            unsigned long long value = strtoull(c, &end, 10);
+            // Tiled keeps the flip and rotation flags in the top 3 bits, tiles are drawn unflipped
+            unsigned long long tile = value & 0x1fffffff;
+            bool is_negative = c > text && c[-1] == '-';
+            if (is_negative || value > UINT32_MAX || tile > 0xffff) {
+                log_warning("Tile %s%llu is out of range", is_negative ? "-" : "", value);
+                destroy_tilemap(map);
+                return NULL;
+            }
+            map->tiles[i++] = (uint16_t)tile;
+            c = end;
+        }
+        else {
+            c++;
+        }
+    }
+    return map;
+}
+
+Tilemap* load_tilemap(const char *filename, ALLEGRO_BITMAP *tileset, int tile_width, int tile_height)
+{
+    ALLEGRO_FILE *file = al_fopen(filename, "rb");
+    if (!file) {
+        log_warning("Failed to open %s", filename);
+        return NULL;
+    }
+
+    int64_t size = al_fsize(file);
+    char *data = malloc(size > 0 ? size + 1 : 1);
+    if (!data) {
+        log_error("Failed to allocate %d bytes for %s", (int)size, filename);
+    }
+    bool is_read = size >= 0 && al_fread(file, data, size) == (size_t)size;
+    al_fclose(file);
+
+    Tilemap *map = NULL;
+    if (is_read) {
+        data[size] = '\0';
+        if (size >= 4 && memcmp(data, TILEMAP_MAGIC, 4) == 0) {
+            map = parse_binary_tilemap((unsigned char *)data, size, tileset, tile_width, tile_height);
+        }
+        else {
+            map = parse_csv_tilemap(data, tileset, tile_width, tile_height);
+        }
+    }
+    free(data);
+
+    if (!map) {
+        log_warning("%s is not a tilemap", filename);
+    }
+    return map;
+}
+
+bool save_tilemap(Tilemap *map, const char *filename)
+{
+    size_t num_tiles = (size_t)map->width * map->height * map->num_layers;
+    size_t size = 17 + num_tiles * 2;
+    unsigned char *data = malloc(size);
+    if (!data) {
+        log_error("Failed to allocate %d bytes for %s", (int)size, filename);
+    }
+
+    memcpy(data, TILEMAP_MAGIC, 4);
+    data[4] = TILEMAP_VERSION;
+    uint32_t header[3] = { map->width, map->height, map->num_layers };
+    for (int i = 0; i < 3; i++) {
+        for (int b = 0; b < 4; b++) {
+            data[5 + i * 4 + b] = (header[i] >> (b * 8)) & 0xff;
+        }
+    }
+    for (size_t i = 0; i < num_tiles; i++) {
+        data[17 + i * 2] = map->tiles[i] & 0xff;
+        data[18 + i * 2] = map->tiles[i] >> 8;
+    }
+
+    ALLEGRO_FILE *file = al_fopen(filename, "wb");
+    if (!file) {
+        log_warning("Failed to open %s", filename);
+        free(data);
+        return false;
+    }
+
+    bool is_written = al_fwrite(file, data, size) == size;
+    free(data);
+    return al_fclose(file) && is_written;
+}
+
+void destroy_tilemap(Tilemap *map)
+{
+    if (!map) {
+        return;
+    }
+
+    for (int i = 0; i < map->chunk_columns * map->chunk_rows; i++) {
+        if (map->chunks[i].bitmap) {
+            al_destroy_bitmap(map->chunks[i].bitmap);
+        }
+    }
+    free(map->chunks);
+    free(map->tiles);
+    free(map);
+}
+
+int get_tile(Tilemap *map, int layer, int x, int y)
+{
+    assert(layer >= 0 && layer < map->num_layers);
+    if (x < 0 || y < 0 || x >= map->width || y >= map->height) {
+        return 0;
+    }
+    return map->tiles[((size_t)layer * map->height + y) * map->width + x];
+}
+
+void set_tile(Tilemap *map, int layer, int x, int y, int tile)
+{
+    assert(layer >= 0 && layer < map->num_layers);
+    assert(tile >= 0 && tile <= 0xffff);
+    if (x < 0 || y < 0 || x >= map->width || y >= map->height) {
+        return;
+    }
+
+    uint16_t *t = &map->tiles[((size_t)layer * map->height + y) * map->width + x];
+    if (*t != tile) {
+        *t = (uint16_t)tile;
+        if (!map->is_dynamic[layer]) {
+            map->chunks[(y / TILEMAP_CHUNK_SIZE) * map->chunk_columns + x / TILEMAP_CHUNK_SIZE].is_dirty = true;
+        }
+    }
+}
+
+void set_tilemap_layer_dynamic(Tilemap *map, int layer, bool is_dynamic)
+{
+    assert(layer >= 0 && layer < map->num_layers);
+    if (map->is_dynamic[layer] != is_dynamic) {
+        map->is_dynamic[layer] = is_dynamic;
+        for (int i = 0; i < map->chunk_columns * map->chunk_rows; i++) {
+            map->chunks[i].is_dirty = true;
+        }
+    }
+}
+
+// Draws the tiles of some layers of a chunk with its top left corner at (x, y).
+static void draw_chunk_tiles(Tilemap *map, int chunk_x, int chunk_y, bool is_dynamic, float x, float y)
+{
+    int tx0 = chunk_x * TILEMAP_CHUNK_SIZE, ty0 = chunk_y * TILEMAP_CHUNK_SIZE;
+    int tx1 = tx0 + TILEMAP_CHUNK_SIZE < map->width ? tx0 + TILEMAP_CHUNK_SIZE : map->width;
+    int ty1 = ty0 + TILEMAP_CHUNK_SIZE < map->height ? ty0 + TILEMAP_CHUNK_SIZE : map->height;
+
+    for (int layer = 0; layer < map->num_layers; layer++) {
+        if (map->is_dynamic[layer] != is_dynamic) {
+            continue;
+        }
+        for (int ty = ty0; ty < ty1; ty++) {
+            const uint16_t *row = &map->tiles[((size_t)layer * map->height + ty) * map->width];
+            for (int tx = tx0; tx < tx1; tx++) {
+                int tile = row[tx];
+                if (tile == 0 || map->tileset_columns == 0) {
+                    continue;
+                }
+                al_draw_bitmap_region(map->tileset,
+                                      ((tile - 1) % map->tileset_columns) * map->tile_width,
+                                      ((tile - 1) / map->tileset_columns) * map->tile_height,
+                                      map->tile_width, map->tile_height,
+                                      x + (tx - tx0) * map->tile_width, y + (ty - ty0) * map->tile_height, 0);
+            }
+        }
+    }
+}
+
+static bool is_chunk_empty(Tilemap *map, int chunk_x, int chunk_y)
+{
+    int tx0 = chunk_x * TILEMAP_CHUNK_SIZE, ty0 = chunk_y * TILEMAP_CHUNK_SIZE;
+    int tx1 = tx0 + TILEMAP_CHUNK_SIZE < map->width ? tx0 + TILEMAP_CHUNK_SIZE : map->width;
+    int ty1 = ty0 + TILEMAP_CHUNK_SIZE < map->height ? ty0 + TILEMAP_CHUNK_SIZE : map->height;
+
+    for (int layer = 0; layer < map->num_layers; layer++) {
+        if (map->is_dynamic[layer]) {
+            continue;
+        }
+        for (int ty = ty0; ty < ty1; ty++) {
+            for (int tx = tx0; tx < tx1; tx++) {
+                if (map->tiles[((size_t)layer * map->height + ty) * map->width + tx]) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static void redraw_chunk(Tilemap *map, int chunk_x, int chunk_y)
+{
+    TilemapChunk *chunk = &map->chunks[chunk_y * map->chunk_columns + chunk_x];
+    chunk->is_dirty = false;
+
+    if (is_chunk_empty(map, chunk_x, chunk_y)) {
+        if (chunk->bitmap) {
+            al_destroy_bitmap(chunk->bitmap);
+            chunk->bitmap = NULL;
+        }
+        return;
+    }
+
+    if (!chunk->bitmap) {
+        chunk->bitmap = al_create_bitmap(TILEMAP_CHUNK_SIZE * map->tile_width, TILEMAP_CHUNK_SIZE * map->tile_height);
+        if (!chunk->bitmap) {
+            log_error("Failed to create tilemap chunk bitmap");
+        }
+    }
+
+    ALLEGRO_STATE state;
+    al_store_state(&state, ALLEGRO_STATE_TARGET_BITMAP);
+    al_set_target_bitmap(chunk->bitmap);
+    al_clear_to_color(al_map_rgba(0, 0, 0, 0));
+    al_hold_bitmap_drawing(true);
+    draw_chunk_tiles(map, chunk_x, chunk_y, false, 0, 0);
+    al_hold_bitmap_drawing(false);
+    al_restore_state(&state);
+}
+
+void draw_tilemap(Tilemap *map, float x, float y, Rectangle view)
+{
+    float chunk_width = TILEMAP_CHUNK_SIZE * map->tile_width;
+    float chunk_height = TILEMAP_CHUNK_SIZE * map->tile_height;
+
+    // the chunks overlapping view
+    int cx0 = (int)floorf((view.x - x) / chunk_width);
+    int cy0 = (int)floorf((view.y - y) / chunk_height);
+    int cx1 = (int)floorf((view.x + view.w - x) / chunk_width);
+    int cy1 = (int)floorf((view.y + view.h - y) / chunk_height);
+    cx0 = cx0 < 0 ? 0 : cx0;
+    cy0 = cy0 < 0 ? 0 : cy0;
+    cx1 = cx1 >= map->chunk_columns ? map->chunk_columns - 1 : cx1;
+    cy1 = cy1 >= map->chunk_rows ? map->chunk_rows - 1 : cy1;
+
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            TilemapChunk *chunk = &map->chunks[cy * map->chunk_columns + cx];
+            if (chunk->is_dirty) {
+                redraw_chunk(map, cx, cy);
+            }
+        }
+    }
+
+    // held drawing batches the chunk bitmaps and the dynamic tiles that share the tileset
+    al_hold_bitmap_drawing(true);
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            TilemapChunk *chunk = &map->chunks[cy * map->chunk_columns + cx];
+            if (chunk->bitmap) {
+                al_draw_bitmap(chunk->bitmap, x + cx * chunk_width, y + cy * chunk_height, 0);
+            }
+        }
+    }
+    for (int cy = cy0; cy <= cy1; cy++) {
+        for (int cx = cx0; cx <= cx1; cx++) {
+            draw_chunk_tiles(map, cx, cy, true, x + cx * chunk_width, y + cy * chunk_height);
+        }
+    }
+    al_hold_bitmap_drawing(false);
+}
+
+void set_tilemap_collision_layer(Tilemap *map, int layer)
+{
+    assert(layer >= 0 && layer < map->num_layers);
+    map->collision_layer = layer;
+}
+
+// Finds the range of tiles overlapping r, returns false if there are none.
+static bool tilemap_tile_range(Tilemap *map, Rectangle r, int *x0, int *y0, int *x1, int *y1)
+{
+    *x0 = (int)floorf(r.x / map->tile_width);
+    *y0 = (int)floorf(r.y / map->tile_height);
+    *x1 = (int)ceilf((r.x + r.w) / map->tile_width) - 1;
+    *y1 = (int)ceilf((r.y + r.h) / map->tile_height) - 1;
+    *x0 = *x0 < 0 ? 0 : *x0;
+    *y0 = *y0 < 0 ? 0 : *y0;
+    *x1 = *x1 >= map->width ? map->width - 1 : *x1;
+    *y1 = *y1 >= map->height ? map->height - 1 : *y1;
+    return *x0 <= *x1 && *y0 <= *y1;
+}
+
+bool tilemap_rectangle_collides(Tilemap *map, Rectangle r)
+{
+    return tilemap_query_rectangle(map, r, NULL, 1) > 0;
+}
+
+int tilemap_query_rectangle(Tilemap *map, Rectangle area, Rectangle *out_tiles, int max_tiles)
+{
+    int x0, y0, x1, y1;
+    if (!tilemap_tile_range(map, area, &x0, &y0, &x1, &y1)) {
+        return 0;
+    }
+
+    int count = 0;
+    for (int y = y0; y <= y1 && count < max_tiles; y++) {
+        const uint16_t *row = &map->tiles[((size_t)map->collision_layer * map->height + y) * map->width];
+        for (int x = x0; x <= x1 && count < max_tiles; x++) {
+            if (!row[x]) {
+                continue;
+            }
+            if (out_tiles) {
+                Rectangle tile = { x * map->tile_width, y * map->tile_height, map->tile_width, map->tile_height };
+                out_tiles[count] = tile;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+
+void get_camera_transform(const Camera *camera, ALLEGRO_TRANSFORM *out)
+{
+    al_identity_transform(out);
+    al_translate_transform(out, -camera->x, -camera->y);
+    al_rotate_transform(out, camera->rotation);
+    al_scale_transform(out, camera->zoom, camera->zoom);
+    al_translate_transform(out, camera->viewport.x + camera->viewport.w / 2, camera->viewport.y + camera->viewport.h / 2);
+}
+
+Rectangle get_camera_bounds(const Camera *camera)
+{
+    // the half size of the viewport in world units, rotated
+    float half_w = camera->viewport.w / 2 / camera->zoom;
+    float half_h = camera->viewport.h / 2 / camera->zoom;
+    float c = fabsf(cosf(camera->rotation)), s = fabsf(sinf(camera->rotation));
+    float extent_x = c * half_w + s * half_h;
+    float extent_y = s * half_w + c * half_h;
+    Rectangle bounds = { camera->x - extent_x, camera->y - extent_y, extent_x * 2, extent_y * 2 };
+    return bounds;
+}
+
+// Same order of operations as get_camera_transform().
+Point world_to_screen(const Camera *camera, float x, float y)
+{
+    float c = cosf(camera->rotation) * camera->zoom, s = sinf(camera->rotation) * camera->zoom;
+    float dx = x - camera->x, dy = y - camera->y;
+    Point p = {
+        camera->viewport.x + camera->viewport.w / 2 + dx * c - dy * s,
+        camera->viewport.y + camera->viewport.h / 2 + dx * s + dy * c
+    };
+    return p;
+}
+
+Point screen_to_world(const Camera *camera, float x, float y)
+{
+    float c = cosf(camera->rotation) / camera->zoom, s = sinf(camera->rotation) / camera->zoom;
+    float dx = x - (camera->viewport.x + camera->viewport.w / 2);
+    float dy = y - (camera->viewport.y + camera->viewport.h / 2);
+    Point p = { camera->x + dx * c + dy * s, camera->y - dx * s + dy * c };
+    return p;
+}
+
+void begin_camera(const Camera *camera)
+{
+    // queued sprites were meant for the previous transform
+    flush_sprites();
+
+    ALLEGRO_TRANSFORM transform;
+    get_camera_transform(camera, &transform);
+    al_use_transform(&transform);
+    al_set_clipping_rectangle((int)camera->viewport.x, (int)camera->viewport.y, (int)camera->viewport.w, (int)camera->viewport.h);
+
+    camera_bounds = get_camera_bounds(camera);
+    is_camera_active = true;
+}
+
+void end_camera()
+{
+    if (!is_camera_active) {
+        return;
+    }
+
+    flush_sprites();
+
+    ALLEGRO_TRANSFORM transform;
+    al_identity_transform(&transform);
+    al_use_transform(&transform);
+    al_reset_clipping_rectangle();
+    is_camera_active = false;
+}
+
+static Rectangle get_cull_bounds()
+{
+    if (is_camera_active) {
+        return camera_bounds;
+    }
+    Rectangle window = { 0, 0, get_window_width(), get_window_height() };
+    return window;
+}
+
+bool is_rectangle_visible(Rectangle r)
+{
+    return rectangles_intersect_ex(get_cull_bounds(), r);
+}
+
+// Circles are tested by their bounding box, a few near the corners of the view pass without being seen.
+bool is_circle_visible(Circle c)
+{
+    Rectangle b = get_cull_bounds();
+    return rectangles_intersect(b.x, b.y, b.x + b.w, b.y + b.h, c.x - c.r, c.y - c.r, c.x + c.r, c.y + c.r);
+}
+
+int cull_rectangles(const Rectangle *rectangles, int n, int *out_indices)
+{
+    Rectangle b = get_cull_bounds();
+    float l = b.x, t = b.y, r = b.x + b.w, bottom = b.y + b.h;
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        const Rectangle *rect = &rectangles[i];
+        out_indices[count] = i;
+        count += r >= rect->x && bottom >= rect->y && l <= rect->x + rect->w && t <= rect->y + rect->h;
+    }
+    return count;
+}
+
+int cull_circles(const Circle *circles, int n, int *out_indices)
+{
+    Rectangle b = get_cull_bounds();
+    float l = b.x, t = b.y, r = b.x + b.w, bottom = b.y + b.h;
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        const Circle *c = &circles[i];
+        out_indices[count] = i;
+        count += r >= c->x - c->r && bottom >= c->y - c->r && l <= c->x + c->r && t <= c->y + c->r;
+    }
+    return count;
+}
+
+int cull_rectangles_batch(const float *x, const float *y, const float *w, const float *h, int n, uint32_t *out_mask)
+{
+    return rectangles_intersect_batch(get_cull_bounds(), x, y, w, h, n, out_mask);
+}
+
+static uint32_t cull_circles_word(float l, float t, float r, float b, const float *x, const float *y, const float *radius, int count)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < count; i++) {
+        if (r >= x[i] - radius[i] && b >= y[i] - radius[i] && l <= x[i] + radius[i] && t <= y[i] + radius[i])
+            bits |= 1u << i;
+    }
+    return bits;
+}
+
+#if defined(FRAMEWORK_SSE2)
+static uint32_t cull_circles_word_sse2(float l, float t, float r, float b, const float *x, const float *y, const float *radius, int count)
+{
+    __m128 vl = _mm_set1_ps(l), vt = _mm_set1_ps(t), vr = _mm_set1_ps(r), vb = _mm_set1_ps(b);
+    uint32_t bits = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 vx = _mm_loadu_ps(x + i);
+        __m128 vy = _mm_loadu_ps(y + i);
+        __m128 vradius = _mm_loadu_ps(radius + i);
+        __m128 hit = _mm_and_ps(_mm_cmpge_ps(vr, _mm_sub_ps(vx, vradius)), _mm_cmpge_ps(vb, _mm_sub_ps(vy, vradius)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(vl, _mm_add_ps(vx, vradius)));
+        hit = _mm_and_ps(hit, _mm_cmple_ps(vt, _mm_add_ps(vy, vradius)));
+        bits |= (uint32_t)_mm_movemask_ps(hit) << i;
+    }
+    if (i < count)
+        bits |= cull_circles_word(l, t, r, b, x + i, y + i, radius + i, count - i) << i;
+    return bits;
+}
+#endif
+
+int cull_circles_batch(const float *x, const float *y, const float *r, int n, uint32_t *out_mask)
+{
+    uint32_t (*kernel)(float, float, float, float, const float *, const float *, const float *, int) = cull_circles_word;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() >= SIMD_SSE2) kernel = cull_circles_word_sse2;
+#endif
+
+    Rectangle b = get_cull_bounds();
+    int hits = 0;
+    for (int i = 0; i < n; i += 32) {
+        int count = n - i < 32 ? n - i : 32;
+        uint32_t bits = kernel(b.x, b.y, b.x + b.w, b.y + b.h, x + i, y + i, r + i, count);
+        out_mask[i / 32] = bits;
+        hits += count_bits(bits);
+    }
+    return hits;
+}
+
+#define PATH_SQRT2 1.41421356f
+#define PATH_INFINITY 1e30f
+
+typedef struct {
+    float f;
+    int index;
+} PathHeapEntry;
+
+// A binary min heap, stale entries are skipped when popped instead of being updated.
+typedef struct {
+    PathHeapEntry *entries;
+    int count;
+    int capacity;
+} PathHeap;
+
+typedef struct {
+    float *g;
+    int *parent;
+    uint32_t *seen;             // == stamp if g and parent are set in this search
+    uint32_t *closed;           // == stamp if the cell has been expanded
+    uint32_t stamp;
+    PathHeap open;
+    int start, goal;
+    int algorithm;
+} PathSearch;
+
+typedef struct {
+    int goal;                   // -1 if unused
+    uint32_t last_used;
+    float *distance;
+    int *parent;                // next cell towards the goal, -1 if none
+} FlowField;
+
+struct PathRequest {
+    int start_x, start_y, goal_x, goal_y;
+    int algorithm;
+    int state;
+    GridCell *cells;
+    int num_cells;
+    PathRequest *next;
+};
+
+struct PathGrid {
+    int width, height;
+    uint8_t *is_blocked;
+
+    PathSearch search;          // used by find_path()
+    PathSearch sliced_search;   // used by the first pending request
+    bool is_sliced_search_started;
+    PathRequest *requests_head, *requests_tail;
+
+    FlowField flow_fields[MAX_FLOW_FIELDS];
+    uint32_t flow_clock;
+    PathHeap flow_heap;
+    int *repair_queue;
+    uint32_t *repair_marks;
+    uint32_t repair_stamp;
+};
+
+static const int path_dx[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+static const int path_dy[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+
+static void path_heap_push(PathHeap *heap, float f, int index)
+{
+    heap->entries = grow_array(heap->entries, &heap->capacity, heap->count + 1, sizeof(PathHeapEntry));
+    int i = heap->count++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (heap->entries[parent].f <= f) {
+            break;
+        }
+        heap->entries[i] = heap->entries[parent];
+        i = parent;
+    }
+    heap->entries[i].f = f;
+    heap->entries[i].index = index;
+}
+
+static PathHeapEntry path_heap_pop(PathHeap *heap)
+{
+    PathHeapEntry top = heap->entries[0];
+    PathHeapEntry last = heap->entries[--heap->count];
+    int i = 0;
+    while (true) {
+        int child = i * 2 + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && heap->entries[child + 1].f < heap->entries[child].f) {
+            child++;
+        }
+        if (last.f <= heap->entries[child].f) {
+            break;
+        }
+        heap->entries[i] = heap->entries[child];
+        i = child;
+    }
+    if (heap->count > 0) {
+        heap->entries[i] = last;
+    }
+    return top;
+}
+
+static bool is_walkable(PathGrid *grid, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < grid->width && y < grid->height && !grid->is_blocked[y * grid->width + x];
+}
+
+// Diagonal moves need both cells next to the corner to be free.
+static bool can_move(PathGrid *grid, int x, int y, int dx, int dy)
+{
+    if (!is_walkable(grid, x + dx, y + dy)) {
+        return false;
+    }
+    return dx == 0 || dy == 0 || (is_walkable(grid, x + dx, y) && is_walkable(grid, x, y + dy));
+}
+
+static float octile_distance(int x1, int y1, int x2, int y2)
+{
+    int dx = abs(x1 - x2), dy = abs(y1 - y2);
+    int diagonal = dx < dy ? dx : dy;
+    return (dx + dy - 2 * diagonal) + diagonal * PATH_SQRT2;
+}
+
+static void init_path_search(PathSearch *search, int num_cells)
+{
+    search->g = malloc(num_cells * sizeof(float));
+    search->parent = malloc(num_cells * sizeof(int));
+    search->seen = calloc(num_cells, sizeof(uint32_t));
+    search->closed = calloc(num_cells, sizeof(uint32_t));
+    if (!search->g || !search->parent || !search->seen || !search->closed) {
+        log_error("Failed to allocate path search for %d cells", num_cells);
+    }
+}
+
+static void free_path_search(PathSearch *search)
+{
+    free(search->g);
+    free(search->parent);
+    free(search->seen);
+    free(search->closed);
+    free(search->open.entries);
+}
+
+static void begin_path_search(PathGrid *grid, PathSearch *search, int start_x, int start_y, int goal_x, int goal_y, int algorithm)
+{
+    // stamps save clearing the arrays for every search
+    if (++search->stamp == 0) {
+        memset(search->seen, 0, grid->width * grid->height * sizeof(uint32_t));
+        memset(search->closed, 0, grid->width * grid->height * sizeof(uint32_t));
+        search->stamp = 1;
+    }
+
+    search->open.count = 0;
+    search->algorithm = algorithm;
+    search->start = start_y * grid->width + start_x;
+    search->goal = goal_y * grid->width + goal_x;
+
+    if (is_walkable(grid, start_x, start_y) && is_walkable(grid, goal_x, goal_y)) {
+        search->g[search->start] = 0;
+        search->parent[search->start] = -1;
+        search->seen[search->start] = search->stamp;
+        path_heap_push(&search->open, octile_distance(start_x, start_y, goal_x, goal_y), search->start);
+    }
+}
+
+static void relax_path_cell(PathGrid *grid, PathSearch *search, int index, int parent, float g)
+{
+    if (search->closed[index] == search->stamp) {
+        return;
+    }
+    if (search->seen[index] == search->stamp && search->g[index] <= g) {
+        return;
+    }
+
+    search->seen[index] = search->stamp;
+    search->g[index] = g;
+    search->parent[index] = parent;
+    int x = index % grid->width, y = index / grid->width;
+    path_heap_push(&search->open, g + octile_distance(x, y, search->goal % grid->width, search->goal / grid->width), index);
+}
+
+/*
+    Moves from (x, y) in a straight or diagonal line until a cell with a
+    forced neighbor or the goal is found, using the rules for grids that don't
+    allow cutting corners. Returns false if a blocked cell is hit first.
+ */
+static bool jump(PathGrid *grid, int x, int y, int dx, int dy, int goal_x, int goal_y, int *out_x, int *out_y)
+{
+    while (true) {
+        if (!is_walkable(grid, x, y)) {
+            return false;
+        }
+        if (x == goal_x && y == goal_y) {
+            break;
+        }
+
+        if (dx != 0 && dy != 0) {
+            int jx, jy;
+            if (jump(grid, x + dx, y, dx, 0, goal_x, goal_y, &jx, &jy) || jump(grid, x, y + dy, 0, dy, goal_x, goal_y, &jx, &jy)) {
+                break;
+            }
+        }
+        else if (dx != 0) {
+            if ((is_walkable(grid, x, y - 1) && !is_walkable(grid, x - dx, y - 1)) ||
+                (is_walkable(grid, x, y + 1) && !is_walkable(grid, x - dx, y + 1))) {
+                break;
+            }
+        }
+        else {
+            if ((is_walkable(grid, x - 1, y) && !is_walkable(grid, x - 1, y - dy)) ||
+                (is_walkable(grid, x + 1, y) && !is_walkable(grid, x + 1, y - dy))) {
+                break;
+            }
+        }
+
+        if (!is_walkable(grid, x + dx, y) || !is_walkable(grid, x, y + dy)) {
+            return false;
+        }
+        x += dx;
+        y += dy;
+    }
+
+    *out_x = x;
+    *out_y = y;
+    return true;
+}
+
+// Returns the directions worth searching from a cell given the direction it was entered from.
+static int jps_directions(PathGrid *grid, int x, int y, int dx, int dy, int *out_dx, int *out_dy)
+{
+    int count = 0;
+    if (dx == 0 && dy == 0) {
+        for (int i = 0; i < 8; i++) {
+            out_dx[count] = path_dx[i];
+            out_dy[count++] = path_dy[i];
+        }
+        return count;
+    }
+
+    if (dx != 0 && dy != 0) {
+        bool is_vertical_free = is_walkable(grid, x, y + dy);
+        bool is_horizontal_free = is_walkable(grid, x + dx, y);
+        if (is_vertical_free) { out_dx[count] = 0; out_dy[count++] = dy; }
+        if (is_horizontal_free) { out_dx[count] = dx; out_dy[count++] = 0; }
+        if (is_vertical_free && is_horizontal_free) { out_dx[count] = dx; out_dy[count++] = dy; }
+    }
+    else if (dx != 0) {
+        bool is_next_free = is_walkable(grid, x + dx, y);
+        bool is_down_free = is_walkable(grid, x, y + 1);
+        bool is_up_free = is_walkable(grid, x, y - 1);
+        if (is_next_free) {
+            out_dx[count] = dx; out_dy[count++] = 0;
+            if (is_down_free) { out_dx[count] = dx; out_dy[count++] = 1; }
+            if (is_up_free) { out_dx[count] = dx; out_dy[count++] = -1; }
+        }
+        if (is_down_free) { out_dx[count] = 0; out_dy[count++] = 1; }
+        if (is_up_free) { out_dx[count] = 0; out_dy[count++] = -1; }
+    }
+    else {
+        bool is_next_free = is_walkable(grid, x, y + dy);
+        bool is_right_free = is_walkable(grid, x + 1, y);
+        bool is_left_free = is_walkable(grid, x - 1, y);
+        if (is_next_free) {
+            out_dx[count] = 0; out_dy[count++] = dy;
+            if (is_right_free) { out_dx[count] = 1; out_dy[count++] = dy; }
+            if (is_left_free) { out_dx[count] = -1; out_dy[count++] = dy; }
+        }
+        if (is_right_free) { out_dx[count] = 1; out_dy[count++] = 0; }
+        if (is_left_free) { out_dx[count] = -1; out_dy[count++] = 0; }
+    }
+    return count;
+}
+
+static void expand_path_cell(PathGrid *grid, PathSearch *search, int index)
+{
+    int x = index % grid->width, y = index / grid->width;
+    float g = search->g[index];
+
+    if (search->algorithm == PATH_ASTAR) {
+        for (int i = 0; i < 8; i++) {
+            if (can_move(grid, x, y, path_dx[i], path_dy[i])) {
+                relax_path_cell(grid, search, index + path_dy[i] * grid->width + path_dx[i], index, g + (i < 4 ? 1.0f : PATH_SQRT2));
+            }
+        }
+        return;
+    }
+
+    int dx = 0, dy = 0;
+    int parent = search->parent[index];
+    if (parent >= 0) {
+        int px = parent % grid->width, py = parent / grid->width;
+        dx = (x > px) - (x < px);
+        dy = (y > py) - (y < py);
+    }
+
+    int directions_x[8], directions_y[8];
+    int num_directions = jps_directions(grid, x, y, dx, dy, directions_x, directions_y);
+    int goal_x = search->goal % grid->width, goal_y = search->goal / grid->width;
+    for (int i = 0; i < num_directions; i++) {
+        int jx, jy;
+        if (!can_move(grid, x, y, directions_x[i], directions_y[i])) {
+            continue;
+        }
+        if (jump(grid, x + directions_x[i], y + directions_y[i], directions_x[i], directions_y[i], goal_x, goal_y, &jx, &jy)) {
+            relax_path_cell(grid, search, jy * grid->width + jx, index, g + octile_distance(x, y, jx, jy));
+        }
+    }
+}
+
+// Runs a search until it ends or *budget expansions are used, a NULL budget runs it to the end.
+static int step_path_search(PathGrid *grid, PathSearch *search, int *budget)
+{
+    while (!budget || *budget > 0) {
+        if (search->open.count == 0) {
+            return PATH_NOT_FOUND;
+        }
+
+        int index = path_heap_pop(&search->open).index;
+        if (search->closed[index] == search->stamp) {
+            continue;
+        }
+        if (index == search->goal) {
+            return PATH_FOUND;
+        }
+
+        search->closed[index] = search->stamp;
+        expand_path_cell(grid, search, index);
+        if (budget) {
+            (*budget)--;
+        }
+    }
+    return PATH_PENDING;
+}
+
+// Writes the first max_cells cells of the path found by a search and returns its length.
+static int copy_found_path(PathGrid *grid, PathSearch *search, GridCell *out_cells, int max_cells)
+{
+    int length = 0;
+    for (int index = search->goal; index >= 0; index = search->parent[index]) {
+        length++;
+    }
+
+    int i = length;
+    for (int index = search->goal; index >= 0; index = search->parent[index]) {
+        if (--i < max_cells) {
+            out_cells[i].x = index % grid->width;
+            out_cells[i].y = index / grid->width;
+        }
+    }
+    return length;
+}
+
+PathGrid* create_path_grid(int width, int height)
+{
+    assert(width > 0 && height > 0);
+
+    PathGrid *grid = calloc(1, sizeof(PathGrid));
+    if (!grid) {
+        log_error("Failed to create path grid");
+    }
+
+    int num_cells = width * height;
+    grid->width = width;
+    grid->height = height;
+    grid->is_blocked = calloc(num_cells, sizeof(uint8_t));
+    grid->repair_queue = malloc(num_cells * sizeof(int));
+    grid->repair_marks = calloc(num_cells, sizeof(uint32_t));
+    if (!grid->is_blocked || !grid->repair_queue || !grid->repair_marks) {
+        log_error("Failed to allocate path grid of %dx%d cells", width, height);
+    }
+
+    init_path_search(&grid->search, num_cells);
+    init_path_search(&grid->sliced_search, num_cells);
+    for (int i = 0; i < MAX_FLOW_FIELDS; i++) {
+        grid->flow_fields[i].goal = -1;
+    }
+    return grid;
+}
+
+PathGrid* create_path_grid_from_tilemap(Tilemap *map)
+{
+    PathGrid *grid = create_path_grid(map->width, map->height);
+    const uint16_t *tiles = &map->tiles[(size_t)map->collision_layer * map->width * map->height];
+    for (int i = 0; i < map->width * map->height; i++) {
+        grid->is_blocked[i] = tiles[i] != 0;
+    }
+    return grid;
+}
+
+void destroy_path_grid(PathGrid *grid)
+{
+    if (!grid) {
+        return;
+    }
+
+    for (PathRequest *request = grid->requests_head, *next; request; request = next) {
+        next = request->next;
+        free(request->cells);
+        free(request);
+    }
+    for (int i = 0; i < MAX_FLOW_FIELDS; i++) {
+        free(grid->flow_fields[i].distance);
+        free(grid->flow_fields[i].parent);
+    }
+    free_path_search(&grid->search);
+    free_path_search(&grid->sliced_search);
+    free(grid->flow_heap.entries);
+    free(grid->repair_queue);
+    free(grid->repair_marks);
+    free(grid->is_blocked);
+    free(grid);
+}
+
+bool is_path_blocked(PathGrid *grid, int x, int y)
+{
+    return !is_walkable(grid, x, y);
+}
+
+int find_path(PathGrid *grid, int start_x, int start_y, int goal_x, int goal_y, int algorithm, GridCell *out_cells, int max_cells)
+{
+    begin_path_search(grid, &grid->search, start_x, start_y, goal_x, goal_y, algorithm);
+    if (step_path_search(grid, &grid->search, NULL) != PATH_FOUND) {
+        return -1;
+    }
+    return copy_found_path(grid, &grid->search, out_cells, max_cells);
+}
+
+PathRequest* request_path(PathGrid *grid, int start_x, int start_y, int goal_x, int goal_y, int algorithm)
+{
+    PathRequest *request = calloc(1, sizeof(PathRequest));
+    if (!request) {
+        log_error("Failed to create path request");
+    }
+
+    request->start_x = start_x;
+    request->start_y = start_y;
+    request->goal_x = goal_x;
+    request->goal_y = goal_y;
+    request->algorithm = algorithm;
+    request->state = PATH_PENDING;
+
+    if (grid->requests_tail) {
+        grid->requests_tail->next = request;
+    }
+    else {
+        grid->requests_head = request;
+    }
+    grid->requests_tail = request;
+    return request;
+}
+
+void destroy_path_request(PathGrid *grid, PathRequest *request)
+{
+    if (request->state == PATH_PENDING) {
+        PathRequest **link = &grid->requests_head;
+        PathRequest *previous = NULL;
+        while (*link != request) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        *link = request->next;
+        if (grid->requests_tail == request) {
+            grid->requests_tail = previous;
+        }
+        if (!previous) {
+            grid->is_sliced_search_started = false;
+        }
+    }
+
+    free(request->cells);
+    free(request);
+}
+
+void update_path_requests(PathGrid *grid, int max_expansions)
+{
+    assert(max_expansions > 0);
+
+    while (grid->requests_head && max_expansions > 0) {
+        PathRequest *request = grid->requests_head;
+        PathSearch *search = &grid->sliced_search;
+        if (!grid->is_sliced_search_started) {
+            begin_path_search(grid, search, request->start_x, request->start_y, request->goal_x, request->goal_y, request->algorithm);
+            grid->is_sliced_search_started = true;
+        }
+
+        int state = step_path_search(grid, search, &max_expansions);
+        if (state == PATH_PENDING) {
+            return;
+        }
+
+        if (state == PATH_FOUND) {
+            request->num_cells = copy_found_path(grid, search, NULL, 0);
+            request->cells = malloc(request->num_cells * sizeof(GridCell));
+            if (!request->cells) {
+                log_error("Failed to allocate path of %d cells", request->num_cells);
+            }
+            copy_found_path(grid, search, request->cells, request->num_cells);
+        }
+        request->state = state;
+
+        grid->requests_head = request->next;
+        if (!grid->requests_head) {
+            grid->requests_tail = NULL;
+        }
+        request->next = NULL;
+        grid->is_sliced_search_started = false;
+    }
+}
+
+int get_path_request_state(PathRequest *request)
+{
+    return request->state;
+}
+
+int get_path_request_cells(PathRequest *request, const GridCell **cells)
+{
+    *cells = request->cells;
+    return request->state == PATH_FOUND ? request->num_cells : -1;
+}
+
+// Lowers distances starting from the cells in the flow heap (Dijkstra's algorithm).
+static void propagate_flow_field(PathGrid *grid, FlowField *field)
+{
+    PathHeap *heap = &grid->flow_heap;
+    while (heap->count > 0) {
+        PathHeapEntry entry = path_heap_pop(heap);
+        int index = entry.index;
+        if (entry.f > field->distance[index]) {
+            continue;
+        }
+
+        // moves are symmetric, so moving from a neighbor to this cell is allowed too
+        int x = index % grid->width, y = index / grid->width;
+        for (int i = 0; i < 8; i++) {
+            if (!can_move(grid, x, y, path_dx[i], path_dy[i])) {
+                continue;
+            }
+            int neighbor = index + path_dy[i] * grid->width + path_dx[i];
+            float distance = entry.f + (i < 4 ? 1.0f : PATH_SQRT2);
+            if (distance < field->distance[neighbor]) {
+                field->distance[neighbor] = distance;
+                field->parent[neighbor] = index;
+                path_heap_push(heap, distance, neighbor);
+            }
+        }
+    }
+}
+
+static void compute_flow_field(PathGrid *grid, FlowField *field)
+{
+    for (int i = 0; i < grid->width * grid->height; i++) {
+        field->distance[i] = PATH_INFINITY;
+        field->parent[i] = -1;
+    }
+
+    grid->flow_heap.count = 0;
+    if (!grid->is_blocked[field->goal]) {
+        field->distance[field->goal] = 0;
+        path_heap_push(&grid->flow_heap, 0, field->goal);
+    }
+    propagate_flow_field(grid, field);
+}
+
+/*
+    Updates a flow field after the cell at (x, y) changed.
+    When a cell gets blocked, the cells whose way to the goal led through it
+    (or diagonally past it) are reset and refilled from their neighbors.
+    When a cell gets unblocked, distances can only go down, so propagating
+    from the cells around it is enough. Cells elsewhere are not touched.
+ */
+static void repair_flow_field(PathGrid *grid, FlowField *field, int x, int y)
+{
+    int changed = y * grid->width + x;
+    if (changed == field->goal) {
+        compute_flow_field(grid, field);
+        return;
+    }
+
+    if (++grid->repair_stamp == 0) {
+        memset(grid->repair_marks, 0, grid->width * grid->height * sizeof(uint32_t));
+        grid->repair_stamp = 1;
+    }
+    uint32_t stamp = grid->repair_stamp;
+    int head = 0, tail = 0;
+
+    if (grid->is_blocked[changed]) {
+        // the changed cell and neighbors that moved diagonally past it
+        grid->repair_marks[changed] = stamp;
+        grid->repair_queue[tail++] = changed;
+        for (int i = 0; i < 8; i++) {
+            int nx = x + path_dx[i], ny = y + path_dy[i];
+            if (!is_walkable(grid, nx, ny)) {
+                continue;
+            }
+            int neighbor = ny * grid->width + nx;
+            int parent = field->parent[neighbor];
+            if (parent >= 0 && !can_move(grid, nx, ny, parent % grid->width - nx, parent / grid->width - ny)) {
+                grid->repair_marks[neighbor] = stamp;
+                grid->repair_queue[tail++] = neighbor;
+            }
+        }
+
+        // and everything downstream of them
+        while (head < tail) {
+            int index = grid->repair_queue[head++];
+            int cx = index % grid->width, cy = index / grid->width;
+            for (int i = 0; i < 8; i++) {
+                int nx = cx + path_dx[i], ny = cy + path_dy[i];
+                if (nx < 0 || ny < 0 || nx >= grid->width || ny >= grid->height) {
+                    continue;
+                }
+                int neighbor = ny * grid->width + nx;
+                if (field->parent[neighbor] == index && grid->repair_marks[neighbor] != stamp) {
+                    grid->repair_marks[neighbor] = stamp;
+                    grid->repair_queue[tail++] = neighbor;
+                }
+            }
+        }
+
+        for (int i = 0; i < tail; i++) {
+            int index = grid->repair_queue[i];
+            field->distance[index] = PATH_INFINITY;
+            field->parent[index] = -1;
+        }
+    }
+
+    grid->flow_heap.count = 0;
+
+    // refill the reset cells from their untouched neighbors
+    for (int i = 0; i < tail; i++) {
+        int index = grid->repair_queue[i];
+        int cx = index % grid->width, cy = index / grid->width;
+        if (grid->is_blocked[index]) {
+            continue;
+        }
+        for (int j = 0; j < 8; j++) {
+            if (!can_move(grid, cx, cy, path_dx[j], path_dy[j])) {
+                continue;
+            }
+            int neighbor = index + path_dy[j] * grid->width + path_dx[j];
+            float distance = field->distance[neighbor] + (j < 4 ? 1.0f : PATH_SQRT2);
+            if (grid->repair_marks[neighbor] != stamp && distance < field->distance[index]) {
+                field->distance[index] = distance;
+                field->parent[index] = neighbor;
+            }
+        }
+        if (field->distance[index] < PATH_INFINITY) {
+            path_heap_push(&grid->flow_heap, field->distance[index], index);
+        }
+    }
+
+    // new moves through or past the changed cell start next to it
+    for (int i = 0; i < 8; i++) {
+        int nx = x + path_dx[i], ny = y + path_dy[i];
+        if (is_walkable(grid, nx, ny)) {
+            int neighbor = ny * grid->width + nx;
+            if (field->distance[neighbor] < PATH_INFINITY) {
+                path_heap_push(&grid->flow_heap, field->distance[neighbor], neighbor);
+            }
+        }
+    }
+
+    propagate_flow_field(grid, field);
+}
+
+void set_path_blocked(PathGrid *grid, int x, int y, bool is_blocked)
+{
+    if (x < 0 || y < 0 || x >= grid->width || y >= grid->height || grid->is_blocked[y * grid->width + x] == is_blocked) {
+        return;
+    }
+
+    grid->is_blocked[y * grid->width + x] = is_blocked;
+    for (int i = 0; i < MAX_FLOW_FIELDS; i++) {
+        if (grid->flow_fields[i].goal >= 0) {
+            repair_flow_field(grid, &grid->flow_fields[i], x, y);
+        }
+    }
+
+    // the search of the first request may have used the cell, start it over
+    grid->is_sliced_search_started = false;
+}
+
+static FlowField* get_flow_field(PathGrid *grid, int goal_x, int goal_y)
+{
+    int goal = goal_y * grid->width + goal_x;
+    FlowField *least_recent = &grid->flow_fields[0];
+    grid->flow_clock++;
+
+    for (int i = 0; i < MAX_FLOW_FIELDS; i++) {
+        FlowField *field = &grid->flow_fields[i];
+        if (field->goal == goal) {
+            field->last_used = grid->flow_clock;
+            return field;
+        }
+        if (field->goal < 0 || (least_recent->goal >= 0 && field->last_used < least_recent->last_used)) {
+            least_recent = field;
+        }
+    }
+
+    FlowField *field = least_recent;
+    if (!field->distance) {
+        field->distance = malloc(grid->width * grid->height * sizeof(float));
+        field->parent = malloc(grid->width * grid->height * sizeof(int));
+        if (!field->distance || !field->parent) {
+            log_error("Failed to allocate flow field of %dx%d cells", grid->width, grid->height);
+        }
+    }
+    field->goal = goal;
+    field->last_used = grid->flow_clock;
+    compute_flow_field(grid, field);
+    return field;
+}
+
+GridCell get_flow_direction(PathGrid *grid, int goal_x, int goal_y, int x, int y)
+{
+    GridCell direction = { 0, 0 };
+    if (x < 0 || y < 0 || x >= grid->width || y >= grid->height || goal_x < 0 || goal_y < 0 || goal_x >= grid->width || goal_y >= grid->height) {
+        return direction;
+    }
+
+    FlowField *field = get_flow_field(grid, goal_x, goal_y);
+    int parent = field->parent[y * grid->width + x];
+    if (parent >= 0) {
+        direction.x = parent % grid->width - x;
+        direction.y = parent / grid->width - y;
+    }
+    return direction;
+}
+
+float get_flow_distance(PathGrid *grid, int goal_x, int goal_y, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= grid->width || y >= grid->height || goal_x < 0 || goal_y < 0 || goal_x >= grid->width || goal_y >= grid->height) {
+        return -1;
+    }
+
+    FlowField *field = get_flow_field(grid, goal_x, goal_y);
+    float distance = field->distance[y * grid->width + x];
+    return distance < PATH_INFINITY ? distance : -1;
+}
+
+#define ENTITY_CACHE_LINE 64
+
+typedef struct {
+    char *memory;       // as returned by malloc
+    char *data;         // memory aligned to a cache line
+} EntityChunk;
+
+typedef struct {
+    uint64_t components;
+    int offsets[MAX_COMPONENTS];    // of each component array in a chunk, -1 if not in the archetype
+    int chunk_bytes;
+    int count;                      // entity i is in chunk i / ENTITY_CHUNK_SIZE
+    EntityChunk *chunks;
+    int num_chunks;
+    int chunks_capacity;
+} Archetype;
+
+typedef struct {
+    uint32_t generation;
+    int archetype;      // -1 if free
+    int row;            // index within the archetype
+    int next_free;
+} EntitySlot;
+
+struct World {
+    int component_sizes[MAX_COMPONENTS];
+    int num_components;
+
+    Archetype *archetypes;
+    int num_archetypes;
+    int archetypes_capacity;
+
+    EntitySlot *slots;
+    int num_slots;
+    int slots_capacity;
+    int free_list;
+    int num_entities;
+};
+
+static int entity_index(Entity entity)
+{
+    return (int)(entity & 0xffffffff);
+}
+
+static uint32_t entity_generation(Entity entity)
+{
+    return (uint32_t)(entity >> 32);
+}
+
+static EntitySlot* world_get_slot(World *world, Entity entity)
+{
+    int index = entity_index(entity);
+    if (index >= world->num_slots) {
+        return NULL;
+    }
+    EntitySlot *slot = &world->slots[index];
+    return slot->archetype >= 0 && slot->generation == entity_generation(entity) ? slot : NULL;
+}
+
+static char* archetype_component(Archetype *archetype, int row, int component, int size)
+{
+    EntityChunk *chunk = &archetype->chunks[row / ENTITY_CHUNK_SIZE];
+    return chunk->data + archetype->offsets[component] + (row % ENTITY_CHUNK_SIZE) * size;
+}
+
+static Entity* archetype_entity(Archetype *archetype, int row)
+{
+    return (Entity *)archetype->chunks[row / ENTITY_CHUNK_SIZE].data + row % ENTITY_CHUNK_SIZE;
+}
+
+static int world_find_archetype(World *world, uint64_t components)
+{
+    for (int i = 0; i < world->num_archetypes; i++) {
+        if (world->archetypes[i].components == components) {
+            return i;
+        }
+    }
+
+    world->archetypes = grow_array(world->archetypes, &world->archetypes_capacity, world->num_archetypes + 1, sizeof(Archetype));
+    Archetype *archetype = &world->archetypes[world->num_archetypes];
+    memset(archetype, 0, sizeof(Archetype));
+    archetype->components = components;
+
+    // the entity handles come first, then one array per component
+    int offset = ENTITY_CHUNK_SIZE * sizeof(Entity);
+    for (int i = 0; i < MAX_COMPONENTS; i++) {
+        archetype->offsets[i] = -1;
+        if (components & COMPONENT_BIT(i)) {
+            offset = (offset + ENTITY_CACHE_LINE - 1) & ~(ENTITY_CACHE_LINE - 1);
+            archetype->offsets[i] = offset;
+            offset += ENTITY_CHUNK_SIZE * world->component_sizes[i];
+        }
+    }
+    archetype->chunk_bytes = offset;
+
+    return world->num_archetypes++;
+}
+
+// Appends a row for an entity, the components are zeroed.
+static int archetype_add(Archetype *archetype, Entity entity)
+{
+    int row = archetype->count;
+    int chunk_index = row / ENTITY_CHUNK_SIZE;
+    if (chunk_index == archetype->num_chunks) {
+        archetype->chunks = grow_array(archetype->chunks, &archetype->chunks_capacity, archetype->num_chunks + 1, sizeof(EntityChunk));
+        EntityChunk *chunk = &archetype->chunks[archetype->num_chunks++];
+        chunk->memory = malloc(archetype->chunk_bytes + ENTITY_CACHE_LINE - 1);
+        if (!chunk->memory) {
+            log_error("Failed to allocate entity chunk of %d bytes", archetype->chunk_bytes);
+        }
+        chunk->data = (char *)(((uintptr_t)chunk->memory + ENTITY_CACHE_LINE - 1) & ~(uintptr_t)(ENTITY_CACHE_LINE - 1));
+    }
+
+    archetype->count++;
+    *archetype_entity(archetype, row) = entity;
+    return row;
+}
+
+// Removes a row by moving the last entity into it, keeping the chunks dense.
+static void world_remove_row(World *world, Archetype *archetype, int row)
+{
+    int last = --archetype->count;
+    if (row != last) {
+        Entity moved = *archetype_entity(archetype, last);
+        *archetype_entity(archetype, row) = moved;
+        for (int i = 0; i < world->num_components; i++) {
+            if (archetype->components & COMPONENT_BIT(i)) {
+                int size = world->component_sizes[i];
+                memcpy(archetype_component(archetype, row, i, size), archetype_component(archetype, last, i, size), size);
+            }
+        }
+        world->slots[entity_index(moved)].row = row;
+    }
+}
+
+static void world_zero_components(World *world, Archetype *archetype, int row, uint64_t components)
+{
+    for (int i = 0; i < world->num_components; i++) {
+        if (components & COMPONENT_BIT(i)) {
+            int size = world->component_sizes[i];
+            memset(archetype_component(archetype, row, i, size), 0, size);
+        }
+    }
+}
+
+// Moves an entity to the archetype with a different set of components.
+static void world_move_entity(World *world, EntitySlot *slot, Entity entity, uint64_t components)
+{
+    int new_index = world_find_archetype(world, components);
+    Archetype *old_archetype = &world->archetypes[slot->archetype];
+    Archetype *new_archetype = &world->archetypes[new_index];
+
+    int row = archetype_add(new_archetype, entity);
+    uint64_t shared = old_archetype->components & components;
+    for (int i = 0; i < world->num_components; i++) {
+        if (shared & COMPONENT_BIT(i)) {
+            int size = world->component_sizes[i];
+            memcpy(archetype_component(new_archetype, row, i, size), archetype_component(old_archetype, slot->row, i, size), size);
+        }
+    }
+    world_zero_components(world, new_archetype, row, components & ~shared);
+
+    world_remove_row(world, old_archetype, slot->row);
+    slot->archetype = new_index;
+    slot->row = row;
+}
+
+World* create_world()
+{
+    World *world = calloc(1, sizeof(World));
+    if (!world) {
+        log_error("Failed to create world");
+    }
+    world->free_list = -1;
+
+    world_register_component(world, sizeof(Rectangle));
+    world_register_component(world, sizeof(Velocity));
+    return world;
+}
+
+void destroy_world(World *world)
+{
+    if (!world) {
+        return;
+    }
+
+    for (int i = 0; i < world->num_archetypes; i++) {
+        Archetype *archetype = &world->archetypes[i];
+        for (int j = 0; j < archetype->num_chunks; j++) {
+            free(archetype->chunks[j].memory);
+        }
+        free(archetype->chunks);
+    }
+    free(world->archetypes);
+    free(world->slots);
+    free(world);
+}
+
+int world_register_component(World *world, int size)
+{
+    assert(size > 0);
+    if (world->num_components == MAX_COMPONENTS) {
+        log_error("Too many components, max is %d", MAX_COMPONENTS);
+    }
+
+    world->component_sizes[world->num_components] = size;
+    return world->num_components++;
+}
+
+Entity world_create_entity(World *world, uint64_t components)
+{
+    int index;
+    if (world->free_list >= 0) {
+        index = world->free_list;
+        world->free_list = world->slots[index].next_free;
+    }
+    else {
+        index = world->num_slots++;
+        world->slots = grow_array(world->slots, &world->slots_capacity, world->num_slots, sizeof(EntitySlot));
+        world->slots[index].generation = 1;
+    }
+
+    EntitySlot *slot = &world->slots[index];
+    Entity entity = ((Entity)slot->generation << 32) | (uint32_t)index;
+
+    slot->archetype = world_find_archetype(world, components);
+    Archetype *archetype = &world->archetypes[slot->archetype];
+    slot->row = archetype_add(archetype, entity);
+    world_zero_components(world, archetype, slot->row, components);
+
+    world->num_entities++;
+    return entity;
+}
+
+void world_destroy_entity(World *world, Entity entity)
+{
+    EntitySlot *slot = world_get_slot(world, entity);
+    if (!slot) {
+        return;
+    }
+
+    world_remove_row(world, &world->archetypes[slot->archetype], slot->row);
+
+    // skip 0 when the generation wraps around, so handles are never NULL_ENTITY
+    slot->generation = slot->generation + 1 ? slot->generation + 1 : 1;
+    slot->archetype = -1;
+    slot->next_free = world->free_list;
+    world->free_list = entity_index(entity);
+    world->num_entities--;
+}
+
+bool world_is_alive(World *world, Entity entity)
+{
+    return world_get_slot(world, entity) != NULL;
+}
+
+int world_get_entity_count(World *world)
+{
+    return world->num_entities;
+}
+
+void* world_get_component(World *world, Entity entity, int component)
+{
+    EntitySlot *slot = world_get_slot(world, entity);
+    if (!slot) {
+        return NULL;
+    }
+
+    Archetype *archetype = &world->archetypes[slot->archetype];
+    if (archetype->offsets[component] < 0) {
+        return NULL;
+    }
+    return archetype_component(archetype, slot->row, component, world->component_sizes[component]);
+}
+
+void* world_add_component(World *world, Entity entity, int component)
+{
+    EntitySlot *slot = world_get_slot(world, entity);
+    if (!slot) {
+        return NULL;
+    }
+
+    uint64_t components = world->archetypes[slot->archetype].components;
+    if (!(components & COMPONENT_BIT(component))) {
+        world_move_entity(world, slot, entity, components | COMPONENT_BIT(component));
+    }
+    return world_get_component(world, entity, component);
+}
+
+void world_remove_component(World *world, Entity entity, int component)
+{
+    EntitySlot *slot = world_get_slot(world, entity);
+    if (!slot) {
+        return;
+    }
+
+    uint64_t components = world->archetypes[slot->archetype].components;
+    if (components & COMPONENT_BIT(component)) {
+        world_move_entity(world, slot, entity, components & ~COMPONENT_BIT(component));
+    }
+}
+
+WorldQuery world_query(World *world, uint64_t all, uint64_t none)
+{
+    WorldQuery query;
+    memset(&query, 0, sizeof(query));
+    query.world = world;
+    query.all = all;
+    query.none = none;
+    query.archetype = 0;
+    query.chunk = -1;
+    return query;
+}
+
+bool world_query_next(WorldQuery *query)
+{
+    World *world = query->world;
+    while (query->archetype < world->num_archetypes) {
+        Archetype *archetype = &world->archetypes[query->archetype];
+        bool is_match = (archetype->components & query->all) == query->all && !(archetype->components & query->none);
+
+        query->chunk++;
+        int first = query->chunk * ENTITY_CHUNK_SIZE;
+        if (is_match && first < archetype->count) {
+            int count = archetype->count - first;
+            query->count = count < ENTITY_CHUNK_SIZE ? count : ENTITY_CHUNK_SIZE;
+            query->entities = (const Entity *)archetype->chunks[query->chunk].data;
+            return true;
+        }
+
+        query->archetype++;
+        query->chunk = -1;
+    }
+
+    query->count = 0;
+    query->entities = NULL;
+    return false;
+}
+
+void* world_query_components(WorldQuery *query, int component)
+{
+    assert(query->all & COMPONENT_BIT(component));
+    Archetype *archetype = &query->world->archetypes[query->archetype];
+    return archetype->chunks[query->chunk].data + archetype->offsets[component];
+}
+
+static void integrate_velocities(Rectangle *r, const Velocity *v, int count)
+{
+    for (int i = 0; i < count; i++) {
+        r[i].x += v[i].dx;
+        r[i].y += v[i].dy;
+    }
+}
+
+static void bounce_off_bounds(Rectangle *r, Velocity *v, int count, float left, float top, float right, float bottom)
+{
+    for (int i = 0; i < count; i++) {
+        if (r[i].x < left) {
+            r[i].x = left;
+            v[i].dx = fabsf(v[i].dx);
+        }
+        if (r[i].x + r[i].w > right) {
+            r[i].x = right - r[i].w;
+            v[i].dx = -fabsf(v[i].dx);
+        }
+        if (r[i].y < top) {
+            r[i].y = top;
+            v[i].dy = fabsf(v[i].dy);
+        }
+        if (r[i].y + r[i].h > bottom) {
+            r[i].y = bottom - r[i].h;
+            v[i].dy = -fabsf(v[i].dy);
+        }
+    }
+}
+
+#if defined(FRAMEWORK_SSE2)
+
+// A Rectangle fills a register, the velocities of two entities are split into (dx, dy, 0, 0) each.
+static void integrate_velocities_sse2(Rectangle *r, const Velocity *v, int count)
+{
+    __m128 zero = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128 velocities = _mm_loadu_ps(&v[i].dx);
+        _mm_store_ps(&r[i].x, _mm_add_ps(_mm_load_ps(&r[i].x), _mm_movelh_ps(velocities, zero)));
+        _mm_store_ps(&r[i + 1].x, _mm_add_ps(_mm_load_ps(&r[i + 1].x), _mm_movehl_ps(zero, velocities)));
+    }
+    integrate_velocities(r + i, v + i, count - i);
+}
+
+static __m128 select_ps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Transposes four rectangles into x, y, w, h registers, same steps as the scalar version.
+static void bounce_off_bounds_sse2(Rectangle *r, Velocity *v, int count, float left, float top, float right, float bottom)
+{
+    __m128 vleft = _mm_set1_ps(left), vtop = _mm_set1_ps(top);
+    __m128 vright = _mm_set1_ps(right), vbottom = _mm_set1_ps(bottom);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_load_ps(&r[i].x);
+        __m128 y = _mm_load_ps(&r[i + 1].x);
+        __m128 w = _mm_load_ps(&r[i + 2].x);
+        __m128 h = _mm_load_ps(&r[i + 3].x);
+        _MM_TRANSPOSE4_PS(x, y, w, h);
+
+        __m128 v01 = _mm_loadu_ps(&v[i].dx);
+        __m128 v23 = _mm_loadu_ps(&v[i + 2].dx);
+        __m128 dx = _mm_shuffle_ps(v01, v23, _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 dy = _mm_shuffle_ps(v01, v23, _MM_SHUFFLE(3, 1, 3, 1));
+
+        __m128 hit = _mm_cmplt_ps(x, vleft);
+        x = select_ps(hit, vleft, x);
+        dx = select_ps(hit, _mm_andnot_ps(sign, dx), dx);
+        hit = _mm_cmpgt_ps(_mm_add_ps(x, w), vright);
+        x = select_ps(hit, _mm_sub_ps(vright, w), x);
+        dx = select_ps(hit, _mm_or_ps(sign, dx), dx);
+
+        hit = _mm_cmplt_ps(y, vtop);
+        y = select_ps(hit, vtop, y);
+        dy = select_ps(hit, _mm_andnot_ps(sign, dy), dy);
+        hit = _mm_cmpgt_ps(_mm_add_ps(y, h), vbottom);
+        y = select_ps(hit, _mm_sub_ps(vbottom, h), y);
+        dy = select_ps(hit, _mm_or_ps(sign, dy), dy);
+
+        _MM_TRANSPOSE4_PS(x, y, w, h);
+        _mm_store_ps(&r[i].x, x);
+        _mm_store_ps(&r[i + 1].x, y);
+        _mm_store_ps(&r[i + 2].x, w);
+        _mm_store_ps(&r[i + 3].x, h);
+        _mm_storeu_ps(&v[i].dx, _mm_unpacklo_ps(dx, dy));
+        _mm_storeu_ps(&v[i + 2].dx, _mm_unpackhi_ps(dx, dy));
+    }
+    bounce_off_bounds(r + i, v + i, count - i, left, top, right, bottom);
+}
+
+#endif
+
+#if defined(FRAMEWORK_AVX2)
+
+// Same as the SSE2 version with two rectangles per register.
+TARGET_AVX2 static void integrate_velocities_avx2(Rectangle *r, const Velocity *v, int count)
+{
+    __m128 zero = _mm_setzero_ps();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128 velocities = _mm_loadu_ps(&v[i].dx);
+        __m256 both = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_movelh_ps(velocities, zero)), _mm_movehl_ps(zero, velocities), 1);
+        _mm256_store_ps(&r[i].x, _mm256_add_ps(_mm256_load_ps(&r[i].x), both));
+    }
+    integrate_velocities(r + i, v + i, count - i);
+}
+
+#endif
+
+void world_integrate_velocities(World *world)
+{
+    void (*kernel)(Rectangle *, const Velocity *, int) = integrate_velocities;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() == SIMD_SSE2) kernel = integrate_velocities_sse2;
+#endif
+#if defined(FRAMEWORK_AVX2)
+    if (get_simd_level() == SIMD_AVX2) kernel = integrate_velocities_avx2;
+#endif
+
+    WorldQuery query = world_query(world, COMPONENT_BIT(COMPONENT_RECTANGLE) | COMPONENT_BIT(COMPONENT_VELOCITY), 0);
+    while (world_query_next(&query)) {
+        kernel(world_query_components(&query, COMPONENT_RECTANGLE), world_query_components(&query, COMPONENT_VELOCITY), query.count);
+    }
+}
+
+void world_bounce_off_bounds(World *world, Rectangle bounds)
+{
+    void (*kernel)(Rectangle *, Velocity *, int, float, float, float, float) = bounce_off_bounds;
+#if defined(FRAMEWORK_SSE2)
+    if (get_simd_level() >= SIMD_SSE2) kernel = bounce_off_bounds_sse2;
+#endif
+
+    WorldQuery query = world_query(world, COMPONENT_BIT(COMPONENT_RECTANGLE) | COMPONENT_BIT(COMPONENT_VELOCITY), 0);
+    while (world_query_next(&query)) {
+        kernel(world_query_components(&query, COMPONENT_RECTANGLE), world_query_components(&query, COMPONENT_VELOCITY), query.count,
+               bounds.x, bounds.y, bounds.x + bounds.w, bounds.y + bounds.h);
+    }
+}
+
+#define SNAPSHOT_MAGIC "SNAP"
+#define SNAPSHOT_DELTA_MAGIC "SDLT"
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t layout_hash;
+    int32_t tick;
+    uint64_t size;              // of the whole blob
+    uint64_t num_regions;
+} SnapshotHeader;
+
+// An arena in a blob is stored as this followed by the used bytes of its block.
+typedef struct {
+    uint64_t block;             // address of the block, pointers into it are only valid there
+    uint64_t used;
+} SnapshotArenaHeader;
+
+struct Snapshot {
+    uint64_t *data;             // in words so regions stay 8 byte aligned
+    size_t size;
+    size_t capacity;
+};
+
+struct SnapshotHistory {
+    Snapshot **snapshots;       // the snapshot of a tick is at tick % capacity
+    int capacity;
+    int newest_tick;
+};
+
+static size_t align_snapshot_size(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+// Hashes the kind and size of the regions, so a blob only restores into the layout it was taken from.
+static void update_snapshot_layout_hash()
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < num_snapshot_regions; i++) {
+        SnapshotRegion *region = &snapshot_regions[i];
+        uint64_t key = region->arena ? UINT64_MAX : (region->data ? region->size : 0);
+        for (int j = 0; j < 8; j++) {
+            hash = (hash ^ (uint8_t)(key >> (j * 8))) * 16777619u;
+        }
+    }
+    snapshot_layout_hash = hash;
+}
+
+static int add_region(void *data, size_t size, Arena *arena)
+{
+    snapshot_regions = grow_array(snapshot_regions, &snapshot_regions_capacity, num_snapshot_regions + 1, sizeof(SnapshotRegion));
+    snapshot_regions[num_snapshot_regions] = (SnapshotRegion) { data, size, arena };
+    update_snapshot_layout_hash();
+    return num_snapshot_regions++;
+}
+
+int add_snapshot_region(void *data, size_t size)
+{
+    return add_region(data, size, NULL);
+}
+
+int add_snapshot_arena(Arena *arena)
+{
+    return add_region(NULL, 0, arena);
+}
+
+void remove_snapshot_region(int id)
+{
+    if (id < 0 || id >= num_snapshot_regions) {
+        return;
+    }
+
+    snapshot_regions[id] = (SnapshotRegion) { NULL, 0, NULL };
+    update_snapshot_layout_hash();
+}
+
+Snapshot* create_snapshot()
+{
+    Snapshot *snapshot = calloc(1, sizeof(Snapshot));
+    if (!snapshot) {
+        log_error("Failed to create snapshot");
+    }
+    return snapshot;
+}
+
+void destroy_snapshot(Snapshot *snapshot)
+{
+    if (!snapshot) {
+        return;
+    }
+
+    free(snapshot->data);
+    free(snapshot);
+}
+
+// Grows the snapshot to hold size bytes, returns false and leaves it as it was if that fails.
+static bool reserve_snapshot(Snapshot *snapshot, size_t size)
+{
+    if (size <= snapshot->capacity) {
+        return true;
+    }
+
+    size_t capacity = snapshot->capacity > 0 ? snapshot->capacity : 1024;
+    while (capacity < size) {
+        capacity = capacity > SIZE_MAX / 2 ? size : capacity * 2;
+    }
+
+    void *data = realloc(snapshot->data, capacity);
+    if (!data) {
+        return false;
+    }
+    snapshot->data = data;
+    snapshot->capacity = capacity;
+    return true;
+}
+
+bool take_snapshot(Snapshot *snapshot)
+{
+    // size everything up front so the regions are copied in one pass
+    size_t size = sizeof(SnapshotHeader);
+    for (int i = 0; i < num_snapshot_regions; i++) {
+        SnapshotRegion *region = &snapshot_regions[i];
+        if (region->arena) {
+            if (region->arena->block->next) {
+                log_warning("Snapshot arena has more than one block, reset it before taking snapshots");
+                return false;
+            }
+            size += sizeof(SnapshotArenaHeader) + align_snapshot_size(region->arena->block->used);
+        }
+        else {
+            size += align_snapshot_size(region->size);
+        }
+    }
+    if (!reserve_snapshot(snapshot, size)) {
+        log_error("Failed to allocate %llu bytes for snapshot", (unsigned long long)size);
+    }
+
+    char *blob = (char *)snapshot->data;
+    SnapshotHeader *header = (SnapshotHeader *)blob;
+    memcpy(header->magic, SNAPSHOT_MAGIC, 4);
+    header->version = SNAPSHOT_VERSION;
+    header->layout_hash = snapshot_layout_hash;
+    header->tick = tick_count;
+    header->size = size;
+    header->num_regions = num_snapshot_regions;
+
+    size_t offset = sizeof(SnapshotHeader);
+    for (int i = 0; i < num_snapshot_regions; i++) {
+        SnapshotRegion *region = &snapshot_regions[i];
+        const void *data = region->data;
+        size_t region_size = region->size;
+        if (region->arena) {
+            ArenaBlock *block = region->arena->block;
+            SnapshotArenaHeader arena = { (uintptr_t)block, block->used };
+            memcpy(blob + offset, &arena, sizeof(arena));
+            offset += sizeof(arena);
+            data = block->data;
+            region_size = block->used;
+        }
+
+        if (region_size > 0) {
+            memcpy(blob + offset, data, region_size);
+        }
+        // zero the padding so equal states give equal blobs
+        size_t padded_size = align_snapshot_size(region_size);
+        memset(blob + offset + region_size, 0, padded_size - region_size);
+        offset += padded_size;
+    }
+
+    snapshot->size = size;
+    return true;
+}
+
+static ArenaBlock* get_first_arena_block(Arena *arena)
+{
+    ArenaBlock *block = arena->block;
+    while (block->next) {
+        block = block->next;
+    }
+    return block;
+}
+
+// Checks a blob against the registered regions and copies it back into them, name is used for warnings.
+static bool restore_snapshot_blob(const char *blob, size_t size, const char *name)
+{
+    const SnapshotHeader *header = (const SnapshotHeader *)blob;
+    if (size < sizeof(SnapshotHeader) || memcmp(header->magic, SNAPSHOT_MAGIC, 4) != 0 || header->version != SNAPSHOT_VERSION || header->size > size) {
+        log_warning("%s is not a snapshot", name);
+        return false;
+    }
+
+    if (header->layout_hash != snapshot_layout_hash || header->num_regions != (uint64_t)num_snapshot_regions) {
+        log_warning("%s was taken with different snapshot regions", name);
+        return false;
+    }
+
+    // validate every region before touching any, so a failed restore leaves the state as it was
+    size_t offset = sizeof(SnapshotHeader);
+    for (int i = 0; i < num_snapshot_regions; i++) {
+        SnapshotRegion *region = &snapshot_regions[i];
+        size_t region_size = region->size;
+        if (region->arena) {
+            SnapshotArenaHeader arena;
+            if (offset + sizeof(arena) > header->size) {
+                break;
+            }
+            memcpy(&arena, blob + offset, sizeof(arena));
+            offset += sizeof(arena);
+
+            ArenaBlock *block = get_first_arena_block(region->arena);
+            if (arena.block != (uintptr_t)block || arena.used > block->size) {
+                log_warning("%s has an arena that was reset since", name);
+                return false;
+            }
+            region_size = arena.used;
+        }
+        offset += align_snapshot_size(region_size);
+    }
 
-        switch (event.type) {
-            case ALLEGRO_EVENT_TIMER:
-                should_redraw = true;
-                if (!is_paused) {
-                    update_proc();
-                }
+    if (offset != header->size) {
+        log_warning("%s is broken", name);
+        return false;
+    }
 
-                // clear input state
-                memset(keys_pressed, false, sizeof(keys_pressed));
-                memset(keys_released, false, sizeof(keys_pressed));
-                memset(mouse_buttons_pressed, false, sizeof(mouse_buttons_pressed));
-                memset(mouse_buttons_released, false, sizeof(mouse_buttons_released));
-                mouse_old_x = mouse_x;
-                mouse_old_y = mouse_y;
-                break;
+    offset = sizeof(SnapshotHeader);
+    for (int i = 0; i < num_snapshot_regions; i++) {
+        SnapshotRegion *region = &snapshot_regions[i];
+        void *data = region->data;
+        size_t region_size = region->size;
+        if (region->arena) {
+            SnapshotArenaHeader arena;
+            memcpy(&arena, blob + offset, sizeof(arena));
+            offset += sizeof(arena);
 
-            case ALLEGRO_EVENT_KEY_DOWN:
-                keys[event.keyboard.keycode] = true;
-                keys_pressed[event.keyboard.keycode] = true;
-                break;
+            // drop the blocks chained since the snapshot
+            ArenaBlock *block = get_first_arena_block(region->arena);
+            for (ArenaBlock *b = region->arena->block, *next; b != block; b = next) {
+                next = b->next;
+                free(b);
+            }
+            region->arena->block = block;
+            region->arena->used_in_full_blocks = 0;
+            block->used = arena.used;
+            data = block->data;
+            region_size = arena.used;
+        }
 
-            case ALLEGRO_EVENT_KEY_UP:
-                keys[event.keyboard.keycode] = false;
-                keys_released[event.keyboard.keycode] = true;
-                break;
+        if (region_size > 0) {
+            memcpy(data, blob + offset, region_size);
+        }
+        offset += align_snapshot_size(region_size);
+    }
+    return true;
+}
 
-            case ALLEGRO_EVENT_KEY_CHAR:
-                // handle alt-tab
-                if ((event.keyboard.modifiers & ALLEGRO_KEYMOD_ALT) &&
-                     event.keyboard.keycode == ALLEGRO_KEY_ENTER) {
-                    al_set_display_flag(display, ALLEGRO_FULLSCREEN_WINDOW, !(al_get_display_flags(display) & ALLEGRO_FULLSCREEN_WINDOW));
-                }
-                break;
+bool restore_snapshot(const Snapshot *snapshot)
+{
+    return restore_snapshot_blob((const char *)snapshot->data, snapshot->size, "Snapshot");
+}
 
-            case ALLEGRO_EVENT_MOUSE_AXES:
-                mouse_x = event.mouse.x;
-                mouse_y = event.mouse.y;
-                break;
+int get_snapshot_tick(const Snapshot *snapshot)
+{
+    return snapshot->size >= sizeof(SnapshotHeader) ? ((const SnapshotHeader *)snapshot->data)->tick : 0;
+}
 
-            case ALLEGRO_EVENT_MOUSE_BUTTON_DOWN:
-                mouse_buttons[event.mouse.button] = true;
-                mouse_buttons_pressed[event.mouse.button] = true;
-                break;
+const void* get_snapshot_data(const Snapshot *snapshot)
+{
+    return snapshot->data;
+}
 
-            case ALLEGRO_EVENT_MOUSE_BUTTON_UP:
-                mouse_buttons[event.mouse.button] = false;
-                mouse_buttons_released[event.mouse.button] = true;
-                break;
+size_t get_snapshot_size(const Snapshot *snapshot)
+{
+    return snapshot->size;
+}
 
-            case ALLEGRO_EVENT_DISPLAY_CLOSE:
-                is_done = true;
-                break;
+typedef struct {
+    void *data;
+    size_t size;
+#if defined(_WIN32)
+    HANDLE file, mapping;
+#endif
+} MappedFile;
 
-            case ALLEGRO_EVENT_DISPLAY_SWITCH_OUT:
-                if (should_alt_tab_pause) {
-                    is_paused = true;
-                }
-                break;
+/*
+    Maps a file into memory.
+    size is the size to create the file with for writing, or 0 to open an
+    existing file for reading.
+ */
+static bool map_file(MappedFile *mapped, const char *filename, size_t size)
+{
+    bool is_write = size > 0;
+    mapped->data = NULL;
+    mapped->size = size;
 
-            case ALLEGRO_EVENT_DISPLAY_SWITCH_IN:
-                if (should_alt_tab_pause) {
-                    is_paused = false;
-                }
-                break;
+#if defined(_WIN32)
+    mapped->file = CreateFileA(filename, is_write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ, FILE_SHARE_READ, NULL,
+                               is_write ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (mapped->file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    if (!is_write) {
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(mapped->file, &file_size) || file_size.QuadPart == 0) {
+            CloseHandle(mapped->file);
+            return false;
         }
+        mapped->size = (size_t)file_size.QuadPart;
+    }
 
-        if (should_redraw && al_is_event_queue_empty(event_queue) && !is_paused) {
-            should_redraw = false;
-            al_set_target_bitmap(al_get_backbuffer(display));
-            al_clear_to_color(al_map_rgb(0, 0, 0));
-            render_proc();
-            al_flip_display();
+    mapped->mapping = CreateFileMappingA(mapped->file, NULL, is_write ? PAGE_READWRITE : PAGE_READONLY,
+                                         (DWORD)((uint64_t)mapped->size >> 32), (DWORD)mapped->size, NULL);
+    if (mapped->mapping) {
+        mapped->data = MapViewOfFile(mapped->mapping, is_write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, mapped->size);
+        if (!mapped->data) {
+            CloseHandle(mapped->mapping);
         }
     }
+    if (!mapped->data) {
+        CloseHandle(mapped->file);
+        return false;
+    }
+#else
+    int fd = open(filename, is_write ? O_RDWR | O_CREAT | O_TRUNC : O_RDONLY, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat file_stat;
+    if (is_write ? ftruncate(fd, (off_t)size) != 0 : fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    if (!is_write) {
+        mapped->size = (size_t)file_stat.st_size;
+    }
+
+    // the mapping stays valid after the file is closed
+    void *data = mmap(NULL, mapped->size, is_write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    mapped->data = data;
+#endif
+    return true;
 }
 
-void quit()
+static void unmap_file(MappedFile *mapped)
 {
-    is_done = true;
+#if defined(_WIN32)
+    UnmapViewOfFile(mapped->data);
+    CloseHandle(mapped->mapping);
+    CloseHandle(mapped->file);
+#else
+    munmap(mapped->data, mapped->size);
+#endif
 }
 
-void alt_tab_should_pause(bool true_or_false)
+bool save_snapshot(const Snapshot *snapshot, const char *filename)
 {
-    should_alt_tab_pause = true_or_false;
+    MappedFile mapped;
+    if (snapshot->size == 0 || !map_file(&mapped, filename, snapshot->size)) {
+        log_warning("Failed to write %s", filename);
+        return false;
+    }
+
+    memcpy(mapped.data, snapshot->data, snapshot->size);
+    unmap_file(&mapped);
+    return true;
 }
 
-int get_window_width()
+bool load_snapshot(Snapshot *snapshot, const char *filename)
 {
-    assert(display != NULL);
-    return al_get_display_width(display);
+    MappedFile mapped;
+    if (!map_file(&mapped, filename, 0)) {
+        log_warning("Failed to open %s", filename);
+        return false;
+    }
+
+    const SnapshotHeader *header = mapped.data;
+    bool is_snapshot = mapped.size >= sizeof(SnapshotHeader) && memcmp(header->magic, SNAPSHOT_MAGIC, 4) == 0 &&
+                       header->version == SNAPSHOT_VERSION && header->size == mapped.size;
+    if (is_snapshot) {
+        if (!reserve_snapshot(snapshot, mapped.size)) {
+            log_error("Failed to allocate %llu bytes for snapshot", (unsigned long long)mapped.size);
+        }
+        memcpy(snapshot->data, mapped.data, mapped.size);
+        snapshot->size = mapped.size;
+    }
+    else {
+        log_warning("%s is not a snapshot", filename);
+    }
+
+    unmap_file(&mapped);
+    return is_snapshot;
 }
 
-int get_window_height()
+bool restore_snapshot_file(const char *filename)
 {
-    assert(display != NULL);
-    return al_get_display_height(display);
+    MappedFile mapped;
+    if (!map_file(&mapped, filename, 0)) {
+        log_warning("Failed to open %s", filename);
+        return false;
+    }
+
+    bool is_restored = restore_snapshot_blob(mapped.data, mapped.size, filename);
+    unmap_file(&mapped);
+    return is_restored;
 }
 
-bool is_key_down(int keycode)
+static uint8_t* write_delta_varint(uint8_t *out, uint64_t value)
 {
-    assert(keycode >= 0 && keycode < ALLEGRO_KEY_MAX);
-    return keys[keycode];
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
 }
 
-bool is_key_pressed(int keycode)
+static bool read_delta_varint(const uint8_t **in, const uint8_t *end, uint64_t *value)
 {
-    assert(keycode >= 0 && keycode < ALLEGRO_KEY_MAX);
-    return keys_pressed[keycode];
+    *value = 0;
+    for (int shift = 0; shift < 64 && *in < end; shift += 7) {
+        uint8_t byte = *(*in)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-bool is_key_released(int keycode)
+size_t get_snapshot_delta_bound(const Snapshot *snapshot)
 {
-    assert(keycode >= 0 && keycode < ALLEGRO_KEY_MAX);
-    return keys_released[keycode];
+    // the header, then at worst two varints and 9 bytes for every changed word
+    return 64 + snapshot->size / 8 * 10;
 }
 
-int get_mouse_x()
+/*
+    The delta is the magic, the number of words, the size and tick of the
+    base, then pairs of runs covering every word: the number of unchanged
+    words, the number of changed words and the changed words XORed with the
+    base, so a truncated delta is caught when the words run out. Each XORed word
+    is a byte with a bit per non zero byte followed by those bytes, as
+    changes are usually in the low bytes of a few fields.
+ */
+size_t encode_snapshot_delta(const Snapshot *snapshot, const Snapshot *base, void *out)
 {
-    return mouse_x;
+    const uint64_t *words = snapshot->data;
+    const uint64_t *base_words = base->data;
+    size_t num_words = snapshot->size / 8;
+    size_t num_base_words = base->size / 8;
+
+    uint8_t *p = out;
+    memcpy(p, SNAPSHOT_DELTA_MAGIC, 4);
+    p += 4;
+    p = write_delta_varint(p, num_words);
+    p = write_delta_varint(p, num_base_words);
+    p = write_delta_varint(p, (uint32_t)get_snapshot_tick(base));
+
+    size_t i = 0;
+    while (i < num_words) {
+        size_t start = i;
+        while (i < num_words && words[i] == (i < num_base_words ? base_words[i] : 0)) {
+            i++;
+        }
+        size_t changed_start = i;
+        while (i < num_words && words[i] != (i < num_base_words ? base_words[i] : 0)) {
+            i++;
+        }
+        p = write_delta_varint(p, changed_start - start);
+        p = write_delta_varint(p, i - changed_start);
+        for (size_t j = changed_start; j < i; j++) {
+            uint64_t x = words[j] ^ (j < num_base_words ? base_words[j] : 0);
+            uint8_t *mask = p++;
+            *mask = 0;
+            for (int k = 0; k < 8; k++, x >>= 8) {
+                if (x & 0xff) {
+                    *mask |= 1 << k;
+                    *p++ = (uint8_t)x;
+                }
+            }
+        }
+    }
+    return p - (uint8_t *)out;
 }
 
-int get_mouse_y()
+// The largest snapshot the registered regions can be restored from, arenas are limited to their first block.
+static size_t get_max_snapshot_size()
 {
-    return mouse_y;
+    size_t size = sizeof(SnapshotHeader);
+    for (int i = 0; i < num_snapshot_regions; i++) {
+        SnapshotRegion *region = &snapshot_regions[i];
+        if (region->arena) {
+            size += sizeof(SnapshotArenaHeader) + align_snapshot_size(get_first_arena_block(region->arena)->size);
+        }
+        else {
+            size += align_snapshot_size(region->size);
+        }
+    }
+    return size;
 }
 
-int get_mouse_dx()
+bool decode_snapshot_delta(Snapshot *snapshot, const Snapshot *base, const void *delta, size_t size)
 {
-    return mouse_x - mouse_old_x;
+    assert(snapshot != base);
+
+    // empty until the whole delta has been decoded, so a broken one leaves nothing half written
+    snapshot->size = 0;
+
+    const uint8_t *p = delta, *end = p + size;
+    uint64_t num_words, num_base_words, base_tick;
+    if (size < 4 || memcmp(p, SNAPSHOT_DELTA_MAGIC, 4) != 0) {
+        log_warning("Snapshot delta is broken");
+        return false;
+    }
+    p += 4;
+    if (!read_delta_varint(&p, end, &num_words) || !read_delta_varint(&p, end, &num_base_words) || !read_delta_varint(&p, end, &base_tick)) {
+        log_warning("Snapshot delta is broken");
+        return false;
+    }
+
+    if (num_base_words != base->size / 8 || (uint32_t)base_tick != (uint32_t)get_snapshot_tick(base)) {
+        log_warning("Snapshot delta has a different base");
+        return false;
+    }
+    // a bigger snapshot couldn't be restored anyway, so don't let a hostile delta allocate it
+    if (num_words > get_max_snapshot_size() / 8) {
+        log_warning("Snapshot delta is larger than the snapshot regions");
+        return false;
+    }
+    if (!reserve_snapshot(snapshot, num_words * 8)) {
+        log_warning("Failed to allocate %llu bytes for snapshot delta", (unsigned long long)num_words * 8);
+        return false;
+    }
+    uint64_t *words = snapshot->data;
+    const uint64_t *base_words = base->data;
+
+    size_t i = 0;
+    while (p < end) {
+        uint64_t num_unchanged, num_changed;
+        // checked one at a time, as their sum may wrap around
+        if (!read_delta_varint(&p, end, &num_unchanged) || !read_delta_varint(&p, end, &num_changed) ||
+            num_unchanged > num_words - i || num_changed > num_words - i - num_unchanged) {
+            log_warning("Snapshot delta is broken");
+            return false;
+        }
+
+        for (size_t n = i + num_unchanged; i < n; i++) {
+            words[i] = i < num_base_words ? base_words[i] : 0;
+        }
+        for (size_t n = i + num_changed; i < n; i++) {
+            if (p >= end) {
+                log_warning("Snapshot delta is broken");
+                return false;
+            }
+            uint8_t mask = *p++;
+            uint64_t x = 0;
+            for (int k = 0; k < 8; k++) {
+                if (mask & (1 << k)) {
+                    if (p >= end) {
+                        log_warning("Snapshot delta is broken");
+                        return false;
+                    }
+                    x |= (uint64_t)*p++ << (k * 8);
+                }
+            }
+            words[i] = x ^ (i < num_base_words ? base_words[i] : 0);
+        }
+    }
+
+    if (i != num_words) {
+        log_warning("Snapshot delta is broken");
+        return false;
+    }
+    snapshot->size = num_words * 8;
+    return true;
 }
 
-int get_mouse_dy()
+SnapshotHistory* create_snapshot_history(int capacity)
 {
-    return mouse_y - mouse_old_y;
+    SnapshotHistory *history = calloc(1, sizeof(SnapshotHistory));
+    if (!history) {
+        log_error("Failed to create snapshot history");
+    }
+
+    history->capacity = capacity > 0 ? capacity : DEFAULT_ROLLBACK_TICKS;
+    history->snapshots = calloc(history->capacity, sizeof(Snapshot *));
+    if (!history->snapshots) {
+        log_error("Failed to create snapshot history");
+    }
+    for (int i = 0; i < history->capacity; i++) {
+        history->snapshots[i] = create_snapshot();
+    }
+    history->newest_tick = INT_MIN;
+    return history;
 }
 
-bool is_mouse_button_down(int mouse_button)
+void destroy_snapshot_history(SnapshotHistory *history)
 {
-    assert(mouse_button >= 0 && mouse_button < al_get_mouse_num_buttons());
-    return mouse_buttons[mouse_button];
+    if (!history) {
+        return;
+    }
+
+    for (int i = 0; i < history->capacity; i++) {
+        destroy_snapshot(history->snapshots[i]);
+    }
+    free(history->snapshots);
+    free(history);
 }
 
-bool is_mouse_button_pressed(int mouse_button)
+static Snapshot* get_history_slot(SnapshotHistory *history, int tick)
 {
-    assert(mouse_button >= 0 && mouse_button < al_get_mouse_num_buttons());
-    return mouse_buttons_pressed[mouse_button];
+    return history->snapshots[((tick % history->capacity) + history->capacity) % history->capacity];
 }
 
-bool is_mouse_button_released(int mouse_button)
+bool record_snapshot(SnapshotHistory *history)
 {
-    assert(mouse_button >= 0 && mouse_button < al_get_mouse_num_buttons());
-    return mouse_buttons_released[mouse_button];
+    Snapshot *snapshot = get_history_slot(history, tick_count);
+    if (!take_snapshot(snapshot)) {
+        snapshot->size = 0;
+        return false;
+    }
+    history->newest_tick = tick_count;
+    return true;
 }
 
-int wait_for_keypress()
+Snapshot* get_history_snapshot(SnapshotHistory *history, int tick)
 {
-    ALLEGRO_EVENT event;
-    do {
-        al_wait_for_event(event_queue, &event);
-    } while (event.type != ALLEGRO_EVENT_KEY_DOWN);
-    return event.keyboard.keycode;
+    Snapshot *snapshot = get_history_slot(history, tick);
+    if (tick > history->newest_tick || snapshot->size == 0 || get_snapshot_tick(snapshot) != tick) {
+        return NULL;
+    }
+    return snapshot;
 }
 
-bool is_float_equal(float a, float b)
+bool rollback_snapshot(SnapshotHistory *history, int tick)
 {
-	return fabs(a - b) < ALMOST_ZERO;
+    Snapshot *snapshot = get_history_snapshot(history, tick);
+    if (!snapshot || !restore_snapshot(snapshot)) {
+        return false;
+    }
+    history->newest_tick = tick;
+    return true;
 }
 
-bool is_double_equal(double a, double b)
+static uint64_t mix_snapshot_word(uint64_t hash, uint64_t word)
 {
-	return fabs(a - b) < ALMOST_ZERO;
+    hash = (hash ^ word) * 0x100000001b3ull;
+    return hash ^ (hash >> 32);
 }
 
-int lerpi(int a, int b, int alpha)
+// Four independent lanes, so the multiplies overlap instead of waiting on each other.
+static uint64_t hash_snapshot_words(uint64_t hash, const uint64_t *words, size_t num_words)
 {
-	return a + alpha * (b - a);
+    uint64_t lanes[4] = { hash, hash + 1, hash + 2, hash + 3 };
+    size_t i = 0;
+    for (; i + 4 <= num_words; i += 4) {
+        for (int j = 0; j < 4; j++) {
+            lanes[j] = mix_snapshot_word(lanes[j], words[i + j]);
+        }
+    }
+    for (; i < num_words; i++) {
+        lanes[0] = mix_snapshot_word(lanes[0], words[i]);
+    }
+
+    for (int j = 1; j < 4; j++) {
+        lanes[0] = mix_snapshot_word(lanes[0], lanes[j]);
+    }
+    return lanes[0];
 }
 
-float lerpf(float a, float b, float alpha)
+uint64_t get_snapshot_hash(const Snapshot *snapshot)
 {
-	return a + alpha * (b - a);
+    // only the state is hashed, and arena block addresses differ between machines
+    uint64_t hash = 14695981039346656037ull;
+    size_t offset = sizeof(SnapshotHeader);
+    for (int i = 0; i < num_snapshot_regions && offset < snapshot->size; i++) {
+        size_t region_size = snapshot_regions[i].size;
+        if (snapshot_regions[i].arena) {
+            SnapshotArenaHeader arena;
+            memcpy(&arena, (const char *)snapshot->data + offset, sizeof(arena));
+            offset += sizeof(uint64_t);
+            region_size = sizeof(uint64_t) + arena.used;
+        }
+
+        size_t end = offset + align_snapshot_size(region_size);
+        end = end < snapshot->size ? end : snapshot->size;
+        hash = hash_snapshot_words(hash, snapshot->data + offset / 8, (end - offset) / 8);
+        offset = end;
+    }
+    return hash;
 }
 
-double lerpd(double a, double b, double alpha)
+#define ROLLBACK_RING_SIZE 256
+
+typedef struct {
+    int tick;
+    uint32_t input;
+    uint32_t used;              // the input the tick was last simulated with
+    bool is_confirmed;
+    bool is_simulated;
+} RollbackInput;
+
+typedef struct {
+    int tick;
+    uint64_t local, remote;
+    bool has_local, has_remote;
+} RollbackHash;
+
+typedef struct {
+    int delivery_time;          // in advances of the receiving session
+    int player;                 // -1 for a state hash
+    int tick;
+    uint64_t value;
+} LoopbackMessage;
+
+struct RollbackSession {
+    int num_players;
+    int local_player;
+    int tick;
+    int num_advances;                               // the clock of loopback messages, runs on while stalled
+    int confirmed_ticks[MAX_ROLLBACK_PLAYERS];      // the last tick up to which all inputs of a player arrived
+    int rollback_tick;                              // the first mispredicted tick, INT_MAX if none
+    int final_hash_tick;                            // the last tick whose hash was checked
+    bool has_failed_snapshot;                       // warned that the state can't be recorded
+    RollbackInput inputs[MAX_ROLLBACK_PLAYERS][ROLLBACK_RING_SIZE];
+    RollbackHash hashes[ROLLBACK_RING_SIZE];
+    SnapshotHistory *history;
+    Snapshot *state;                                // while another session is swapped in
+
+    RollbackSession *peers[MAX_ROLLBACK_PLAYERS];
+    int peer_latencies[MAX_ROLLBACK_PLAYERS];
+    int num_peers;
+    LoopbackMessage *inbox;
+    int inbox_size, inbox_capacity;
+
+    RollbackStats stats;
+};
+
+static RollbackSession *active_rollback_session = NULL;    // the one whose state is in the registered regions
+static RollbackSession *stepping_rollback_session = NULL;
+
+RollbackSession* create_rollback_session(int num_players, int local_player, int max_rollback_ticks)
 {
-	return a + alpha * (b - a);
+    assert(num_players > 0 && num_players <= MAX_ROLLBACK_PLAYERS && local_player >= 0 && local_player < num_players);
+
+    RollbackSession *session = calloc(1, sizeof(RollbackSession));
+    if (!session) {
+        log_error("Failed to create rollback session");
+    }
+
+    session->num_players = num_players;
+    session->local_player = local_player;
+    for (int i = 0; i < MAX_ROLLBACK_PLAYERS; i++) {
+        session->confirmed_ticks[i] = -1;
+    }
+    for (int i = 0; i < ROLLBACK_RING_SIZE; i++) {
+        session->hashes[i].tick = -1;
+        for (int j = 0; j < MAX_ROLLBACK_PLAYERS; j++) {
+            session->inputs[j][i].tick = -1;
+        }
+    }
+    session->rollback_tick = INT_MAX;
+    session->final_hash_tick = -1;
+    session->stats.confirmed_tick = -1;
+    session->stats.desync_tick = -1;
+
+    max_rollback_ticks = max_rollback_ticks < 1 ? 1 : (max_rollback_ticks > MAX_ROLLBACK_TICKS ? MAX_ROLLBACK_TICKS : max_rollback_ticks);
+    session->history = create_snapshot_history(max_rollback_ticks);
+    session->state = create_snapshot();
+    take_snapshot(session->state);
+    return session;
 }
 
-int get_random_int(int min, int max)
+static void disconnect_loopback_session(RollbackSession *session, RollbackSession *peer)
 {
-    return min + (rand() % (int)(max - min + 1));
+    for (int i = 0; i < session->num_peers; i++) {
+        if (session->peers[i] == peer) {
+            session->num_peers--;
+            session->peers[i] = session->peers[session->num_peers];
+            session->peer_latencies[i] = session->peer_latencies[session->num_peers];
+            return;
+        }
+    }
 }
 
-float get_random_float(float min, float max)
+void destroy_rollback_session(RollbackSession *session)
 {
-    return min + ((float)rand() / ((float)RAND_MAX / (max - min)));
+    if (!session) {
+        return;
+    }
+
+    for (int i = 0; i < session->num_peers; i++) {
+        disconnect_loopback_session(session->peers[i], session);
+    }
+    if (active_rollback_session == session) {
+        active_rollback_session = NULL;
+    }
+
+    destroy_snapshot_history(session->history);
+    destroy_snapshot(session->state);
+    free(session->inbox);
+    free(session);
 }
 
-bool one_in(int chance)
+void connect_loopback_sessions(RollbackSession *a, RollbackSession *b, int latency_ticks)
 {
-    if (get_random_int(0, chance - 1) == 0)
-        return true;
-    return false;
+    assert(a->num_peers < MAX_ROLLBACK_PLAYERS && b->num_peers < MAX_ROLLBACK_PLAYERS);
+
+    a->peers[a->num_peers] = b;
+    a->peer_latencies[a->num_peers++] = latency_ticks;
+    b->peers[b->num_peers] = a;
+    b->peer_latencies[b->num_peers++] = latency_ticks;
 }
 
-int roll_dice(int number, int sides)
+static void send_to_peers(RollbackSession *session, int player, int tick, uint64_t value)
 {
-    int result = 0;
-    for (int i = 0; i < number; i++)
-        result += get_random_int(1, sides);
-    return result;
+    for (int i = 0; i < session->num_peers; i++) {
+        RollbackSession *peer = session->peers[i];
+        peer->inbox = grow_array(peer->inbox, &peer->inbox_capacity, peer->inbox_size + 1, sizeof(LoopbackMessage));
+        peer->inbox[peer->inbox_size++] = (LoopbackMessage) { peer->num_advances + session->peer_latencies[i], player, tick, value };
+    }
 }
 
-ALLEGRO_FONT* get_default_font()
+static void receive_loopback_messages(RollbackSession *session)
 {
-    return default_font;
+    int num_kept = 0;
+    for (int i = 0; i < session->inbox_size; i++) {
+        LoopbackMessage message = session->inbox[i];
+        if (message.delivery_time > session->num_advances) {
+            session->inbox[num_kept++] = message;
+        }
+        else if (message.player < 0) {
+            add_remote_state_hash(session, message.tick, message.value);
+        }
+        else {
+            add_remote_input(session, message.player, message.tick, (uint32_t)message.value);
+        }
+    }
+    session->inbox_size = num_kept;
 }
 
-float angle_between_points(float x1, float y1, float x2, float y2)
+static RollbackInput* get_rollback_input(RollbackSession *session, int player, int tick)
 {
-    return atan2(y2 - y1, x2 - x1);
+    RollbackInput *input = &session->inputs[player][tick % ROLLBACK_RING_SIZE];
+    if (input->tick != tick) {
+        *input = (RollbackInput) { tick, 0, 0, false, false };
+    }
+    return input;
 }
 
-float angle_between_points_ex(Point p1, Point p2)
+static int get_confirmed_tick(RollbackSession *session)
 {
-    return angle_between_points(p1.x, p1.y, p2.x, p2.y);
+    int tick = INT_MAX;
+    for (int i = 0; i < session->num_players; i++) {
+        tick = session->confirmed_ticks[i] < tick ? session->confirmed_ticks[i] : tick;
+    }
+    return tick;
 }
 
-float distance_between_points(float x1, float y1, float x2, float y2)
+void add_remote_input(RollbackSession *session, int player, int tick, uint32_t input)
 {
-    float dx = x2 - x1;
-    float dy = y2 - y1;
-    return sqrt(dx * dx + dy * dy);
+    if (player < 0 || player >= session->num_players || player == session->local_player || tick <= session->confirmed_ticks[player]) {
+        return;
+    }
+    if (tick >= session->tick + ROLLBACK_RING_SIZE / 2) {
+        log_warning("Dropped input for tick %d, too far ahead of tick %d", tick, session->tick);
+        return;
+    }
+
+    RollbackInput *slot = get_rollback_input(session, player, tick);
+    slot->input = input;
+    slot->is_confirmed = true;
+    if (slot->is_simulated && slot->used != input && tick < session->rollback_tick) {
+        session->rollback_tick = tick;
+    }
+
+    // inputs may arrive out of order, the player is confirmed up to the first gap
+    int *confirmed_tick = &session->confirmed_ticks[player];
+    for (;;) {
+        RollbackInput *next = &session->inputs[player][(*confirmed_tick + 1) % ROLLBACK_RING_SIZE];
+        if (next->tick != *confirmed_tick + 1 || !next->is_confirmed) {
+            break;
+        }
+        (*confirmed_tick)++;
+    }
 }
 
-float distance_between_points_ex(Point p1, Point p2)
+static void check_state_hash(RollbackSession *session, RollbackHash *hash)
 {
-    return distance_between_points(p1->x, p1->y, p2->x, p2->y);
+    if (hash->has_local && hash->has_remote && hash->tick <= session->final_hash_tick &&
+        hash->local != hash->remote && session->stats.desync_tick < 0) {
+        session->stats.desync_tick = hash->tick;
+        log_warning("Desync at tick %d", hash->tick);
+    }
 }
 
-bool rectangles_intersect(float l1, float t1, float r1, float b1, float l2, float t2, float r2, float b2)
+static RollbackHash* get_rollback_hash(RollbackSession *session, int tick)
 {
-    return !(r1 < l2 || b1 < t2 || l1 > r2 || t1 > b2);
+    RollbackHash *hash = &session->hashes[tick % ROLLBACK_RING_SIZE];
+    if (hash->tick != tick) {
+        *hash = (RollbackHash) { tick, 0, 0, false, false };
+    }
+    return hash;
 }
 
-bool rectangles_intersect_ex(Rectangle r1, Rectangle r2)
+void add_remote_state_hash(RollbackSession *session, int tick, uint64_t value)
 {
-    return rectangles_intersect(r1->x, r1-y, r1->x + r1->w, r1->y + r1->h, r2->x, r2-y, r2->x + r2->w, r2->y + r2->h);
+    if (tick < 0 || tick <= session->final_hash_tick - ROLLBACK_RING_SIZE / 2) {
+        return;
+    }
+
+    RollbackHash *hash = get_rollback_hash(session, tick);
+    hash->remote = value;
+    hash->has_remote = true;
+    check_state_hash(session, hash);
 }
 
-bool rectangle_contains_point(float l, float t, float r, float b, float x, float y)
+// Hashes are final once the inputs of every tick before them are confirmed.
+static void finalize_state_hashes(RollbackSession *session)
 {
-    return !(x < l || x > r || y < t || y > b);
+    int last_tick = get_confirmed_tick(session) + 1;
+    last_tick = last_tick < session->tick - 1 ? last_tick : session->tick - 1;
+    while (session->final_hash_tick < last_tick) {
+        int tick = ++session->final_hash_tick;
+        RollbackHash *hash = get_rollback_hash(session, tick);
+        if (hash->has_local) {
+            send_to_peers(session, -1, tick, hash->local);
+            check_state_hash(session, hash);
+        }
+    }
 }
 
-bool rectangle_contains_point_ex(Rectangle r, Point p)
+// Swaps the state of a session into the registered regions.
+static bool activate_rollback_session(RollbackSession *session)
 {
-    return rectangle_contains_point(r->x, r-y, r->x + r->w, r->y + r->h, p->x, p->y);
+    if (active_rollback_session == session) {
+        return true;
+    }
+
+    // the active state stays where it is unless it was saved
+    if (active_rollback_session && !take_snapshot(active_rollback_session->state)) {
+        return false;
+    }
+    if (!restore_snapshot(session->state)) {
+        return false;
+    }
+    active_rollback_session = session;
+    return true;
 }
 
-bool circles_intersect(float x1, float y1, float r1, float x2, float y2, float r2)
+// Records the snapshot and hash of the state a tick starts from, returns false if the state can't be saved.
+static bool record_rollback_tick(RollbackSession *session, int tick)
 {
-    float radii = r1 + r2;
-    float dx = x2 - x1;
-    float dy = y2 - y1;
-    return (radii * radii) > (dx * dx + dy * dy);
+    tick_count = tick;
+    RollbackHash *hash = get_rollback_hash(session, tick);
+    if (!record_snapshot(session->history)) {
+        hash->has_local = false;
+        if (!session->has_failed_snapshot) {
+            log_warning("Rollback session failed to snapshot tick %d, it can't roll back there", tick);
+            session->has_failed_snapshot = true;
+        }
+        return false;
+    }
+
+    hash->local = get_snapshot_hash(get_history_snapshot(session->history, tick));
+    hash->has_local = true;
+    return true;
 }
 
-bool circles_intersect_ex(Circle c1, Circle c2)
+static void simulate_rollback_tick(RollbackSession *session, int tick, void (*step_proc)())
+{
+    tick_count = tick;
+
+    // inputs that haven't arrived repeat the last confirmed input
+    for (int i = 0; i < session->num_players; i++) {
+        RollbackInput *input = get_rollback_input(session, i, tick);
+        if (!input->is_confirmed) {
+            int confirmed_tick = session->confirmed_ticks[i];
+            RollbackInput *last = &session->inputs[i][(confirmed_tick < 0 ? 0 : confirmed_tick) % ROLLBACK_RING_SIZE];
+            input->used = confirmed_tick >= 0 && last->tick == confirmed_tick ? last->input : 0;
+        }
+        else {
+            input->used = input->input;
+        }
+        input->is_simulated = true;
+    }
+
+    stepping_rollback_session = session;
+    step_proc();
+    stepping_rollback_session = NULL;
+}
+
+bool advance_rollback_session(RollbackSession *session, uint32_t local_input, void (*step_proc)())
 {
-    return circles_intersect(c1->x, c1->y, c1->r, c2->x, c2->y, c2->r);
+    if (!activate_rollback_session(session)) {
+        session->stats.stalled_ticks++;
+        return false;
+    }
+
+    int outer_tick_count = tick_count;
+    session->num_advances++;
+    receive_loopback_messages(session);
+
+    if (session->rollback_tick < session->tick) {
+        PROFILE_BEGIN("rollback");
+        double start_time = al_get_time();
+
+        int tick = session->rollback_tick;
+        if (rollback_snapshot(session->history, tick)) {
+            // the restored snapshot of the first tick is still in the history, and a
+            // tick that can't be recorded is simulated anyway to get back to the present
+            for (int t = tick; t < session->tick; t++) {
+                if (t > tick) {
+                    record_rollback_tick(session, t);
+                }
+                simulate_rollback_tick(session, t, step_proc);
+            }
+
+            int num_ticks = session->tick - tick;
+            session->stats.num_rollbacks++;
+            session->stats.resimulated_ticks += num_ticks;
+            if (num_ticks > session->stats.longest_rollback) {
+                session->stats.longest_rollback = num_ticks;
+            }
+        }
+        else {
+            log_warning("Failed to roll back to tick %d", tick);
+        }
+        session->rollback_tick = INT_MAX;
+
+        session->stats.resimulation_time += al_get_time() - start_time;
+        PROFILE_END("rollback");
+    }
+
+    // stall rather than run further ahead of the remote inputs than the history reaches back
+    int remote_tick = INT_MAX;
+    for (int i = 0; i < session->num_players; i++) {
+        if (i != session->local_player && session->confirmed_ticks[i] < remote_tick) {
+            remote_tick = session->confirmed_ticks[i];
+        }
+    }
+    bool is_stalled = remote_tick != INT_MAX && session->tick - remote_tick > session->history->capacity;
+
+    // a tick that can't be recorded couldn't be rolled back, so it isn't simulated
+    if (!is_stalled && !record_rollback_tick(session, session->tick)) {
+        is_stalled = true;
+    }
+
+    if (is_stalled) {
+        session->stats.stalled_ticks++;
+    }
+    else {
+        int tick = session->tick;
+        RollbackInput *input = get_rollback_input(session, session->local_player, tick);
+        input->input = local_input;
+        input->is_confirmed = true;
+        session->confirmed_ticks[session->local_player] = tick;
+        send_to_peers(session, session->local_player, tick, local_input);
+
+        simulate_rollback_tick(session, tick, step_proc);
+        session->tick++;
+    }
+    finalize_state_hashes(session);
+
+    tick_count = outer_tick_count;
+    return !is_stalled;
 }
 
-bool circle_contains_point(float x1, float y1, float r, float x2, float y2)
+uint32_t get_player_input(int player)
 {
-    float dx = x2 - x1;
-    float dy = y2 - y1;
-    return (dx * dx + dy * dy) < (r * r);
+    RollbackSession *session = stepping_rollback_session;
+    if (!session || player < 0 || player >= session->num_players) {
+        return 0;
+    }
+    return session->inputs[player][tick_count % ROLLBACK_RING_SIZE].used;
 }
 
-bool circle_contains_point_ex(Circle c, Point p)
+RollbackStats get_rollback_stats(RollbackSession *session)
 {
-    return circle_contains_point(c->x, c->y, c->r, p->x, p->y);
+    RollbackStats stats = session->stats;
+    stats.tick = session->tick;
+    stats.confirmed_tick = get_confirmed_tick(session);
+    stats.resimulated_ticks_per_second = stats.resimulation_time > 0 ? stats.resimulated_ticks / stats.resimulation_time : 0;
+    return stats;
 }
@@ -19,29 +19,73 @@
 
 #define lengthof(x)  (sizeof(x) / sizeof(x[0]))
 
+// SIMD instruction sets used by the batch functions (see get_simd_level).
+enum { SIMD_NONE, SIMD_SSE2, SIMD_AVX2 };
+
+/*
+    Returns the instruction set used by the batch functions.
+    The best one supported by the cpu is picked the first time it is needed.
+ */
+int get_simd_level();
+
+/*
+    Overrides the instruction set used by the batch functions, e.g. to compare
+    against the scalar fallback. Levels not supported by the cpu are clamped.
+ */
+void set_simd_level(int simd_level);
+
 //==============================================================================
 // DEBUG
 //==============================================================================
 
+// logging levels (used in write_logfile)
+#define LOG_MESSAGE 0
+#define LOG_WARNING 1
+#define LOG_ERROR   2
+
+/*
+    Messages below this level are removed at compile time, e.g. compile with
+    -DMIN_LOG_LEVEL=LOG_WARNING to drop all log_message calls.
+    Errors are never removed.
+ */
+#ifndef MIN_LOG_LEVEL
+    #define MIN_LOG_LEVEL LOG_MESSAGE
+#endif
+
 /*
     Logging macros.
     - log_message: for debug messages
     - log_warning: for non-fatal errors, i.e. continue program execution
     - log_error:   for fatal errors, program will be forcefully terminated
  */
-#define log_message(...) write_logfile(LOG_MESSAGE, __VA_ARGS__);
-#define log_warning(...) write_logfile(LOG_WARNING, __VA_ARGS__);
+#if MIN_LOG_LEVEL <= LOG_MESSAGE
+    #define log_message(...) write_logfile(LOG_MESSAGE, __VA_ARGS__);
+#else
+    #define log_message(...)
+#endif
+#if MIN_LOG_LEVEL <= LOG_WARNING
+    #define log_warning(...) write_logfile(LOG_WARNING, __VA_ARGS__);
+#else
+    #define log_warning(...)
+#endif
 #define log_error(...)   write_logfile(LOG_ERROR, __VA_ARGS__);
 
-// logging levels (used in write_logfile)
-enum { LOG_MESSAGE, LOG_WARNING, LOG_ERROR };
-
 /*
-    Writes a message to the logfile.
+    Writes a message to the logfile (log.txt), prefixed with a timestamp.
     Use the logging macros above instead of using this function directly.
+
+    Messages are queued and written in batches by a background thread once
+    allegro is initialized. Messages longer than LOG_RECORD_SIZE are truncated,
+    and messages are dropped (and counted in the log) if the queue is full.
+    Errors flush the queue before the program exits.
  */
 void write_logfile(int log_level, const char *format, ...);
 
+#define LOG_RECORD_SIZE 488
+
+// Writes all queued messages to the logfile before returning.
+void flush_logfile();
+
 //==============================================================================
 // FRAMEWORK
 //==============================================================================
@@ -57,6 +101,32 @@ void write_logfile(int log_level, const char *format, ...);
  */
 void init_framework(const char *title, int window_width, int window_height, bool fullscreen);
 
+/*
+    Initializes the framework without a display, keyboard or mouse, e.g. for
+    benchmarks and tests on build servers. Use this instead of init_framework().
+
+    The game loops run ticks back to back as fast as possible instead of
+    waiting for the timer, input only comes from play_input_events() and
+    the random generators are seeded with 0, so runs are deterministic.
+
+    width, height: the size reported by get_window_width/height()
+    should_render: if true, render_proc() draws into a memory bitmap of that
+                   size, otherwise rendering is skipped
+ */
+void init_framework_headless(int width, int height, bool should_render);
+
+// Returns true if the framework was initialized with init_framework_headless().
+bool is_headless();
+
+/*
+    Makes the game loops return after a number of ticks in headless mode.
+    0 (the default) runs until quit() is called.
+ */
+void set_headless_tick_limit(int num_ticks);
+
+// Returns the number of logic ticks run so far.
+int get_tick_count();
+
 /*
     Destroys everything we need to clean up when it is time to quit the program.
     This function is called automatically at program exit.
@@ -68,7 +138,7 @@ void destroy_framework();
 
     update_proc() and draw_proc() are function pointers you need to define yourself.
     Will call update_proc() 60 times per second.
-    Will call render_proc() 60 times a second if there is no other events to deal with.
+    Will call render_proc() 60 times a second, after all pending events are handled.
     If there is nothing else to do, the game loop will sleep.
  */
 void run_game_loop(void (*update_proc)(), void (*render_proc)());
@@ -83,6 +153,233 @@ void quit();
  */
 void alt_tab_should_pause(bool true_or_false);
 
+// Render modes used by run_fixed_game_loop().
+enum {
+    RENDER_ON_TICK,     // render once after each batch of logic ticks, sleep in between
+    RENDER_UNCAPPED     // render as often as possible, limited by vsync if enabled
+};
+
+/*
+    Runs the game loop with a fixed logic rate that is decoupled from rendering.
+
+    update_proc() is called at the logic rate (see set_logic_rate()), catching
+    up with several calls when a frame was slow, but never more than the catch
+    up limit. Time beyond that is dropped, so slow machines drop frames instead
+    of falling further and further behind.
+
+    render_proc() is given alpha, how far between the last and the next logic
+    tick the frame is [0, 1). Use it with lerpf() to smooth movement.
+ */
+void run_fixed_game_loop(void (*update_proc)(), void (*render_proc)(float alpha));
+
+// Sets the number of logic ticks per second used by run_fixed_game_loop(). Default is 60.
+void set_logic_rate(double ticks_per_second);
+
+// Sets the max number of logic ticks run to catch up in one frame. Default is 5.
+void set_max_catch_up_ticks(int max_ticks);
+
+// Sets the render mode used by run_fixed_game_loop(). Default is RENDER_ON_TICK.
+void set_render_mode(int render_mode);
+
+/*
+    Requests vsync for the display.
+    This must be called before init_framework() to have any effect.
+ */
+void use_vsync(bool true_or_false);
+
+//==============================================================================
+// JOBS
+//==============================================================================
+
+/*
+    Job system.
+    A pool of worker threads, one per extra core, is started by the init
+    functions. Every thread keeps its own queue of jobs and steals from the
+    others when it runs out. A thread waiting for jobs runs jobs in the
+    meantime, so update_proc() can fan work out and join before returning.
+
+    Jobs can be queued from the main thread and from inside other jobs, from
+    any other thread they run right away. Each job thread gets its own random
+    stream, see set_random_stream().
+ */
+typedef void (*JobProc)(void *data);
+
+// Counts unfinished jobs, used to wait for them or to make jobs depend on them.
+typedef struct JobCounter JobCounter;
+
+JobCounter* create_job_counter();
+
+// Destroys a counter, its jobs must have finished.
+void destroy_job_counter(JobCounter *counter);
+
+// Queues a job, counter (may be NULL) is incremented until the job has finished.
+void run_job(JobProc proc, void *data, JobCounter *counter);
+
+// Queues a job that starts once all jobs counted by dependency have finished.
+void run_job_after(JobCounter *dependency, JobProc proc, void *data, JobCounter *counter);
+
+// Returns true if all jobs counted by counter have finished.
+bool is_job_counter_done(JobCounter *counter);
+
+// Runs jobs until all jobs counted by counter have finished.
+void wait_for_job_counter(JobCounter *counter);
+
+/*
+    Calls proc for batches of [0, count) on all job threads and returns when
+    they are done. batch_size is the number of indices per call, 0 picks one.
+ */
+void parallel_for(int count, int batch_size, void (*proc)(int begin, int end, void *data), void *data);
+
+// Returns the number of threads running jobs, including the main thread.
+int get_job_thread_count();
+
+// Returns the index of the calling job thread, 0 is the main thread, -1 other threads.
+int get_job_thread_index();
+
+//==============================================================================
+// MEMORY
+//==============================================================================
+
+/*
+    Arenas hand out memory by bumping a pointer and free all of it at once
+    with arena_reset(). When an arena runs out it chains another block, the
+    next reset merges them into one block big enough for the whole load, so
+    an arena used the same way every tick stops allocating after warming up.
+ */
+typedef struct Arena Arena;
+
+// Memory statistics of an arena.
+typedef struct {
+    size_t used;            // bytes allocated since the last reset
+    size_t capacity;        // bytes reserved
+    size_t high_water;      // most bytes used between two resets
+    int num_blocks;         // blocks currently reserved, 1 once warmed up
+} ArenaStats;
+
+// Creates an arena, size is the size of the first block.
+Arena* create_arena(size_t size);
+void destroy_arena(Arena *arena);
+
+// Allocates size bytes aligned to 16 bytes.
+void* arena_alloc(Arena *arena, size_t size);
+
+// Allocates a formatted string.
+char* arena_printf(Arena *arena, const char *format, ...);
+
+// Frees everything allocated from the arena.
+void arena_reset(Arena *arena);
+
+ArenaStats get_arena_stats(Arena *arena);
+
+/*
+    Per tick scratch memory.
+    The game loops switch between two arenas at the start of every tick and
+    reset the one switched to, so memory stays valid until the end of the
+    next tick. render_proc() can use what the last tick before it allocated,
+    but not older ticks when several run per frame. Only use it from the main
+    thread.
+ */
+Arena* get_frame_arena();
+
+// Short cuts for arena_alloc() and arena_printf() with the frame arena.
+void* frame_alloc(size_t size);
+char* frame_printf(const char *format, ...);
+
+/*
+    A pool of fixed size objects with a fixed capacity.
+    Allocating and freeing are O(1) and never touch the heap.
+ */
+typedef struct Pool Pool;
+
+// Memory statistics of a pool.
+typedef struct {
+    int used;               // objects allocated
+    int capacity;           // max number of objects
+    int high_water;         // most objects allocated at once
+} PoolStats;
+
+Pool* create_pool(size_t object_size, int capacity);
+void destroy_pool(Pool *pool);
+
+// Allocates an object, returns NULL if the pool is full.
+void* pool_alloc(Pool *pool);
+
+// Gives an object back to the pool.
+void pool_free(Pool *pool, void *object);
+
+PoolStats get_pool_stats(Pool *pool);
+
+//==============================================================================
+// PROFILER
+//==============================================================================
+
+/*
+    Frame time profiler.
+    When enabled, the game loops measure the time spent handling events, in
+    update_proc(), in render_proc() and flipping the display. Your own code can
+    be measured with named scopes:
+
+        PROFILE_BEGIN("physics");
+        ...
+        PROFILE_END("physics");
+
+    Scopes are summed per frame, so a scope may be entered several times in a
+    frame but must not be nested in itself. The profiler is not thread safe,
+    only use it from the thread running the game loop.
+ */
+#define PROFILE_BEGIN(name) do { static int scope_ = -1; if (scope_ < 0) scope_ = get_profile_scope(name); profile_begin_scope(scope_); } while (0)
+#define PROFILE_END(name)   do { static int scope_ = -1; if (scope_ < 0) scope_ = get_profile_scope(name); profile_end_scope(scope_); } while (0)
+
+// Built-in profiler scopes.
+enum {
+    PROFILE_FRAME,      // "frame": the whole frame
+    PROFILE_EVENTS,     // "events": handling allegro events
+    PROFILE_UPDATE,     // "update": update_proc()
+    PROFILE_RENDER,     // "render": render_proc()
+    PROFILE_FLIP,       // "flip": al_flip_display()
+    NUM_BUILTIN_PROFILE_SCOPES
+};
+
+#define MAX_PROFILE_SCOPES 32
+#define PROFILE_HISTORY_SIZE 1024
+
+// Statistics of a scope over the last PROFILE_HISTORY_SIZE frames, in milliseconds.
+typedef struct {
+    float last;
+    float min;
+    float avg;
+    float max;
+    float p99;
+} ProfileStats;
+
+// Enables or disables the profiler. It is disabled by default.
+void enable_profiler(bool true_or_false);
+
+// Shows a frame time graph and the scope statistics on top of each frame.
+void show_profiler_overlay(bool true_or_false);
+
+// Returns the id of a named scope, creating the scope if needed.
+int get_profile_scope(const char *name);
+
+// Starts and stops timing a scope. Use the PROFILE_BEGIN/END macros instead.
+void profile_begin_scope(int scope);
+void profile_end_scope(int scope);
+
+// Ends a profiler frame. This is called by the game loops.
+void profile_end_frame();
+
+// Returns false if the scope does not exist or has no recorded frames.
+bool get_profile_stats(const char *name, ProfileStats *stats);
+
+// Draws the profiler overlay with its top left corner at (x, y).
+void draw_profiler_overlay(float x, float y);
+
+// Writes the recorded frames to a CSV file, one row per frame and one column per scope.
+bool save_profile_csv(const char *filename);
+
+// Writes the recorded scopes to a JSON file that can be opened in chrome://tracing.
+bool save_profile_trace(const char *filename);
+
 //==============================================================================
 // GRAPHICS
 //==============================================================================
@@ -117,6 +414,214 @@ extern ALLEGRO_COLOR navy_color;
 extern ALLEGRO_COLOR teal_color;
 extern ALLEGRO_COLOR brown_color;
 
+//==============================================================================
+// SPRITE BATCHING
+//==============================================================================
+
+/*
+    Sprite batching.
+    Instead of drawing right away, the draw_sprite functions queue quads. The
+    queue is sorted by layer and texture and drawn with one al_draw_prim call
+    per texture change when flush_sprites() is called, which the game loops do
+    after render_proc(). Sprites cut from the same atlas share a texture, so a
+    whole layer of them is usually a single draw call.
+
+    Layers are drawn in increasing order, sprites within a layer and texture
+    keep the order they were queued in.
+ */
+
+// Queues a bitmap (or sub bitmap) to be drawn at (x, y).
+void draw_sprite(ALLEGRO_BITMAP *bitmap, float x, float y, int layer);
+
+// Queues a region of a bitmap to be drawn scaled and tinted.
+void draw_sprite_ex(ALLEGRO_BITMAP *bitmap, float sx, float sy, float sw, float sh,
+                    float dx, float dy, float dw, float dh, ALLEGRO_COLOR tint, int layer);
+
+// Queues a filled rectangle.
+void draw_sprite_rectangle(float x1, float y1, float x2, float y2, ALLEGRO_COLOR color, int layer);
+
+// Draws all queued sprites onto the target bitmap.
+void flush_sprites();
+
+typedef struct {
+    int num_sprites;    // sprites drawn by the last flush
+    int num_draw_calls; // al_draw_prim calls made by the last flush
+} SpriteBatchStats;
+
+// Returns statistics about the last flush_sprites().
+SpriteBatchStats get_sprite_batch_stats();
+
+/*
+    A texture atlas.
+    Packs many small bitmaps into a few large pages at startup, every source
+    bitmap becomes a sub bitmap of a page.
+ */
+typedef struct Atlas Atlas;
+
+/*
+    Loads image files and packs them into an atlas.
+    page_size: width and height of each page, e.g. 2048
+    Returns NULL if a file could not be loaded or does not fit on a page.
+ */
+Atlas* create_atlas(const char **filenames, int num_files, int page_size);
+
+// Packs already loaded bitmaps into an atlas, the bitmaps are copied.
+Atlas* create_atlas_from_bitmaps(ALLEGRO_BITMAP **bitmaps, int num_bitmaps, int page_size);
+
+// Destroys an atlas and all of its sprites.
+void destroy_atlas(Atlas *atlas);
+
+// Returns the sprite made from the file or bitmap at index.
+ALLEGRO_BITMAP* get_atlas_sprite(Atlas *atlas, int index);
+
+// Returns the number of pages in an atlas.
+int get_atlas_page_count(Atlas *atlas);
+
+//==============================================================================
+// TEXT
+//==============================================================================
+
+/*
+    Cached text.
+    al_draw_text() lays out and draws a string glyph by glyph every time. The
+    functions below render each string once into a text page and queue it as
+    a sprite afterwards, so drawing unchanged text costs a hash lookup and a
+    quad, and all cached text on a page is one draw call (see SPRITE BATCHING).
+
+    Strings are cached by font and text. They are rendered in white and tinted
+    when drawn, so the same string in another color reuses the cached one.
+    When the pages are full, the oldest page not drawn from this frame is
+    cleared and reused.
+ */
+#define TEXT_CACHE_PAGES 4
+#define TEXT_CACHE_PAGE_SIZE 1024
+
+/*
+    Queues text to be drawn at (x, y).
+    flags: the alignment flags of al_draw_text()
+    Text too large for a page is drawn right away with al_draw_text().
+ */
+void draw_cached_text(const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, int flags, int layer, const char *text);
+
+// Formats and queues text, only strings that changed since they were last drawn are rendered again.
+void draw_cached_textf(const ALLEGRO_FONT *font, ALLEGRO_COLOR color, float x, float y, int flags, int layer, const char *format, ...);
+
+// Drops all cached text, call it after destroying a font used with cached text.
+void clear_text_cache();
+
+typedef struct {
+    int num_strings;    // strings in the cache
+    int hits;           // draws of already cached strings in the last frame
+    int misses;         // strings rendered in the last frame
+} TextCacheStats;
+
+// Returns statistics about the text cache.
+TextCacheStats get_text_cache_stats();
+
+//==============================================================================
+// PARTICLES
+//==============================================================================
+
+/*
+    A pool of particles with a fixed capacity.
+    Particles are stored as separate arrays (structure of arrays) so updates
+    run 4-8 particles at a time depending on get_simd_level(). Dead particles
+    are replaced by the last live one, and all of them are drawn as one
+    al_draw_prim call.
+ */
+typedef struct ParticleEmitter ParticleEmitter;
+
+ParticleEmitter* create_particle_emitter(int capacity);
+void destroy_particle_emitter(ParticleEmitter *emitter);
+
+/*
+    Spawns particles at (x, y) moving in random directions.
+    speed: random in [min_speed, max_speed) pixels per tick
+    life: ticks until the particle is gone, it fades out on the way
+    Returns the number spawned, less than count if the pool is full.
+ */
+int emit_particles(ParticleEmitter *emitter, int count, float x, float y, float min_speed, float max_speed, float life, ALLEGRO_COLOR color);
+
+// Sets the velocity added to every particle each tick. Default is none.
+void set_particle_gravity(ParticleEmitter *emitter, float gx, float gy);
+
+// Sets the width and height particles are drawn with. Default is 2.
+void set_particle_size(ParticleEmitter *emitter, float size);
+
+// Moves all particles by one tick and removes the dead ones.
+void update_particles(ParticleEmitter *emitter);
+
+// Draws all particles right away, so they end up below queued sprites.
+void draw_particles(ParticleEmitter *emitter);
+
+// Returns the number of live particles.
+int get_particle_count(ParticleEmitter *emitter);
+
+//==============================================================================
+// ASSETS
+//==============================================================================
+
+/*
+    Asynchronous asset loading.
+    Files are read and decoded on background threads into memory bitmaps, the
+    main thread uploads them to video memory when update_assets() is called,
+    which the game loops do every tick. Fonts are uploaded once nothing else
+    is loading. This way the window shows up right away and levels can stream
+    in behind a loading screen.
+
+    Assets are cached by type and filename and reference counted, loading a
+    file that is already loaded or loading returns the same asset. Call
+    release_asset() once for every load. Load and release assets from the
+    main thread only.
+ */
+typedef struct Asset Asset;
+
+// Asset types.
+enum { ASSET_BITMAP, ASSET_FONT, ASSET_FILE };
+
+// Asset states.
+enum { ASSET_LOADING, ASSET_LOADED, ASSET_FAILED };
+
+// Starts loading an image.
+Asset* load_bitmap_async(const char *filename);
+
+// Starts loading a font, see al_load_font for the supported formats.
+Asset* load_font_async(const char *filename, int size);
+
+// Starts reading a whole file into memory.
+Asset* load_file_async(const char *filename);
+
+// Drops a reference, the asset is destroyed when the last one is released.
+void release_asset(Asset *asset);
+
+// Returns ASSET_LOADING, ASSET_LOADED or ASSET_FAILED.
+int get_asset_state(Asset *asset);
+
+// Returns the loaded bitmap or font, or NULL while loading or if loading failed.
+ALLEGRO_BITMAP* get_asset_bitmap(Asset *asset);
+ALLEGRO_FONT* get_asset_font(Asset *asset);
+
+// Returns the contents of a loaded file (zero terminated) or NULL.
+const void* get_asset_data(Asset *asset, size_t *size);
+
+/*
+    Uploads assets finished by the loader threads. The game loops call this
+    every tick, call it yourself when waiting for assets outside of them.
+ */
+void update_assets();
+
+// Returns the number of assets still loading.
+int get_pending_asset_count();
+
+/*
+    Returns the fraction of the assets requested since the loader was last
+    idle that have finished loading, for loading screens.
+ */
+float get_asset_load_progress();
+
+// Blocks until all requested assets are loaded.
+void wait_for_assets();
+
 //==============================================================================
 // INPUT
 //==============================================================================
@@ -130,12 +635,33 @@ bool is_key_pressed(int keycode);
 // Returns true if a key on the keyboard was released.
 bool is_key_released(int keycode);
 
-// helper mouse input enum
+// Returns true if any key is held down, was pressed or was released.
+bool is_any_key_down();
+bool is_any_key_pressed();
+bool is_any_key_released();
+
+/*
+    Writes the keycodes of the keys that were pressed or released, in
+    increasing order. Returns the number of keycodes written.
+ */
+int get_pressed_keys(int *out_keycodes, int max_keycodes);
+int get_released_keys(int *out_keycodes, int max_keycodes);
+
+/*
+    Returns the modifier keys held down as ALLEGRO_KEYMOD_* flags, e.g.
+    ALLEGRO_KEYMOD_SHIFT. Lock keys are reported as of the last typed character.
+ */
+int get_key_modifiers();
+
+/*
+    helper mouse input enum
+    Other buttons are numbered after these, up to MAX_MOUSE_BUTTONS.
+ */
 enum {
     MOUSE_LEFT_BUTTON,
     MOUSE_RIGHT_BUTTON,
     MOUSE_MIDDLE_BUTTON,
-    MAX_MOUSE_BUTTONS
+    MAX_MOUSE_BUTTONS = 32
 };
 
 // Returns mouse x coordinate.
@@ -159,12 +685,111 @@ bool is_mouse_button_pressed(int mouse_button);
 // Returns true if a mouse button was released.
 bool is_mouse_button_released(int mouse_button);
 
+// An input event used for playback, see play_input_events().
+typedef struct {
+    int tick;       // the tick the event happens before, see get_tick_count()
+    int type;       // ALLEGRO_EVENT_KEY_DOWN/UP, ALLEGRO_EVENT_MOUSE_AXES or ALLEGRO_EVENT_MOUSE_BUTTON_DOWN/UP
+    int code;       // the keycode or the allegro mouse button (starting at 1)
+    int x, y;       // the mouse position
+} InputEvent;
+
+/*
+    Plays back a list of input events, sorted by tick. Each event is applied
+    to the input state at the start of its tick, as if it was a real event.
+    The list must stay valid until playback is done, pass NULL to stop.
+ */
+void play_input_events(const InputEvent *events, int num_events);
+
+// Returns true while there are input events left to play back.
+bool is_playing_input_events();
+
+/*
+    Input recording.
+    While recording, every key and mouse event is appended to a compact,
+    delta encoded stream in memory together with the tick it happened before.
+    Every INPUT_KEYFRAME_INTERVAL ticks the full input state is stored as a
+    keyframe, so replays can seek without decoding from the start.
+ */
+#define INPUT_KEYFRAME_INTERVAL 600
+
+// Starts recording input, tick 0 of the recording is the next tick.
+void start_input_recording();
+
+/*
+    Stops recording and writes the recording to a file.
+    Returns false if the file could not be written.
+ */
+bool stop_input_recording(const char *filename);
+
+// Returns true while input is being recorded.
+bool is_recording_input();
+
+typedef struct InputReplay InputReplay;
+
+// Loads a recording written by stop_input_recording(). Returns NULL on failure.
+InputReplay* load_input_replay(const char *filename);
+
+// Destroys a replay loaded with load_input_replay().
+void destroy_input_replay(InputReplay *replay);
+
+// Returns the number of ticks in a replay.
+int get_input_replay_length(InputReplay *replay);
+
+/*
+    Plays back a replay, feeding its events into the input state starting with
+    the next tick. The replay must stay valid until playback is done, pass NULL
+    to stop.
+ */
+void play_input_replay(InputReplay *replay);
+
+/*
+    Restores the input state of the replay being played at a tick, so that the
+    next tick is that tick of the replay. Returns false if the tick is out of range.
+ */
+bool seek_input_replay(int replay_tick);
+
+// Returns true while a replay is being played.
+bool is_playing_input_replay();
+
 /*
     Waits until a key is pressed on the keyboard.
     Returns the keycode of the key that was pressed.
  */
 int wait_for_keypress();
 
+//==============================================================================
+// EVENTS
+//==============================================================================
+
+/*
+    Event callbacks.
+    The game loops handle all pending events at once before each tick, with
+    runs of mouse moves merged into one ALLEGRO_EVENT_MOUSE_AXES event (dx, dy,
+    dz and dw are summed). Callbacks are called for every event after the input
+    state has been updated, in the order they were added. Timer events are
+    used by the game loops and not passed on.
+ */
+typedef void (*EventCallback)(const ALLEGRO_EVENT *event, void *data);
+
+// Adds a callback for an event type and returns an id to remove it with.
+int add_event_callback(ALLEGRO_EVENT_TYPE type, EventCallback callback, void *data);
+
+// Removes a callback, callbacks may remove themselves.
+void remove_event_callback(int id);
+
+/*
+    Posts a user event from any thread, e.g. when a worker finished loading
+    or a network message came in. Posted events go through a lock free queue
+    and are passed to the callbacks on the main thread at the start of the
+    next tick, in the order they were posted.
+
+    type: a user event type, see ALLEGRO_GET_EVENT_TYPE
+    Returns false if the queue is full (POSTED_EVENT_QUEUE_SIZE events).
+ */
+#define POSTED_EVENT_QUEUE_SIZE 1024
+
+bool post_user_event(ALLEGRO_EVENT_TYPE type, intptr_t data1, intptr_t data2, intptr_t data3, intptr_t data4);
+
 //==============================================================================
 // MATH
 //==============================================================================
@@ -183,31 +808,159 @@ int wait_for_keypress();
 
 bool is_float_equal(float a, float b);
 bool is_double_equal(double a, double b);
-int lerpi(int a, int b, int alpha);
+
+// Linear interpolation, alpha is between [0, 1]. lerpi() rounds to the nearest integer.
+int lerpi(int a, int b, float alpha);
 float lerpf(float a, float b, float alpha);
 double lerpd(double a, double b, double alpha);
 
-//==============================================================================
-// RANDOM
-//==============================================================================
-
-// Returns a random integer between [min, max].
-int get_random_int(int min, int max);
-
-// Returns a random float between [min, max].
-float get_random_float(float min, float max);
+/*
+    Fast approximations.
+    Use these where speed matters more than the last digits, e.g. steering
+    and AI running over many units. The max errors are given for all inputs.
+ */
 
-// Returns true if the random number is one in [chance].
-bool one_in(int chance);
+// Returns atan2(y, x) in radians, off by at most 3e-6 radians.
+float fast_atan2(float y, float x);
 
-// Returns the result of rolling dice with a number of sides.
-int roll_dice(int number, int sides);
+// Returns sin(x) and cos(x), off by at most 2e-7 for |x| < 1000.
+float fast_sin(float x);
+float fast_cos(float x);
 
-//==============================================================================
-// COLLISION
-//==============================================================================
+// Returns 1 / sqrt(x) with a relative error of at most 3e-7, x must be > 0.
+float fast_rsqrt(float x);
 
-// A point/vector.
+// A 2D vector, has the same layout as Point.
+typedef struct {
+    float x, y;
+} Vec2;
+
+// A 4D vector, e.g. a color or a pair of 2D vectors.
+typedef struct {
+    float x, y, z, w;
+} Vec4;
+
+Vec2 vec2(float x, float y);
+Vec2 vec2_add(Vec2 a, Vec2 b);
+Vec2 vec2_sub(Vec2 a, Vec2 b);
+Vec2 vec2_scale(Vec2 v, float s);
+float vec2_dot(Vec2 a, Vec2 b);
+float vec2_length(Vec2 v);
+float vec2_length_squared(Vec2 v);
+float vec2_distance(Vec2 a, Vec2 b);
+
+// Use to compare distances, it doesn't take the square root.
+float vec2_distance_squared(Vec2 a, Vec2 b);
+
+// Returns the vector with a length of 1, or (0, 0) for a zero vector.
+Vec2 vec2_normalize(Vec2 v);
+Vec2 vec2_lerp(Vec2 a, Vec2 b, float alpha);
+
+// Returns the angle of the vector in radians, using fast_atan2().
+float vec2_angle(Vec2 v);
+
+Vec4 vec4(float x, float y, float z, float w);
+Vec4 vec4_add(Vec4 a, Vec4 b);
+Vec4 vec4_sub(Vec4 a, Vec4 b);
+Vec4 vec4_scale(Vec4 v, float s);
+float vec4_dot(Vec4 a, Vec4 b);
+float vec4_length(Vec4 v);
+Vec4 vec4_normalize(Vec4 v);
+Vec4 vec4_lerp(Vec4 a, Vec4 b, float alpha);
+
+/*
+    Batch variants of the vector functions.
+    These process n vectors at a time, 4-8 at once depending on
+    get_simd_level(), and give the same results as the functions above.
+    out may be the same array as an input.
+ */
+void vec2_dot_batch(const Vec2 *a, const Vec2 *b, float *out, int n);
+void vec2_length_batch(const Vec2 *v, float *out, int n);
+void vec2_normalize_batch(const Vec2 *v, Vec2 *out, int n);
+void vec2_lerp_batch(const Vec2 *a, const Vec2 *b, float alpha, Vec2 *out, int n);
+
+// Squared distances from p to each vector, e.g. to find the nearest unit.
+void vec2_distance_squared_batch(Vec2 p, const Vec2 *v, float *out, int n);
+
+void vec4_dot_batch(const Vec4 *a, const Vec4 *b, float *out, int n);
+void vec4_normalize_batch(const Vec4 *v, Vec4 *out, int n);
+void vec4_lerp_batch(const Vec4 *a, const Vec4 *b, float alpha, Vec4 *out, int n);
+
+//==============================================================================
+// RANDOM
+//==============================================================================
+
+/*
+    Random number generators.
+    The functions below without a generator argument use a generator owned by
+    the calling thread, so threads never share state. Every thread gets its own
+    stream; streams started from the same seed never overlap.
+ */
+
+// Random number engines.
+enum {
+    RANDOM_XOSHIRO256,  // xoshiro256**, the default
+    RANDOM_PCG32        // pcg32, smaller state
+};
+
+typedef struct {
+    int engine;
+    uint64_t state[4];
+} RandomGenerator;
+
+/*
+    Seeds a generator.
+    engine: RANDOM_XOSHIRO256 or RANDOM_PCG32
+    stream: generators with the same seed but different streams are independent
+ */
+void seed_random_generator(RandomGenerator *rng, int engine, uint64_t seed, uint64_t stream);
+
+// Returns 32 random bits.
+uint32_t random_next(RandomGenerator *rng);
+
+// Returns a random integer between [min, max], without modulo bias.
+int random_int(RandomGenerator *rng, int min, int max);
+
+// Returns a random float between [min, max).
+float random_float(RandomGenerator *rng, float min, float max);
+
+// Fills a buffer with n random integers between [min, max].
+void random_fill_ints(RandomGenerator *rng, int *out, int n, int min, int max);
+
+// Fills a buffer with n random floats between [min, max).
+void random_fill_floats(RandomGenerator *rng, float *out, int n, float min, float max);
+
+/*
+    Seeds the generators of all threads, init_framework() seeds with the time.
+    The calling thread uses stream 0 and job threads use their index. Other
+    threads are given the next free stream on first use unless they call
+    set_random_stream(), these start at 64 and are never reused.
+ */
+void seed_random(uint64_t seed);
+
+// Reseeds the generator of the calling thread to use a specific stream.
+void set_random_stream(uint64_t stream);
+
+// Returns the generator of the calling thread.
+RandomGenerator* get_random_generator();
+
+// Returns a random integer between [min, max].
+int get_random_int(int min, int max);
+
+// Returns a random float between [min, max).
+float get_random_float(float min, float max);
+
+// Returns true if the random number is one in [chance].
+bool one_in(int chance);
+
+// Returns the result of rolling dice with a number of sides.
+int roll_dice(int number, int sides);
+
+//==============================================================================
+// COLLISION
+//==============================================================================
+
+// A point/vector.
 typedef struct {
     float x, y;
 } Point;
@@ -235,6 +988,9 @@ float angle_between_points(float x1, float y1, float x2, float y2);
 // Returns the distance between two points.
 float distance_between_points(float x1, float y1, float x2, float y2);
 
+// Returns the squared distance between two points, faster when comparing distances.
+float distance_squared_between_points(float x1, float y1, float x2, float y2);
+
 // Returns true if two rectangles overlap.
 bool rectangles_intersect(float l1, float t1, float r1, float b1, float l2, float t2, float r2, float b2);
 
@@ -250,11 +1006,656 @@ bool circle_contains_point(float x1, float y1, float r, float x2, float y2);
 // Variants of the functions using the structs defined above.
 float angle_between_points_ex(Point p1, Point p2);
 float distance_between_points_ex(Point p1, Point p2);
+float distance_squared_between_points_ex(Point p1, Point p2);
 bool rectangles_intersect_ex(Rectangle r1, Rectangle r2);
 bool rectangle_contains_point_ex(Rectangle r, Point p);
 bool circles_intersect_ex(Circle c1, Circle c2);
 bool circle_contains_point_ex(Circle c, Point p);
 
+/*
+    Batch variants of the collision functions.
+    These test one shape against n shapes stored as separate arrays (structure
+    of arrays), 4-8 shapes at a time depending on get_simd_level().
+
+    out_mask: receives one bit per shape, shape i is bit (i % 32) of out_mask[i / 32],
+              must hold at least BATCH_MASK_SIZE(n) words
+    Returns the number of hits.
+ */
+#define BATCH_MASK_SIZE(n) (((n) + 31) / 32)
+
+int rectangles_intersect_batch(Rectangle r, const float *x, const float *y, const float *w, const float *h, int n, uint32_t *out_mask);
+int rectangle_contains_points_batch(Rectangle r, const float *x, const float *y, int n, uint32_t *out_mask);
+int circles_intersect_batch(Circle c, const float *x, const float *y, const float *r, int n, uint32_t *out_mask);
+int circle_contains_points_batch(Circle c, const float *x, const float *y, int n, uint32_t *out_mask);
+
+/*
+    Converts a batch result mask into a list of indices.
+    out_indices must hold as many ints as there are hits.
+    Returns the number of indices written.
+ */
+int batch_mask_to_indices(const uint32_t *mask, int n, int *out_indices);
+
+//==============================================================================
+// BROADPHASE
+//==============================================================================
+
+/*
+    A uniform grid used to find potentially colliding objects without testing
+    every object against every other object.
+
+    Objects are added with broadphase_insert() which returns an id. Moving or
+    removing objects marks the grid dirty, it is rebuilt the next time it is
+    queried (or with broadphase_rebuild()). Memory is kept between rebuilds, so
+    once the grid has grown to fit the scene it does not allocate anymore.
+ */
+typedef struct Broadphase Broadphase;
+
+// A pair of ids of objects whose bounds overlap.
+typedef struct {
+    int a, b;
+} BroadphasePair;
+
+/*
+    Creates a grid covering the window.
+    Objects outside the window are put in the border cells.
+
+    cell_size: width and height of a cell, ideally a bit larger than a typical object
+ */
+Broadphase* create_broadphase(float cell_size);
+
+// Destroys a grid created with create_broadphase().
+void destroy_broadphase(Broadphase *broadphase);
+
+// Adds an object and returns its id.
+int broadphase_insert(Broadphase *broadphase, Rectangle bounds);
+int broadphase_insert_circle(Broadphase *broadphase, Circle circle);
+
+// Removes an object, its id may be reused by a later insert.
+void broadphase_remove(Broadphase *broadphase, int id);
+
+// Updates the bounds of an object.
+void broadphase_move(Broadphase *broadphase, int id, Rectangle bounds);
+void broadphase_move_circle(Broadphase *broadphase, int id, Circle circle);
+
+// Removes all objects.
+void broadphase_clear(Broadphase *broadphase);
+
+// Sorts all objects into the grid cells.
+void broadphase_rebuild(Broadphase *broadphase);
+
+/*
+    Finds all pairs of objects whose bounds overlap, each pair is reported once.
+    pairs: receives a pointer to the pairs, valid until the grid is changed
+    Returns the number of pairs.
+ */
+int broadphase_find_pairs(Broadphase *broadphase, const BroadphasePair **pairs);
+
+/*
+    Finds all objects whose bounds overlap an area.
+    out_ids: receives at most max_ids ids
+    Returns the number of ids written.
+ */
+int broadphase_query(Broadphase *broadphase, Rectangle area, int *out_ids, int max_ids);
+
+//==============================================================================
+// AABB TREE
+//==============================================================================
+
+/*
+    A dynamic bounding volume hierarchy, suited for many static level tiles
+    mixed with a smaller number of moving actors.
+
+    Dynamic objects are stored with bounds enlarged by a margin, so small moves
+    only update the object itself. Bigger moves reinsert the object and refit
+    the nodes above it. Nodes live in one pool and queries never allocate.
+ */
+typedef struct AabbTree AabbTree;
+
+/*
+    Called for every object found by a query.
+    Return false to stop the query.
+ */
+typedef bool (*AabbTreeQueryProc)(int id, void *data);
+
+/*
+    Called for every object hit by a ray.
+    fraction: where along the ray the object was hit, from 0 (start) to 1 (end)
+    Return 0 to stop, the fraction to only look for closer hits or 1 to continue.
+ */
+typedef float (*AabbTreeRaycastProc)(int id, float fraction, void *data);
+
+/*
+    Creates an empty tree.
+    margin: how far dynamic objects can move before they are reinserted
+ */
+AabbTree* create_aabb_tree(float margin);
+
+// Destroys a tree created with create_aabb_tree().
+void destroy_aabb_tree(AabbTree *tree);
+
+/*
+    Adds an object and returns its id.
+    is_static: static objects get no margin since they are not expected to move
+ */
+int aabb_tree_insert(AabbTree *tree, Rectangle bounds, bool is_static);
+
+// Removes an object, its id may be reused by a later insert.
+void aabb_tree_remove(AabbTree *tree, int id);
+
+/*
+    Updates the bounds of an object.
+    Returns true if the object had to be reinserted.
+ */
+bool aabb_tree_move(AabbTree *tree, int id, Rectangle bounds);
+
+// Returns the bounds of an object.
+Rectangle aabb_tree_get_bounds(AabbTree *tree, int id);
+
+// Returns the height of the tree, mainly used for debugging purposes.
+int aabb_tree_get_height(AabbTree *tree);
+
+// Finds the objects containing a point, overlapping a rectangle or overlapping a circle.
+void aabb_tree_query_point(AabbTree *tree, float x, float y, AabbTreeQueryProc callback, void *data);
+void aabb_tree_query_rectangle(AabbTree *tree, Rectangle area, AabbTreeQueryProc callback, void *data);
+void aabb_tree_query_circle(AabbTree *tree, Circle area, AabbTreeQueryProc callback, void *data);
+
+// Finds the objects hit by a ray going from (x1, y1) to (x2, y2).
+void aabb_tree_raycast(AabbTree *tree, float x1, float y1, float x2, float y2, AabbTreeRaycastProc callback, void *data);
+
+//==============================================================================
+// TILEMAP
+//==============================================================================
+
+/*
+    A grid of tiles in several layers, drawn from a tileset bitmap.
+    Tile 0 is empty, tile t is the t-th tile of the tileset counting from the
+    top left, row by row (the way Tiled numbers them in CSV exports).
+
+    The map is split into chunks of TILEMAP_CHUNK_SIZE x TILEMAP_CHUNK_SIZE
+    tiles. The static layers of a chunk are drawn once into a cached bitmap,
+    which is redrawn only after one of its tiles has changed. Drawing only
+    touches the chunks in view, so it costs about the same for any map size.
+ */
+typedef struct Tilemap Tilemap;
+
+#define TILEMAP_CHUNK_SIZE 16
+#define MAX_TILEMAP_LAYERS 8
+
+// Creates an empty map, the tileset is not owned by the map.
+Tilemap* create_tilemap(int width, int height, int num_layers, ALLEGRO_BITMAP *tileset, int tile_width, int tile_height);
+
+/*
+    Loads a map saved with save_tilemap() or a CSV file with one row of tiles
+    per line and an empty line between layers. The flip flags of Tiled's CSV
+    export are ignored. Returns NULL if the file could not be loaded or has
+    tiles that are negative or above 65535.
+ */
+Tilemap* load_tilemap(const char *filename, ALLEGRO_BITMAP *tileset, int tile_width, int tile_height);
+
+// Saves a map in the compact binary format.
+bool save_tilemap(Tilemap *map, const char *filename);
+
+void destroy_tilemap(Tilemap *map);
+
+// Returns the tile at (x, y) in tiles, 0 outside of the map.
+int get_tile(Tilemap *map, int layer, int x, int y);
+
+// Changes a tile, the cached chunk is redrawn before it is drawn next.
+void set_tile(Tilemap *map, int layer, int x, int y, int tile);
+
+/*
+    Layers are static by default. Dynamic layers are not cached, their tiles
+    are drawn every frame on top of the static layers, use them for tiles
+    that change all the time.
+ */
+void set_tilemap_layer_dynamic(Tilemap *map, int layer, bool is_dynamic);
+
+/*
+    Draws the map with its top left corner at (x, y).
+    view: the area of the target bitmap to fill, usually the window, or
+          get_camera_bounds() when drawing through a camera
+ */
+void draw_tilemap(Tilemap *map, float x, float y, Rectangle view);
+
+// Sets the layer whose non empty tiles are solid. Default is 0.
+void set_tilemap_collision_layer(Tilemap *map, int layer);
+
+// Returns true if a rectangle in map pixel coordinates overlaps a solid tile.
+bool tilemap_rectangle_collides(Tilemap *map, Rectangle r);
+
+/*
+    Finds the solid tiles overlapping an area in map pixel coordinates.
+    out_tiles: receives the bounds of at most max_tiles tiles
+    Returns the number of tiles written.
+ */
+int tilemap_query_rectangle(Tilemap *map, Rectangle area, Rectangle *out_tiles, int max_tiles);
+
+//==============================================================================
+// CAMERA
+//==============================================================================
+
+/*
+    A 2D camera looking at (x, y) in the world, drawn into a viewport of the
+    target bitmap. Several cameras with different viewports make split screen:
+
+    Camera left = { player1.x, player1.y, 1, 0, { 0, 0, 320, 480 } };
+    begin_camera(&left);
+    draw_tilemap(map, 0, 0, get_camera_bounds(&left));
+    ...
+    end_camera();
+
+    The game loops reset the camera at the start of every frame.
+ */
+typedef struct {
+    float x, y;             // the world position at the center of the viewport
+    float zoom;             // scale of the world, 2 draws everything twice as big
+    float rotation;         // in radians, the world turns by this around the center
+    Rectangle viewport;     // the area of the target bitmap to draw into, in pixels
+} Camera;
+
+/*
+    Draws through a camera until end_camera(): flushes the sprites queued so
+    far, then uses the camera's transform and clips drawing to its viewport.
+ */
+void begin_camera(const Camera *camera);
+
+// Flushes the sprites queued with the camera and goes back to drawing in pixels of the whole target.
+void end_camera();
+
+// Returns the transform from world to target coordinates.
+void get_camera_transform(const Camera *camera, ALLEGRO_TRANSFORM *out);
+
+// Returns the area of the world in view, the bounding box of it if the camera is rotated.
+Rectangle get_camera_bounds(const Camera *camera);
+
+// Converts between world and target coordinates, e.g. to find what is under the mouse.
+Point world_to_screen(const Camera *camera, float x, float y);
+Point screen_to_world(const Camera *camera, float x, float y);
+
+/*
+    Culling.
+    Tests shapes against the bounds of the camera passed to begin_camera(),
+    or the window when there is none, so only what is in view gets drawn.
+    These still look at every shape, in large worlds query a broadphase or
+    AABB tree with get_camera_bounds() so the cost depends on what is in view.
+ */
+bool is_rectangle_visible(Rectangle r);
+bool is_circle_visible(Circle c);
+
+// Writes the indices of the visible shapes, out_indices must hold n ints. Returns the number written.
+int cull_rectangles(const Rectangle *rectangles, int n, int *out_indices);
+int cull_circles(const Circle *circles, int n, int *out_indices);
+
+// Batch variants, see rectangles_intersect_batch(). Returns the number of visible shapes.
+int cull_rectangles_batch(const float *x, const float *y, const float *w, const float *h, int n, uint32_t *out_mask);
+int cull_circles_batch(const float *x, const float *y, const float *r, int n, uint32_t *out_mask);
+
+//==============================================================================
+// PATHFINDING
+//==============================================================================
+
+/*
+    Pathfinding on a grid of walkable and blocked cells.
+    Units move to the 8 neighboring cells, diagonal moves cost sqrt(2) and are
+    not allowed past the corner of a blocked cell.
+
+    Single units use find_path() with A* or jump point search (JPS), which is
+    much faster on open maps as it skips over straight runs of cells. Many
+    units with the same goal share a flow field instead: it stores the best
+    direction towards the goal for every cell. Flow fields are cached by goal
+    and repaired around changed cells rather than recomputed.
+ */
+typedef struct PathGrid PathGrid;
+
+// A cell of a grid.
+typedef struct {
+    int x, y;
+} GridCell;
+
+// Search algorithms.
+enum { PATH_ASTAR, PATH_JPS };
+
+// States of a path request.
+enum { PATH_PENDING, PATH_FOUND, PATH_NOT_FOUND };
+
+// Max number of flow fields cached by a grid, the least recently used is dropped.
+#define MAX_FLOW_FIELDS 16
+
+// Creates a grid with all cells walkable.
+PathGrid* create_path_grid(int width, int height);
+
+// Creates a grid with a cell per tile, solid tiles (see set_tilemap_collision_layer) are blocked.
+PathGrid* create_path_grid_from_tilemap(Tilemap *map);
+
+void destroy_path_grid(PathGrid *grid);
+
+// Blocks or unblocks a cell, cached flow fields are repaired.
+void set_path_blocked(PathGrid *grid, int x, int y, bool is_blocked);
+
+// Returns true if a cell is blocked or outside of the grid.
+bool is_path_blocked(PathGrid *grid, int x, int y);
+
+/*
+    Finds a shortest path.
+    out_cells: receives the first max_cells cells, from start to goal. With
+               PATH_JPS only the cells where the path turns are returned,
+               the cells in between lie on straight or diagonal lines.
+    Returns the number of cells in the path, or -1 if there is none.
+ */
+int find_path(PathGrid *grid, int start_x, int start_y, int goal_x, int goal_y, int algorithm, GridCell *out_cells, int max_cells);
+
+/*
+    Time sliced path finding.
+    Requests are worked on in order by update_path_requests(), which stops
+    after max_expansions search steps, so long searches are spread over
+    several ticks. Destroy requests when done with them.
+ */
+typedef struct PathRequest PathRequest;
+
+PathRequest* request_path(PathGrid *grid, int start_x, int start_y, int goal_x, int goal_y, int algorithm);
+void destroy_path_request(PathGrid *grid, PathRequest *request);
+
+// Continues the pending requests, call it from update_proc().
+void update_path_requests(PathGrid *grid, int max_expansions);
+
+// Returns PATH_PENDING, PATH_FOUND or PATH_NOT_FOUND.
+int get_path_request_state(PathRequest *request);
+
+// Returns the cells of a found path and its length, see find_path().
+int get_path_request_cells(PathRequest *request, const GridCell **cells);
+
+/*
+    Returns the direction to move in from (x, y) to get to the goal, each of
+    dx and dy being -1, 0 or 1. It is (0, 0) at the goal and if the goal can't
+    be reached. The flow field of the goal is computed on first use.
+ */
+GridCell get_flow_direction(PathGrid *grid, int goal_x, int goal_y, int x, int y);
+
+// Returns the length of the shortest path from (x, y) to the goal, or -1 if there is none.
+float get_flow_distance(PathGrid *grid, int goal_x, int goal_y, int x, int y);
+
+//==============================================================================
+// ENTITIES
+//==============================================================================
+
+/*
+    Entity component storage.
+    Entities with the same set of components (an archetype) are stored
+    together in chunks of ENTITY_CHUNK_SIZE, each component in its own cache
+    aligned array. Queries visit the chunks of every archetype that has the
+    requested components, so loops run over dense arrays like the batch
+    functions do.
+
+    Entities are handles that include a generation, so a handle to a destroyed
+    entity never refers to a later entity reusing the slot. Pointers to
+    components are only valid until entities are created, destroyed or change
+    components, don't do that while iterating a query.
+ */
+typedef struct World World;
+
+// An entity handle, NULL_ENTITY is never a valid entity.
+typedef uint64_t Entity;
+#define NULL_ENTITY 0
+
+#define MAX_COMPONENTS 64
+#define ENTITY_CHUNK_SIZE 256
+
+// Component sets are bitmasks of component ids.
+#define COMPONENT_BIT(component) ((uint64_t)1 << (component))
+
+// Components every world has, used by the built-in systems.
+enum {
+    COMPONENT_RECTANGLE,    // Rectangle
+    COMPONENT_VELOCITY,     // Velocity
+    NUM_BUILTIN_COMPONENTS
+};
+
+World* create_world();
+void destroy_world(World *world);
+
+// Registers a component of size bytes and returns its id.
+int world_register_component(World *world, int size);
+
+// Creates an entity with a set of components, all zeroed.
+Entity world_create_entity(World *world, uint64_t components);
+
+// Destroys an entity, does nothing if it is already destroyed.
+void world_destroy_entity(World *world, Entity entity);
+
+// Returns true if the entity has not been destroyed.
+bool world_is_alive(World *world, Entity entity);
+
+// Returns the number of entities alive.
+int world_get_entity_count(World *world);
+
+// Returns a component of an entity, or NULL if the entity doesn't have it.
+void* world_get_component(World *world, Entity entity, int component);
+
+// Adds a zeroed component to an entity (if it doesn't have it) and returns it.
+void* world_add_component(World *world, Entity entity, int component);
+
+// Removes a component from an entity.
+void world_remove_component(World *world, Entity entity, int component);
+
+/*
+    Iterates over the chunks of all entities that have all of the components
+    in all and none of the components in none:
+
+    WorldQuery query = world_query(world, COMPONENT_BIT(COMPONENT_RECTANGLE), 0);
+    while (world_query_next(&query)) {
+        Rectangle *r = world_query_components(&query, COMPONENT_RECTANGLE);
+        for (int i = 0; i < query.count; i++) {
+            ...
+        }
+    }
+ */
+typedef struct {
+    World *world;
+    uint64_t all, none;
+    int archetype, chunk;
+    int count;                  // entities in the current chunk
+    const Entity *entities;     // handles of the entities in the current chunk
+} WorldQuery;
+
+WorldQuery world_query(World *world, uint64_t all, uint64_t none);
+bool world_query_next(WorldQuery *query);
+
+// Returns the array of a component in the current chunk, the component must be in all.
+void* world_query_components(WorldQuery *query, int component);
+
+// Adds Velocity to Rectangle for every entity that has both.
+void world_integrate_velocities(World *world);
+
+// Keeps entities with Rectangle and Velocity within bounds, reversing their velocity when they hit an edge.
+void world_bounce_off_bounds(World *world, Rectangle bounds);
+
+//==============================================================================
+// SNAPSHOTS
+//==============================================================================
+
+/*
+    Snapshots of the game state for quick saves and rollback.
+    Game code registers the memory its state lives in once, taking a snapshot
+    copies every region into one versioned blob in a single pass and
+    restoring copies it back. Keep the state in plain data without pointers
+    to memory outside the registered regions, and register the random
+    generator too if the game uses it:
+
+    add_snapshot_region(&game, sizeof(game));
+    add_snapshot_region(get_random_generator(), sizeof(RandomGenerator));
+
+    The blob is in native byte order, snapshots saved to file only load in a
+    build with the same regions (checked by a hash of the layout).
+ */
+typedef struct Snapshot Snapshot;
+
+#define SNAPSHOT_VERSION 1
+
+// Registers size bytes at data, returns an id to remove it with.
+int add_snapshot_region(void *data, size_t size);
+
+/*
+    Registers the memory allocated from an arena.
+    Restoring sets the arena back to what was allocated when the snapshot was
+    taken and frees blocks chained since. The arena must be warmed up to a
+    single block when a snapshot is taken, and restoring fails if it has been
+    reset into a new block since, as pointers into the old one are stale.
+ */
+int add_snapshot_arena(Arena *arena);
+
+void remove_snapshot_region(int id);
+
+// Creates an empty snapshot, its memory is reused by every take_snapshot().
+Snapshot* create_snapshot();
+void destroy_snapshot(Snapshot *snapshot);
+
+// Copies the registered regions into the snapshot, returns false if an arena can't be saved.
+bool take_snapshot(Snapshot *snapshot);
+
+// Copies the snapshot back into the registered regions, returns false if the layout doesn't match.
+bool restore_snapshot(const Snapshot *snapshot);
+
+// The tick the snapshot was taken at, see get_tick_count().
+int get_snapshot_tick(const Snapshot *snapshot);
+
+// The blob, e.g. to hash or send it.
+const void* get_snapshot_data(const Snapshot *snapshot);
+size_t get_snapshot_size(const Snapshot *snapshot);
+
+// Writes the snapshot to a file through a memory mapping.
+bool save_snapshot(const Snapshot *snapshot, const char *filename);
+
+// Reads a snapshot file into snapshot.
+bool load_snapshot(Snapshot *snapshot, const char *filename);
+
+// Restores straight from a memory mapped snapshot file without reading it into a snapshot first.
+bool restore_snapshot_file(const char *filename);
+
+/*
+    Delta compression against an earlier snapshot, e.g. the previous tick.
+    The snapshot is XORed with the base in 8 byte words and runs of unchanged
+    words are skipped, so a tick that only touched a few values compresses to
+    a few bytes.
+
+    out must hold at least get_snapshot_delta_bound() bytes.
+    Returns the size of the delta.
+ */
+size_t get_snapshot_delta_bound(const Snapshot *snapshot);
+size_t encode_snapshot_delta(const Snapshot *snapshot, const Snapshot *base, void *out);
+
+/*
+    Rebuilds a snapshot from a delta and the same base. Returns false and
+    leaves it empty if the delta is broken or describes a snapshot larger than
+    the registered regions could be restored from.
+ */
+bool decode_snapshot_delta(Snapshot *snapshot, const Snapshot *base, const void *delta, size_t size);
+
+/*
+    A ring of snapshots of the last ticks for rollback.
+    Record one at the start of every tick, so the snapshot of a tick is the
+    state the tick starts from, and roll back to any of the last capacity
+    ticks when a late input arrives.
+ */
+typedef struct SnapshotHistory SnapshotHistory;
+
+#define DEFAULT_ROLLBACK_TICKS 8
+
+SnapshotHistory* create_snapshot_history(int capacity);
+void destroy_snapshot_history(SnapshotHistory *history);
+
+// Takes a snapshot of the current tick, replacing the oldest one.
+bool record_snapshot(SnapshotHistory *history);
+
+// Returns the snapshot taken at tick or NULL if it's not in the history anymore.
+Snapshot* get_history_snapshot(SnapshotHistory *history, int tick);
+
+/*
+    Restores the snapshot taken at tick and drops the snapshots after it,
+    they get recorded again while re-simulating. Returns false if tick is not
+    in the history.
+ */
+bool rollback_snapshot(SnapshotHistory *history, int tick);
+
+// Hashes the state in a snapshot, e.g. to compare it with another machine.
+uint64_t get_snapshot_hash(const Snapshot *snapshot);
+
+//==============================================================================
+// ROLLBACK
+//==============================================================================
+
+/*
+    Rollback simulation for lockstep multiplayer.
+    A session runs a step function over the registered snapshot state one
+    tick at a time, with the inputs of all players for that tick. Inputs of
+    remote players that haven't arrived yet are predicted by repeating their
+    last known input. When an input arrives that differs from the prediction,
+    the session restores the snapshot of that tick and re-simulates up to the
+    present before simulating the next tick.
+
+    The step function must be deterministic: it should only read and write
+    the registered state and get_player_input(). get_tick_count() returns the
+    tick being simulated while it runs.
+
+    The state is hashed at the start of every tick, and once the inputs
+    before a tick are confirmed its hash is compared with the peers' to
+    detect desyncs.
+ */
+typedef struct RollbackSession RollbackSession;
+
+#define MAX_ROLLBACK_PLAYERS 4
+#define MAX_ROLLBACK_TICKS 64
+
+// Statistics of a session.
+typedef struct {
+    int tick;                       // the next tick to simulate
+    int confirmed_tick;             // the last tick with the inputs of all players, -1 if none
+    int num_rollbacks;
+    int resimulated_ticks;          // ticks simulated again after rollbacks
+    int longest_rollback;           // most ticks re-simulated at once
+    int stalled_ticks;              // advances that waited for remote input instead
+    double resimulation_time;       // seconds spent restoring and re-simulating
+    double resimulated_ticks_per_second;
+    int desync_tick;                // first tick that started from a different state than a peer's, -1 if none
+} RollbackStats;
+
+/*
+    Creates a session for the local player, the current state is the start
+    of tick 0.
+
+    max_rollback_ticks: how many ticks the session may run ahead of the
+                        remote inputs before it stalls, at most MAX_ROLLBACK_TICKS
+ */
+RollbackSession* create_rollback_session(int num_players, int local_player, int max_rollback_ticks);
+void destroy_rollback_session(RollbackSession *session);
+
+/*
+    Simulates the next tick with the local player's input, after rolling back
+    and re-simulating if mispredicted inputs arrived. Call it from update_proc().
+    Returns false if the session stalled waiting for remote input, or because
+    its state couldn't be snapshotted (see add_snapshot_arena()), try again
+    with the same input next tick.
+ */
+bool advance_rollback_session(RollbackSession *session, uint32_t local_input, void (*step_proc)());
+
+// Returns the input of a player for the tick being simulated, only valid in step_proc().
+uint32_t get_player_input(int player);
+
+// Adds the input of a remote player for a tick, e.g. from a network message.
+void add_remote_input(RollbackSession *session, int player, int tick, uint32_t input);
+
+// Adds the state hash of a peer at the start of a tick.
+void add_remote_state_hash(RollbackSession *session, int tick, uint64_t hash);
+
+/*
+    Connects two sessions in the same process as a stand in for the network.
+    The local inputs and state hashes of each reach the other latency_ticks
+    calls of advance_rollback_session() later, stalled or not. Sessions
+    advanced in turn swap their state in and out of the registered regions.
+ */
+void connect_loopback_sessions(RollbackSession *a, RollbackSession *b, int latency_ticks);
+
+RollbackStats get_rollback_stats(RollbackSession *session);
+
 //==============================================================================
 
 #ifdef __cplusplus
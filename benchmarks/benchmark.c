@@ -0,0 +1,662 @@
+/*
+    Benchmarks for the hot paths of the framework.
+
+    usage: allegro_framework_benchmark [--quick] [--filter text] [--output file]
+                                       [--baseline file] [--threshold percent]
+
+    Every benchmark runs a batch of operations a number of times and reports
+    the time per operation of the fastest, median and mean run. Results are
+    written as JSON, one benchmark per line. With --baseline the medians are
+    compared against an earlier run, and the exit code is 1 if any benchmark
+    got slower by more than the threshold (10% by default).
+ */
+#include "allegro_framework.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_REPETITIONS 15
+#define NUM_SHAPES 4096
+#define MAX_BENCHMARKS 64
+
+typedef struct {
+    const char *name;
+    void (*run)(int num_ops);   // does num_ops operations
+    int num_ops;                // operations per repetition
+} Benchmark;
+
+typedef struct {
+    const char *name;
+    int num_ops;
+    int repetitions;
+    double min_ns, median_ns, mean_ns;
+} BenchmarkResult;
+
+// Results are added to this, so the compiler can't drop the work.
+static volatile float sink;
+
+static RandomGenerator rng;
+static Rectangle rectangles[NUM_SHAPES];
+static Circle circles[NUM_SHAPES];
+static Point points[NUM_SHAPES];
+static float xs[NUM_SHAPES], ys[NUM_SHAPES], ws[NUM_SHAPES], hs[NUM_SHAPES], rs[NUM_SHAPES];
+static uint32_t mask[BATCH_MASK_SIZE(NUM_SHAPES)];
+
+static void create_shapes()
+{
+    seed_random_generator(&rng, RANDOM_XOSHIRO256, 1, 0);
+    for (int i = 0; i < NUM_SHAPES; i++) {
+        rectangles[i] = (Rectangle){ random_float(&rng, 0, 1000), random_float(&rng, 0, 1000), random_float(&rng, 5, 50), random_float(&rng, 5, 50) };
+        circles[i] = (Circle){ rectangles[i].x, rectangles[i].y, rectangles[i].w };
+        points[i] = (Point){ random_float(&rng, 0, 1000), random_float(&rng, 0, 1000) };
+        xs[i] = rectangles[i].x;
+        ys[i] = rectangles[i].y;
+        ws[i] = rectangles[i].w;
+        hs[i] = rectangles[i].h;
+        rs[i] = circles[i].r;
+    }
+}
+
+// Index of the second shape of pair i, so pairs don't repeat within NUM_SHAPES ops.
+#define OTHER(i) (((i) * 7 + 1) & (NUM_SHAPES - 1))
+#define SHAPE(i) ((i) & (NUM_SHAPES - 1))
+
+static void run_rectangles_intersect(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        Rectangle a = rectangles[SHAPE(i)], b = rectangles[OTHER(i)];
+        hits += rectangles_intersect(a.x, a.y, a.x + a.w, a.y + a.h, b.x, b.y, b.x + b.w, b.y + b.h);
+    }
+    sink += hits;
+}
+
+static void run_rectangles_intersect_ex(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        hits += rectangles_intersect_ex(rectangles[SHAPE(i)], rectangles[OTHER(i)]);
+    }
+    sink += hits;
+}
+
+static void run_rectangle_contains_point(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        hits += rectangle_contains_point_ex(rectangles[SHAPE(i)], points[OTHER(i)]);
+    }
+    sink += hits;
+}
+
+static void run_circles_intersect(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        Circle a = circles[SHAPE(i)], b = circles[OTHER(i)];
+        hits += circles_intersect(a.x, a.y, a.r, b.x, b.y, b.r);
+    }
+    sink += hits;
+}
+
+static void run_circles_intersect_ex(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        hits += circles_intersect_ex(circles[SHAPE(i)], circles[OTHER(i)]);
+    }
+    sink += hits;
+}
+
+static void run_circle_contains_point(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        hits += circle_contains_point_ex(circles[SHAPE(i)], points[OTHER(i)]);
+    }
+    sink += hits;
+}
+
+static void run_distance_between_points(int num_ops)
+{
+    float sum = 0;
+    for (int i = 0; i < num_ops; i++) {
+        sum += distance_between_points_ex(points[SHAPE(i)], points[OTHER(i)]);
+    }
+    sink += sum;
+}
+
+static void run_distance_squared_between_points(int num_ops)
+{
+    float sum = 0;
+    for (int i = 0; i < num_ops; i++) {
+        sum += distance_squared_between_points_ex(points[SHAPE(i)], points[OTHER(i)]);
+    }
+    sink += sum;
+}
+
+static void run_angle_between_points(int num_ops)
+{
+    float sum = 0;
+    for (int i = 0; i < num_ops; i++) {
+        sum += angle_between_points_ex(points[SHAPE(i)], points[OTHER(i)]);
+    }
+    sink += sum;
+}
+
+// The batch benchmarks count one op per shape tested.
+static void run_rectangles_intersect_batch(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i += NUM_SHAPES) {
+        hits += rectangles_intersect_batch(rectangles[SHAPE(i / NUM_SHAPES)], xs, ys, ws, hs, NUM_SHAPES, mask);
+    }
+    sink += hits;
+}
+
+static void run_circles_intersect_batch(int num_ops)
+{
+    int hits = 0;
+    for (int i = 0; i < num_ops; i += NUM_SHAPES) {
+        hits += circles_intersect_batch(circles[SHAPE(i / NUM_SHAPES)], xs, ys, rs, NUM_SHAPES, mask);
+    }
+    sink += hits;
+}
+
+static int visible_indices[NUM_SHAPES];
+
+// Culls the shapes against the window, which sees about a third of them. One op is one shape.
+static void run_cull_rectangles(int num_ops)
+{
+    int visible = 0;
+    for (int i = 0; i < num_ops; i += NUM_SHAPES) {
+        visible += cull_rectangles(rectangles, NUM_SHAPES, visible_indices);
+    }
+    sink += visible;
+}
+
+static void run_cull_circles_batch(int num_ops)
+{
+    int visible = 0;
+    for (int i = 0; i < num_ops; i += NUM_SHAPES) {
+        visible += cull_circles_batch(xs, ys, rs, NUM_SHAPES, mask);
+    }
+    sink += visible;
+}
+
+static void run_random_next_xoshiro256(int num_ops)
+{
+    RandomGenerator generator;
+    seed_random_generator(&generator, RANDOM_XOSHIRO256, 1, 0);
+    uint32_t bits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        bits ^= random_next(&generator);
+    }
+    sink += bits;
+}
+
+static void run_random_next_pcg32(int num_ops)
+{
+    RandomGenerator generator;
+    seed_random_generator(&generator, RANDOM_PCG32, 1, 0);
+    uint32_t bits = 0;
+    for (int i = 0; i < num_ops; i++) {
+        bits ^= random_next(&generator);
+    }
+    sink += bits;
+}
+
+static void run_get_random_int(int num_ops)
+{
+    int sum = 0;
+    for (int i = 0; i < num_ops; i++) {
+        sum += get_random_int(-100, 100);
+    }
+    sink += sum;
+}
+
+static void run_get_random_float(int num_ops)
+{
+    float sum = 0;
+    for (int i = 0; i < num_ops; i++) {
+        sum += get_random_float(0, 1);
+    }
+    sink += sum;
+}
+
+static float random_floats[NUM_SHAPES];
+
+static void run_random_fill_floats(int num_ops)
+{
+    for (int i = 0; i < num_ops; i += NUM_SHAPES) {
+        random_fill_floats(get_random_generator(), random_floats, NUM_SHAPES, 0, 1);
+    }
+    sink += random_floats[0];
+}
+
+static void run_write_logfile(int num_ops)
+{
+    // flushing in batches smaller than the queue, so no message is dropped
+    for (int i = 0; i < num_ops; i++) {
+        write_logfile(LOG_MESSAGE, "benchmark message %d with a float %f", i, i * 0.5);
+        if (i % 1024 == 1023) {
+            flush_logfile();
+        }
+    }
+    flush_logfile();
+}
+
+static void update_nothing()
+{
+}
+
+static void run_empty_ticks(int num_ops)
+{
+    set_headless_tick_limit(num_ops);
+    run_game_loop(update_nothing, update_nothing);
+}
+
+#define EVENTS_PER_TICK 16
+static InputEvent *input_events;
+
+static void update_input()
+{
+    int keycodes[ALLEGRO_KEY_MAX];
+    int count = get_pressed_keys(keycodes, ALLEGRO_KEY_MAX) + get_released_keys(keycodes, ALLEGRO_KEY_MAX);
+    for (int key = 1; key < ALLEGRO_KEY_MAX; key++) {
+        count += is_key_down(key) + is_key_pressed(key);
+    }
+    sink += count + get_mouse_dx();
+}
+
+// Every tick presses or releases a few keys and moves the mouse, the state is cleared after each tick.
+static void run_input_ticks(int num_ops)
+{
+    input_events = realloc(input_events, num_ops * EVENTS_PER_TICK * sizeof(InputEvent));
+    int first_tick = get_tick_count();
+    for (int i = 0; i < num_ops * EVENTS_PER_TICK; i++) {
+        InputEvent *event = &input_events[i];
+        event->tick = first_tick + i / EVENTS_PER_TICK;
+        event->code = 1 + (i * 13) % (ALLEGRO_KEY_MAX - 1);
+        event->type = (i / EVENTS_PER_TICK) % 2 ? ALLEGRO_EVENT_KEY_UP : ALLEGRO_EVENT_KEY_DOWN;
+        event->x = event->y = 0;
+        if (i % EVENTS_PER_TICK == 0) {
+            event->type = ALLEGRO_EVENT_MOUSE_AXES;
+            event->x = i % 640;
+            event->y = i % 480;
+        }
+    }
+
+    play_input_events(input_events, num_ops * EVENTS_PER_TICK);
+    set_headless_tick_limit(num_ops);
+    run_game_loop(update_input, update_nothing);
+    play_input_events(NULL, 0);
+}
+
+#define NUM_ENTITIES 10000
+static World *world;
+
+static void update_entities()
+{
+    world_integrate_velocities(world);
+    world_bounce_off_bounds(world, (Rectangle){ 0, 0, 640, 480 });
+}
+
+static void run_entity_ticks(int num_ops)
+{
+    if (!world) {
+        world = create_world();
+        for (int i = 0; i < NUM_ENTITIES; i++) {
+            Entity entity = world_create_entity(world, COMPONENT_BIT(COMPONENT_RECTANGLE) | COMPONENT_BIT(COMPONENT_VELOCITY));
+            Rectangle *r = world_get_component(world, entity, COMPONENT_RECTANGLE);
+            Velocity *v = world_get_component(world, entity, COMPONENT_VELOCITY);
+            *r = (Rectangle){ random_float(&rng, 0, 600), random_float(&rng, 0, 440), 16, 16 };
+            *v = (Velocity){ random_float(&rng, -3, 3), random_float(&rng, -3, 3) };
+        }
+    }
+
+    set_headless_tick_limit(num_ops);
+    run_game_loop(update_entities, update_nothing);
+}
+
+#define NUM_PARTICLES 20000
+static ParticleEmitter *emitter;
+
+// Particles live 60 ticks, so emitting a 60th of the pool each tick keeps it about full.
+static void update_particle_emitter()
+{
+    emit_particles(emitter, NUM_PARTICLES / 60, 320, 240, 0.5f, 3, 60, al_map_rgb(255, 128, 0));
+    update_particles(emitter);
+}
+
+static void run_particle_ticks(int num_ops)
+{
+    if (!emitter) {
+        emitter = create_particle_emitter(NUM_PARTICLES);
+        set_particle_gravity(emitter, 0, 0.05f);
+    }
+
+    set_headless_tick_limit(num_ops);
+    run_game_loop(update_particle_emitter, update_nothing);
+}
+
+#define NUM_BODIES 2000
+static Broadphase *broadphase;
+static int body_ids[NUM_BODIES];
+static Rectangle bodies[NUM_BODIES];
+static Velocity body_velocities[NUM_BODIES];
+
+// Moves bodies around the window (the area covered by the grid) and finds the overlapping pairs, like a physics step.
+static void update_bodies()
+{
+    for (int i = 0; i < NUM_BODIES; i++) {
+        Rectangle *r = &bodies[i];
+        Velocity *v = &body_velocities[i];
+        r->x += v->dx;
+        r->y += v->dy;
+        if (r->x < 0 || r->x + r->w > get_window_width()) v->dx = -v->dx;
+        if (r->y < 0 || r->y + r->h > get_window_height()) v->dy = -v->dy;
+        broadphase_move(broadphase, body_ids[i], *r);
+    }
+
+    const BroadphasePair *pairs;
+    int num_pairs = broadphase_find_pairs(broadphase, &pairs);
+    int hits = 0;
+    for (int i = 0; i < num_pairs; i++) {
+        hits += rectangles_intersect_ex(bodies[pairs[i].a], bodies[pairs[i].b]);
+    }
+    sink += hits;
+}
+
+static void run_broadphase_ticks(int num_ops)
+{
+    if (!broadphase) {
+        broadphase = create_broadphase(32);
+        for (int i = 0; i < NUM_BODIES; i++) {
+            bodies[i] = (Rectangle){ random_float(&rng, 0, get_window_width() - 16), random_float(&rng, 0, get_window_height() - 16), 8, 8 };
+            body_velocities[i] = (Velocity){ random_float(&rng, -2, 2), random_float(&rng, -2, 2) };
+            body_ids[i] = broadphase_insert(broadphase, bodies[i]);
+        }
+    }
+
+    set_headless_tick_limit(num_ops);
+    run_game_loop(update_bodies, update_nothing);
+}
+
+#define SNAPSHOT_STATE_SIZE (64 * 1024)
+static float snapshot_state[SNAPSHOT_STATE_SIZE / sizeof(float)];
+static SnapshotHistory *snapshot_history;
+static Snapshot *snapshots[2];
+static uint8_t *snapshot_delta;
+
+// 64 KB of game state with a few values changed per tick, recorded for 8 frame rollback.
+static void create_snapshot_state()
+{
+    if (snapshot_history) {
+        return;
+    }
+
+    random_fill_floats(&rng, snapshot_state, SNAPSHOT_STATE_SIZE / sizeof(float), -1000, 1000);
+    add_snapshot_region(snapshot_state, sizeof(snapshot_state));
+    snapshot_history = create_snapshot_history(DEFAULT_ROLLBACK_TICKS);
+    for (int i = 0; i < 2; i++) {
+        snapshots[i] = create_snapshot();
+        snapshot_state[i * 64] += 1;
+        take_snapshot(snapshots[i]);
+    }
+    snapshot_delta = malloc(get_snapshot_delta_bound(snapshots[1]));
+}
+
+static void run_record_snapshot(int num_ops)
+{
+    create_snapshot_state();
+    for (int i = 0; i < num_ops; i++) {
+        snapshot_state[i % 64 * 256] += 1;
+        record_snapshot(snapshot_history);
+    }
+}
+
+static void run_restore_snapshot(int num_ops)
+{
+    create_snapshot_state();
+    for (int i = 0; i < num_ops; i++) {
+        restore_snapshot(snapshots[i & 1]);
+    }
+    sink += snapshot_state[0];
+}
+
+static void run_encode_snapshot_delta(int num_ops)
+{
+    create_snapshot_state();
+    size_t size = 0;
+    for (int i = 0; i < num_ops; i++) {
+        size += encode_snapshot_delta(snapshots[1], snapshots[0], snapshot_delta);
+    }
+    sink += size;
+}
+
+#define ROLLBACK_LATENCY 4
+static RollbackSession *rollback_sessions[2];
+static uint32_t rollback_inputs[2];
+
+// Each player moves one of the snapshot state values, so most remote inputs are mispredicted for a few ticks.
+static void step_snapshot_state()
+{
+    for (int i = 0; i < 2; i++) {
+        snapshot_state[i * 1024 + get_tick_count() % 1024] += get_player_input(i);
+    }
+}
+
+// Two loopback peers ROLLBACK_LATENCY ticks apart, one op advances both.
+static void run_rollback_ticks(int num_ops)
+{
+    create_snapshot_state();
+    if (!rollback_sessions[0]) {
+        for (int i = 0; i < 2; i++) {
+            rollback_sessions[i] = create_rollback_session(2, i, DEFAULT_ROLLBACK_TICKS);
+        }
+        connect_loopback_sessions(rollback_sessions[0], rollback_sessions[1], ROLLBACK_LATENCY);
+    }
+
+    for (int i = 0; i < num_ops; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (random_int(&rng, 0, 7) == 0) {
+                rollback_inputs[j] = random_next(&rng) & 0xff;
+            }
+            advance_rollback_session(rollback_sessions[j], rollback_inputs[j], step_snapshot_state);
+        }
+    }
+}
+
+static const Benchmark benchmarks[] = {
+    { "collision/rectangles_intersect", run_rectangles_intersect, 1 << 22 },
+    { "collision/rectangles_intersect_ex", run_rectangles_intersect_ex, 1 << 22 },
+    { "collision/rectangle_contains_point_ex", run_rectangle_contains_point, 1 << 22 },
+    { "collision/circles_intersect", run_circles_intersect, 1 << 22 },
+    { "collision/circles_intersect_ex", run_circles_intersect_ex, 1 << 22 },
+    { "collision/circle_contains_point_ex", run_circle_contains_point, 1 << 22 },
+    { "collision/distance_between_points", run_distance_between_points, 1 << 22 },
+    { "collision/distance_squared_between_points", run_distance_squared_between_points, 1 << 22 },
+    { "collision/angle_between_points", run_angle_between_points, 1 << 20 },
+    { "collision/rectangles_intersect_batch", run_rectangles_intersect_batch, 1 << 22 },
+    { "collision/circles_intersect_batch", run_circles_intersect_batch, 1 << 22 },
+    { "camera/cull_rectangles", run_cull_rectangles, 1 << 22 },
+    { "camera/cull_circles_batch", run_cull_circles_batch, 1 << 22 },
+    { "random/random_next_xoshiro256", run_random_next_xoshiro256, 1 << 22 },
+    { "random/random_next_pcg32", run_random_next_pcg32, 1 << 22 },
+    { "random/get_random_int", run_get_random_int, 1 << 22 },
+    { "random/get_random_float", run_get_random_float, 1 << 22 },
+    { "random/random_fill_floats", run_random_fill_floats, 1 << 22 },
+    { "input/playback_tick", run_input_ticks, 1 << 12 },
+    { "log/write_logfile", run_write_logfile, 1 << 14 },
+    { "snapshot/record_snapshot", run_record_snapshot, 1 << 12 },
+    { "snapshot/restore_snapshot", run_restore_snapshot, 1 << 12 },
+    { "snapshot/encode_snapshot_delta", run_encode_snapshot_delta, 1 << 12 },
+    { "rollback/loopback_tick", run_rollback_ticks, 1 << 10 },
+    { "loop/empty_tick", run_empty_ticks, 1 << 16 },
+    { "loop/entities_tick", run_entity_ticks, 1 << 9 },
+    { "loop/particles_tick", run_particle_ticks, 1 << 9 },
+    { "loop/broadphase_tick", run_broadphase_ticks, 1 << 8 },
+};
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static BenchmarkResult run_benchmark(const Benchmark *benchmark, int repetitions, int divisor)
+{
+    int num_ops = benchmark->num_ops / divisor > 0 ? benchmark->num_ops / divisor : 1;
+    double times[MAX_REPETITIONS];
+
+    // warm up caches and lazily created state
+    benchmark->run(num_ops);
+
+    for (int i = 0; i < repetitions; i++) {
+        double start = al_get_time();
+        benchmark->run(num_ops);
+        times[i] = (al_get_time() - start) * 1e9 / num_ops;
+    }
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+
+    BenchmarkResult result = { benchmark->name, num_ops, repetitions, times[0], times[repetitions / 2], 0 };
+    for (int i = 0; i < repetitions; i++) {
+        result.mean_ns += times[i] / repetitions;
+    }
+    return result;
+}
+
+static void write_results(FILE *file, const BenchmarkResult *results, int num_results, bool is_quick)
+{
+    static const char *simd_names[] = { "none", "sse2", "avx2" };
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"version\": 1,\n");
+    fprintf(file, "  \"simd_level\": \"%s\",\n", simd_names[get_simd_level()]);
+    fprintf(file, "  \"quick\": %s,\n", is_quick ? "true" : "false");
+    fprintf(file, "  \"benchmarks\": [\n");
+    for (int i = 0; i < num_results; i++) {
+        const BenchmarkResult *r = &results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"ops\": %d, \"repetitions\": %d, \"min_ns\": %.3f, \"median_ns\": %.3f, \"mean_ns\": %.3f}%s\n",
+                r->name, r->num_ops, r->repetitions, r->min_ns, r->median_ns, r->mean_ns, i + 1 < num_results ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+// Reads the median of a benchmark from a file written by write_results(). Returns false if it's not there.
+static bool read_baseline_median(const char *filename, const char *name, double *out_median)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file) {
+        return false;
+    }
+
+    char line[512], key[160];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    bool is_found = false;
+    while (!is_found && fgets(line, sizeof(line), file)) {
+        const char *median = strstr(line, "\"median_ns\": ");
+        if (strstr(line, key) && median) {
+            is_found = sscanf(median + strlen("\"median_ns\": "), "%lf", out_median) == 1;
+        }
+    }
+
+    fclose(file);
+    return is_found;
+}
+
+// Prints how much every benchmark changed and returns the number that got slower than allowed.
+static int compare_with_baseline(const char *filename, const BenchmarkResult *results, int num_results, double threshold)
+{
+    int num_regressions = 0;
+    fprintf(stderr, "\n%-45s %12s %12s %8s\n", "benchmark", "baseline ns", "ns", "change");
+    for (int i = 0; i < num_results; i++) {
+        double baseline;
+        if (!read_baseline_median(filename, results[i].name, &baseline) || baseline <= 0) {
+            fprintf(stderr, "%-45s %12s %12.3f\n", results[i].name, "-", results[i].median_ns);
+            continue;
+        }
+
+        double change = (results[i].median_ns / baseline - 1) * 100;
+        bool is_regression = change > threshold;
+        num_regressions += is_regression;
+        fprintf(stderr, "%-45s %12.3f %12.3f %+7.1f%%%s\n", results[i].name, baseline, results[i].median_ns, change, is_regression ? "  SLOWER" : "");
+    }
+    return num_regressions;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filter = NULL, *output = NULL, *baseline = NULL;
+    double threshold = 10;
+    bool is_quick = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            is_quick = true;
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        }
+        else {
+            fprintf(stderr, "usage: %s [--quick] [--filter text] [--output file] [--baseline file] [--threshold percent]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    init_framework_headless(640, 480, false);
+    create_shapes();
+
+    BenchmarkResult results[MAX_BENCHMARKS];
+    int num_results = 0;
+    for (int i = 0; i < (int)lengthof(benchmarks); i++) {
+        if (filter && !strstr(benchmarks[i].name, filter)) {
+            continue;
+        }
+
+        results[num_results] = run_benchmark(&benchmarks[i], is_quick ? 3 : MAX_REPETITIONS, is_quick ? 64 : 1);
+        fprintf(stderr, "%-45s %10.3f ns/op\n", results[num_results].name, results[num_results].median_ns);
+        num_results++;
+    }
+
+    FILE *file = output ? fopen(output, "w") : stdout;
+    if (!file) {
+        fprintf(stderr, "Failed to open %s\n", output);
+        return 2;
+    }
+    write_results(file, results, num_results, is_quick);
+    if (output) {
+        fclose(file);
+    }
+
+    int num_regressions = baseline ? compare_with_baseline(baseline, results, num_results, threshold) : 0;
+
+    // rollback cost is dominated by re-simulation, so report how fast that ran
+    if (rollback_sessions[0]) {
+        RollbackStats stats = get_rollback_stats(rollback_sessions[0]);
+        fprintf(stderr, "rollback: %d rollbacks, %d ticks re-simulated at %.0f ticks/s\n",
+                stats.num_rollbacks, stats.resimulated_ticks, stats.resimulated_ticks_per_second);
+    }
+
+    destroy_particle_emitter(emitter);
+    destroy_broadphase(broadphase);
+    destroy_world(world);
+    free(input_events);
+    for (int i = 0; i < 2; i++) {
+        destroy_rollback_session(rollback_sessions[i]);
+        destroy_snapshot(snapshots[i]);
+    }
+    destroy_snapshot_history(snapshot_history);
+    free(snapshot_delta);
+    return num_regressions > 0;
+}
@@ -0,0 +1,116 @@
+/*
+    Regression tests for snapshots: broken or hostile deltas, which may come
+    off the network, must be rejected without writing out of bounds, and
+    rollback sessions must cope with state that can't be snapshotted.
+ */
+#include "allegro_framework.h"
+#include <stdio.h>
+#include <string.h>
+
+static int num_failures = 0;
+
+#define CHECK(condition) do { if (!(condition)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); num_failures++; } } while (0)
+
+static float state[256];
+static Arena *arena;
+
+static uint8_t* write_varint(uint8_t *out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+// Writes the header of a delta against base, see encode_snapshot_delta().
+static uint8_t* write_header(uint8_t *out, uint64_t num_words, const Snapshot *base)
+{
+    memcpy(out, "SDLT", 4);
+    out = write_varint(out + 4, num_words);
+    out = write_varint(out, get_snapshot_size(base) / 8);
+    return write_varint(out, (uint32_t)get_snapshot_tick(base));
+}
+
+// Outgrows the arena's only block, so the next snapshot of it fails.
+static void grow_arena()
+{
+    arena_alloc(arena, 4096);
+}
+
+int main()
+{
+    init_framework_headless(640, 480, false);
+    add_snapshot_region(state, sizeof(state));
+
+    Snapshot *base = create_snapshot();
+    Snapshot *snapshot = create_snapshot();
+    Snapshot *decoded = create_snapshot();
+    take_snapshot(base);
+    state[3] = 1;
+    state[200] = 2;
+    take_snapshot(snapshot);
+
+    static uint8_t delta[4096];
+    size_t size = encode_snapshot_delta(snapshot, base, delta);
+    CHECK(size <= get_snapshot_delta_bound(snapshot));
+    CHECK(decode_snapshot_delta(decoded, base, delta, size));
+    CHECK(get_snapshot_size(decoded) == get_snapshot_size(snapshot));
+    CHECK(memcmp(get_snapshot_data(decoded), get_snapshot_data(snapshot), get_snapshot_size(snapshot)) == 0);
+
+    // every truncation is rejected and leaves the snapshot empty
+    for (size_t i = 0; i < size; i++) {
+        CHECK(!decode_snapshot_delta(decoded, base, delta, i));
+        CHECK(get_snapshot_size(decoded) == 0);
+    }
+
+    // runs whose sum wraps around to the word count: UINT64_MAX unchanged words, then two changed ones
+    uint8_t hostile[64];
+    uint8_t *p = write_header(hostile, 1, base);
+    p = write_varint(p, UINT64_MAX);
+    p = write_varint(p, 2);
+    for (int i = 0; i < 2; i++) {
+        *p++ = 0x01;
+        *p++ = 0xaa;
+    }
+    CHECK(!decode_snapshot_delta(decoded, base, hostile, p - hostile));
+
+    // the same header with runs that add up is fine, so the runs are what got rejected above
+    p = write_header(hostile, 1, base);
+    p = write_varint(p, 0);
+    p = write_varint(p, 1);
+    *p++ = 0x01;
+    *p++ = 0xaa;
+    CHECK(decode_snapshot_delta(decoded, base, hostile, p - hostile));
+    CHECK(get_snapshot_size(decoded) == 8);
+
+    // word counts that would wrap the capacity around or can be allocated but are absurd,
+    // each with a run covering all of them so only the size is wrong
+    uint64_t word_counts[] = { ((uint64_t)1 << 61) - 1, (uint64_t)1 << 40, get_snapshot_size(base) / 8 };
+    for (int i = 0; i < 3; i++) {
+        p = write_header(hostile, word_counts[i], base);
+        p = write_varint(p, word_counts[i]);
+        p = write_varint(p, 0);
+        CHECK(decode_snapshot_delta(decoded, base, hostile, p - hostile) == (i == 2));
+    }
+
+    destroy_snapshot(base);
+    destroy_snapshot(snapshot);
+    destroy_snapshot(decoded);
+
+    // a rollback session stalls instead of crashing when its state can't be snapshotted
+    arena = create_arena(1024);
+    add_snapshot_arena(arena);
+    RollbackSession *session = create_rollback_session(1, 0, DEFAULT_ROLLBACK_TICKS);
+    CHECK(advance_rollback_session(session, 0, grow_arena));
+    CHECK(!advance_rollback_session(session, 0, grow_arena));
+    CHECK(get_rollback_stats(session).tick == 1);
+    destroy_rollback_session(session);
+    destroy_arena(arena);
+
+    if (num_failures == 0) {
+        printf("all snapshot tests passed\n");
+    }
+    return num_failures > 0;
+}